@@ -77,6 +77,8 @@ static void spiSend(const uint8_t* buf, size_t len, bool w);
 //static void usartSend(Usart *p, uint8_t b, bool w);
 static void usartSend(Usart *p, const uint8_t* buf, size_t len, bool w);
 static bool dmac_channel_transfer_done(uint32_t ul_num);
+static void dmac_channel_disable(uint32_t ul_num);
+static void dmac_channel_enable(uint32_t ul_num);
 
 #define CS 14
 // dmaspi   from SdFat lib
@@ -353,21 +355,89 @@ static bool dmac_channel_transfer_done(uint32_t ul_num);
 //----------------------------------------------------------------------------
     void showAll(LPD8806 &stripA, LPD8806 &stripB, LPD8806 &stripC) {
 //----------------------------------------------------------------------------
-  uint8_t  *ptrA = stripA.pixels;   // must be USART0
-  uint8_t  *ptrB = stripB.pixels;   // must be USART1
-  uint8_t  *ptrC = stripC.pixels;   // must be SPI
-  //int i = stripA.numBytes;     // all 
-  
   // This doesn't need to distinguish among individual pixel color
   // bytes vs. latch data, etc.  Everything is laid out in one big
   // flat buffer and issued the same regardless of purpose.
      //uint32_t mask = SPI_PCS(BOARD_PIN_TO_SPI_CHANNEL(BOARD_SPI_DEFAULT_SS)); 
      //uint32_t d = *ptrA++ | SPI_PCS(ch);
+  showAll(stripA.pixels, stripA.numBytes,   // must be USART0
+          stripB.pixels, stripB.numBytes,   // must be USART1
+          stripC.pixels, stripC.numBytes);  // must be SPI
+}
 
+// output of byte streams prepared elsewhere (e.g. columns rendered by GifDisplay)
+//----------------------------------------------------------------------------
+    void showAll(const uint8_t *ptrA, uint16_t countA,
+                 const uint8_t *ptrB, uint16_t countB,
+                 const uint8_t *ptrC, uint16_t countC) {
+//----------------------------------------------------------------------------
   // all three DMA transfers in parallel - don't wait for completion
-  usartSend(USART0, ptrA, stripA.numBytes, false);
-  usartSend(USART1, ptrB, stripB.numBytes, false);
-  spiSend(ptrC, stripC.numBytes, false);
+  usartSend(USART0, ptrA, countA, false);
+  usartSend(USART1, ptrB, countB, false);
+  spiSend(ptrC, countC, false);
+}
+
+// showAll() request waiting for the DMA transfers of the previous one (see showAllWhenReady);
+// ptrA != 0 marks a valid request
+static volatile struct {
+  const uint8_t *ptrA, *ptrB, *ptrC;
+  uint16_t countA, countB, countC;
+} showPending;
+
+static const uint32_t SHOW_CBTC = (DMAC_EBCIER_CBTC0 << SPI_DMAC_TX_CH) |
+                                  (DMAC_EBCIER_CBTC0 << USART0_DMAC_TX_CH) |
+                                  (DMAC_EBCIER_CBTC0 << USART1_DMAC_TX_CH);
+
+// true if all DMA transfers of the last showAll() are completed (does not wait)
+//----------------------------------------------------------------------------
+    bool showAllReady(void) {
+//----------------------------------------------------------------------------
+  return (DMAC->DMAC_CHSR & ((DMAC_CHSR_ENA0 << SPI_DMAC_TX_CH) |
+                             (DMAC_CHSR_ENA0 << USART0_DMAC_TX_CH) |
+                             (DMAC_CHSR_ENA0 << USART1_DMAC_TX_CH))) == 0;
+}
+
+// Non-blocking showAll() for interrupt routines: if the DMA transfers of the
+// previous showAll() are still running, the output is started by DMAC_Handler
+// when they are completed (a request still waiting is replaced).
+// Returns false in that case, i.e. if the previous output overran its slot.
+//----------------------------------------------------------------------------
+    bool showAllWhenReady(const uint8_t *ptrA, uint16_t countA,
+                          const uint8_t *ptrB, uint16_t countB,
+                          const uint8_t *ptrC, uint16_t countC) {
+//----------------------------------------------------------------------------
+  if (showAllReady()) {
+    showAll(ptrA, countA, ptrB, countB, ptrC, countC);
+    return true;
+  }
+  // DMAC_Handler may preempt the update: invalidate the request first and
+  // validate it with ptrA last, so that it never starts a half written one
+  showPending.ptrA = 0;
+  showPending.countA = countA;
+  showPending.ptrB = ptrB;  showPending.countB = countB;
+  showPending.ptrC = ptrC;  showPending.countC = countC;
+  showPending.ptrA = ptrA;
+  // completion flags are not cleared here, so a transfer which has just
+  // completed raises the interrupt immediately
+  DMAC->DMAC_EBCIER = SHOW_CBTC;
+  NVIC_EnableIRQ(DMAC_IRQn);
+  return false;
+}
+
+// DMAC interrupt: chained buffer transfer completed
+//----------------------------------------------------------------------------
+    void DMAC_Handler(void) {
+//----------------------------------------------------------------------------
+  uint32_t status = DMAC->DMAC_EBCISR;   // clears the flags
+
+  if (showPending.ptrA && showAllReady()) {
+    DMAC->DMAC_EBCIDR = SHOW_CBTC;
+    showAll(showPending.ptrA, showPending.countA,
+            showPending.ptrB, showPending.countB,
+            showPending.ptrC, showPending.countC);
+    showPending.ptrA = 0;
+  }
+  (void) status;
 }
 
 // wait until all DMA transfers are completed
@@ -383,6 +453,102 @@ static bool dmac_channel_transfer_done(uint32_t ul_num);
 }
 
 
+// MCK cycles per byte of an output channel of showAll()
+//----------------------------------------------------------------------------
+    uint32_t showByteCycles(int channel) {
+//----------------------------------------------------------------------------
+  uint32_t div;
+
+  switch (channel) {
+    case SHOW_USART0: div = (USART0->US_BRGR & US_BRGR_CD_Msk) >> US_BRGR_CD_Pos; break;
+    case SHOW_USART1: div = (USART1->US_BRGR & US_BRGR_CD_Msk) >> US_BRGR_CD_Pos; break;
+    default:          div = (SPI0->SPI_CSR[SPI_CHIP_SEL] & SPI_CSR_SCBR_Msk) >> SPI_CSR_SCBR_Pos; break;
+  }
+  return 8 * (div ? div : 1);
+}
+
+// Linked list output: descriptors 2*i and 2*i+1 of a channel send 'pad' zero
+// bytes (the LPD8806 takes them as latch bytes) followed by 'count' bytes from
+// 'src'. The zero bytes delay the buffer to its time slot, so the byte clock
+// of the channel paces the buffers without CPU intervention. The list is a
+// ring of n columns: column n-1 continues with column 0 unless it is the last.
+//----------------------------------------------------------------------------
+    void chainSetColumn(DmacDescriptor *lld, int n, int channel, int i,
+                        const uint8_t *src, uint16_t count, uint16_t pad, bool last) {
+//----------------------------------------------------------------------------
+  static const uint8_t zero = 0;
+  uint32_t daddr;
+
+  switch (channel) {
+    case SHOW_USART0: daddr = (uint32_t)(uintptr_t)&USART0->US_THR; break;
+    case SHOW_USART1: daddr = (uint32_t)(uintptr_t)&USART1->US_THR; break;
+    default:          daddr = (uint32_t)(uintptr_t)&SPI0->SPI_TDR;  break;
+  }
+  DmacDescriptor *next = i + 1 < n ? lld + 2*i + 2 : lld;
+
+  lld += 2*i;
+  lld[0].saddr = (uint32_t)(uintptr_t)&zero;
+  lld[0].daddr = daddr;
+  lld[0].ctrla = (pad ? pad : 1) | DMAC_CTRLA_SRC_WIDTH_BYTE | DMAC_CTRLA_DST_WIDTH_BYTE;
+  lld[0].ctrlb = DMAC_CTRLB_FC_MEM2PER_DMA_FC |
+    DMAC_CTRLB_SRC_INCR_FIXED | DMAC_CTRLB_DST_INCR_FIXED;
+  lld[0].dscr  = (uint32_t)(uintptr_t)&lld[1];
+
+  lld[1].saddr = (uint32_t)(uintptr_t)src;
+  lld[1].daddr = daddr;
+  lld[1].ctrla = count | DMAC_CTRLA_SRC_WIDTH_BYTE | DMAC_CTRLA_DST_WIDTH_BYTE;
+  lld[1].ctrlb = DMAC_CTRLB_FC_MEM2PER_DMA_FC |
+    DMAC_CTRLB_SRC_INCR_INCREMENTING | DMAC_CTRLB_DST_INCR_FIXED;
+  lld[1].dscr  = last ? 0 : (uint32_t)(uintptr_t)next;
+}
+
+// (re)start the linked lists of all three channels - a running list is aborted
+//----------------------------------------------------------------------------
+    void chainStart(DmacDescriptor *lldA, DmacDescriptor *lldB, DmacDescriptor *lldC) {
+//----------------------------------------------------------------------------
+  static const uint32_t ch[SHOW_CHANNELS]  = { USART0_DMAC_TX_CH, USART1_DMAC_TX_CH, SPI_DMAC_TX_CH };
+  static const uint32_t per[SHOW_CHANNELS] = { USART0_TX_IDX, USART1_TX_IDX, SPI_TX_IDX };
+  DmacDescriptor *lld[SHOW_CHANNELS] = { lldA, lldB, lldC };
+  int i;
+
+  for (i = 0; i < SHOW_CHANNELS; i++) {
+    dmac_channel_disable(ch[i]);
+    DMAC->DMAC_CH_NUM[ch[i]].DMAC_DSCR = (uint32_t)(uintptr_t)lld[i];
+    // descriptor fetch enabled for source and destination (SRC_DSCR = DST_DSCR = 0)
+    DMAC->DMAC_CH_NUM[ch[i]].DMAC_CTRLB = DMAC_CTRLB_FC_MEM2PER_DMA_FC;
+    DMAC->DMAC_CH_NUM[ch[i]].DMAC_CFG = DMAC_CFG_DST_PER(per[i]) |
+        DMAC_CFG_DST_H2SEL | DMAC_CFG_SOD | DMAC_CFG_FIFOCFG_ALAP_CFG;
+  }
+  for (i = 0; i < SHOW_CHANNELS; i++)
+    dmac_channel_enable(ch[i]);
+}
+
+// abort the linked lists of all three channels
+//----------------------------------------------------------------------------
+    void chainStop(void) {
+//----------------------------------------------------------------------------
+  dmac_channel_disable(USART0_DMAC_TX_CH);
+  dmac_channel_disable(USART1_DMAC_TX_CH);
+  dmac_channel_disable(SPI_DMAC_TX_CH);
+}
+
+// Column of the ring lld (n columns, see chainSetColumn) that the channel is
+// outputting: the DSCR register holds the descriptor following the current one.
+// Returns -1 if no further descriptor will be fetched (list ended or in its last one).
+//----------------------------------------------------------------------------
+    int chainColumn(const DmacDescriptor *lld, int n, int channel) {
+//----------------------------------------------------------------------------
+  static const uint32_t ch[SHOW_CHANNELS] = { USART0_DMAC_TX_CH, USART1_DMAC_TX_CH, SPI_DMAC_TX_CH };
+  uint32_t next;
+  int i;
+
+  if ((DMAC->DMAC_CHSR & (DMAC_CHSR_ENA0 << ch[channel])) == 0) return -1;
+  next = DMAC->DMAC_CH_NUM[ch[channel]].DMAC_DSCR;
+  if (next == 0) return -1;
+  i = (int) ((next - (uint32_t)(uintptr_t)lld) / sizeof(DmacDescriptor));
+  return (i + 2*n - 1) % (2*n) / 2;
+}
+
 // Convert separate R,G,B into combined 32-bit GRB color:
 //------------------------------------------------------------------------------
   uint32_t LPD8806::Color(byte r, byte g, byte b) {
@@ -561,8 +727,8 @@ static bool dmac_channel_transfer_done(uint32_t ul_num);
     src_incr = DMAC_CTRLB_SRC_INCR_FIXED;
   }
   dmac_channel_disable(SPI_DMAC_TX_CH);
-  DMAC->DMAC_CH_NUM[SPI_DMAC_TX_CH].DMAC_SADDR = (uint32_t)src;
-  DMAC->DMAC_CH_NUM[SPI_DMAC_TX_CH].DMAC_DADDR = (uint32_t)&SPI0->SPI_TDR;
+  DMAC->DMAC_CH_NUM[SPI_DMAC_TX_CH].DMAC_SADDR = (uint32_t)(uintptr_t)src;
+  DMAC->DMAC_CH_NUM[SPI_DMAC_TX_CH].DMAC_DADDR = (uint32_t)(uintptr_t)&SPI0->SPI_TDR;
   DMAC->DMAC_CH_NUM[SPI_DMAC_TX_CH].DMAC_DSCR =  0;
   DMAC->DMAC_CH_NUM[SPI_DMAC_TX_CH].DMAC_CTRLA = count |
     DMAC_CTRLA_SRC_WIDTH_BYTE | DMAC_CTRLA_DST_WIDTH_BYTE;
@@ -611,8 +777,8 @@ static bool dmac_channel_transfer_done(uint32_t ul_num);
   }
   
   dmac_channel_disable(usart_dmac_ch);
-  DMAC->DMAC_CH_NUM[usart_dmac_ch].DMAC_SADDR = (uint32_t)src;
-  DMAC->DMAC_CH_NUM[usart_dmac_ch].DMAC_DADDR = (uint32_t)&pU->US_THR;
+  DMAC->DMAC_CH_NUM[usart_dmac_ch].DMAC_SADDR = (uint32_t)(uintptr_t)src;
+  DMAC->DMAC_CH_NUM[usart_dmac_ch].DMAC_DADDR = (uint32_t)(uintptr_t)&pU->US_THR;
   DMAC->DMAC_CH_NUM[usart_dmac_ch].DMAC_DSCR =  0;
   DMAC->DMAC_CH_NUM[usart_dmac_ch].DMAC_CTRLA = count |
     DMAC_CTRLA_SRC_WIDTH_BYTE | DMAC_CTRLA_DST_WIDTH_BYTE;
@@ -12,6 +12,14 @@ class LPD8806 {
   void begin(void);
   void setPixelColor(uint16_t n, uint8_t r, uint8_t g, uint8_t b);
   void setPixelColor(uint16_t n, uint32_t c);
+  inline void setPixelLED(uint16_t n, const volatile uint8_t *led) { // 3 bytes in strip format, bit 7 set
+    if(n < numLEDs) {
+      uint8_t *p = &pixels[n * 3];
+      p[0] = led[0];
+      p[1] = led[1];
+      p[2] = led[2];
+    }
+  }
   void show(void);
   void updatePins(uint8_t dpin, uint8_t cpin); // Change pins, configurable
   void updatePins(Usart *p);                   // Change pins, USART in SPI mode
@@ -40,4 +48,25 @@ class LPD8806 {
   enum { SPI_SW, SPI_SPI, SPI_USART, SPI_ALL } spiSelect;  
 };
 
+// DMAC linked list item (transfer descriptor), see SAM3X datasheet "Multi-buffer Transfers"
+typedef struct {
+  uint32_t saddr, daddr, ctrla, ctrlb, dscr;
+} DmacDescriptor;
+
+// output channels of showAll()
+enum { SHOW_USART0, SHOW_USART1, SHOW_SPI, SHOW_CHANNELS };
+
+void showAll(const uint8_t *ptrA, uint16_t countA,    // USART0
+             const uint8_t *ptrB, uint16_t countB,    // USART1
+             const uint8_t *ptrC, uint16_t countC);   // SPI
 void waitShowAllReady(void);
+bool showAllReady(void);
+bool showAllWhenReady(const uint8_t *ptrA, uint16_t countA,
+                      const uint8_t *ptrB, uint16_t countB,
+                      const uint8_t *ptrC, uint16_t countC);
+uint32_t showByteCycles(int channel);                 // MCK cycles per byte
+void chainSetColumn(DmacDescriptor *lld, int n, int channel, int i,
+                    const uint8_t *src, uint16_t count, uint16_t pad, bool last);
+void chainStart(DmacDescriptor *lldA, DmacDescriptor *lldB, DmacDescriptor *lldC);
+void chainStop(void);
+int chainColumn(const DmacDescriptor *lld, int n, int channel);   // column of the ring in output
@@ -0,0 +1,125 @@
+/*
+ *  Geometry of the POV cylinder
+ *
+ *  Screen size and mapping of the LED strips to the frame buffer. The frame
+ *  buffer, the rendered columns (GifDisplay::renderThisColumn) and the DMA output of
+ *  a column (mpc.ino) are generated from this description at compile time.
+ *  A different cylinder only needs a new stripGeometry table; the static
+ *  asserts below check that it covers every row exactly once.
+ */
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#ifndef XSIZE
+#define XSIZE 151     // columns per rotation
+#endif
+#ifndef YSIZE
+#define YSIZE  40     // rows
+#endif
+#ifndef STRIP_LEDS
+#define STRIP_LEDS 10 // LEDs per strip
+#endif
+
+// output channels in the order of their byte streams in a column
+#define CHANNEL_USART0  0
+#define CHANNEL_USART1  1
+#define CHANNEL_SPI     2
+#define CHANNELS        3
+
+// LED strip: column offset (for wheel=0), first row and row distance of its
+// LEDs, output channel. Strips of the same channel are chained in table order.
+struct StripGeometry {
+    int x;
+    int y;
+    int dy;
+    int channel;
+};
+
+constexpr StripGeometry stripGeometry[] = {
+    //  x   y  dy  channel
+    {   8,  0,  4, CHANNEL_USART0 },
+    {  12,  1,  4, CHANNEL_USART1 },
+    {   0,  2,  4, CHANNEL_SPI    },
+    {   4,  3,  4, CHANNEL_SPI    },
+};
+constexpr int STRIPS = sizeof(stripGeometry) / sizeof(stripGeometry[0]);
+
+// number of LEDs chained on a channel
+constexpr int channelLeds(int channel, int s = 0)
+{
+    return s == STRIPS ? 0 : (stripGeometry[s].channel == channel ? STRIP_LEDS : 0) + channelLeds(channel, s + 1);
+}
+
+// bytes of a channel in a column: 3 bytes per LED plus latch byte
+constexpr int channelBytes(int channel)
+{
+    return 3 * channelLeds(channel) + 1;
+}
+
+// offset of a channel's byte stream in a column
+constexpr int channelOffset(int channel)
+{
+    return channel == 0 ? 0 : channelOffset(channel - 1) + channelBytes(channel - 1);
+}
+
+// offset of the bytes of strip s in a column
+constexpr int stripOffset(int s, int i = 0)
+{
+    return i == s ? channelOffset(stripGeometry[s].channel)
+                  : (stripGeometry[i].channel == stripGeometry[s].channel ? 3 * STRIP_LEDS : 0) + stripOffset(s, i + 1);
+}
+
+// strip s is the last one of its channel and is followed by the latch byte
+constexpr bool stripLast(int s, int i = STRIPS - 1)
+{
+    return i == s ? true : stripGeometry[i].channel == stripGeometry[s].channel ? false : stripLast(s, i - 1);
+}
+
+constexpr int COLUMN_BYTES = channelOffset(CHANNELS);
+
+// strip s has an LED in row y
+constexpr bool stripShowsRow(int s, int y)
+{
+    return y >= stripGeometry[s].y && (y - stripGeometry[s].y) % stripGeometry[s].dy == 0
+           && (y - stripGeometry[s].y) / stripGeometry[s].dy < STRIP_LEDS;
+}
+
+// number of LEDs showing row y
+constexpr int rowLeds(int y, int s = 0)
+{
+    return s == STRIPS ? 0 : stripShowsRow(s, y) + rowLeds(y, s + 1);
+}
+
+// strip showing row y
+constexpr int rowStrip(int y, int s = 0)
+{
+    return s == STRIPS ? 0 : stripShowsRow(s, y) ? s : rowStrip(y, s + 1);
+}
+
+constexpr bool geometryValid(int s = 0, int y = 0)
+{
+    return s < STRIPS ? stripGeometry[s].x >= 0 && stripGeometry[s].x < XSIZE
+                        && stripGeometry[s].channel >= 0 && stripGeometry[s].channel < CHANNELS
+                        && stripGeometry[s].dy > 0 && geometryValid(s + 1, y)
+         : y < YSIZE ? rowLeds(y) == 1 && geometryValid(s, y + 1)
+         : true;
+}
+
+static_assert(geometryValid(), "stripGeometry must show every row with exactly one LED");
+static_assert(STRIPS * STRIP_LEDS == YSIZE, "stripGeometry has LEDs outside of the screen");
+
+// Frame buffer layout. With FRAME_STRIP_MAJOR the rows of each frame buffer column
+// are stored in the order the strips consume them (strip 0 LED 0..STRIP_LEDS-1,
+// strip 1 LED 0.., ...), so a strip reads STRIP_LEDS contiguous bytes per column.
+#ifndef FRAME_STRIP_MAJOR
+#define FRAME_STRIP_MAJOR 0
+#endif
+
+// frame buffer row of screen row y
+constexpr int frameRow(int y)
+{
+    return FRAME_STRIP_MAJOR ? rowStrip(y) * STRIP_LEDS + (y - stripGeometry[rowStrip(y)].y) / stripGeometry[rowStrip(y)].dy
+                             : y;
+}
+
+#endif
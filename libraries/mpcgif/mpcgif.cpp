@@ -16,15 +16,17 @@
 
 #include "mpcgif.h"
 #include "trace.h"
+#ifdef GIF_RAM_TARGET
+#include GIF_RAM_TARGET     // host build: sizes on the 32 bit target (see sim/Makefile)
+#endif
 
 /************************************************************************/
-/* Host simulation under CYGWIN                                         */
+/* Host simulation (see sim/ directory)                                 */
 /************************************************************************/
 #ifdef SIMULATION
-#   include <unistd.h>
 #   include "xwin.h"
 #   define delay(x)
-#   define btWriteString(x) printf(x)
+#   define btWriteString(x) fputs(x, stdout)
 #   define printInfo(x)
 #else
 #   include "Arduino.h"
@@ -64,57 +66,97 @@ void debug_print(const char *function, int line, const char *format, int value)
 	char text[80];
 	snprintf(text, 80, "\n\n%s!\nSYSTEM HALTED!\n", errmsg); 
 	btWriteString(text);
+#ifdef SIMULATION
+	exit(1);
+#endif
 	while (1);
 }
 
+//----------------------------------------------------------------------------------------
+  void GifDisplay::printRamBudget(void)  //!< prints the RAM used by each part of GifDisplay
+//----------------------------------------------------------------------------------------
+{
+	char text[80];
+	unsigned long total = sizeof(GifDisplay);
+	unsigned long pictures = 2*sizeof(GifPicture);
+	unsigned long decoder = sizeof(GifDecoder);
+	unsigned long maps = 2*sizeof(picture0.column_map);
+	unsigned long arena = 0, scaler = 0;
+#ifdef RAM_TARGET_DISPLAY
+	total = RAM_TARGET_DISPLAY;
+	pictures = 2*RAM_TARGET_PICTURE;
+	decoder = RAM_TARGET_DECODER;
+#endif
+#if FRAME_STRIP_MAJOR
+	maps += 2*sizeof(picture0.column_source);
+#endif
+	pictures -= maps;           // column maps are reported separately
+#if FRAME_STRIP_MAJOR
+	maps += sizeof(frame_row);
+#endif
+#if GIF_CACHE_SIZE > 0
+	arena = sizeof(cache_arena);
+#endif
+#if GIF_SCALE_MAXWIDTH > 0
+	scaler = sizeof(scale_line);
+#endif
+	snprintf(text, 80, "GifDisplay RAM: %lu bytes (budget %lu)\n", total, (unsigned long) GIF_RAM_BUDGET);
+	btWriteString(text);
+	snprintf(text, 80, "  picture buffers %6lu\n", pictures);
+	btWriteString(text);
+#if GIF_CACHE_SIZE > 0
+	snprintf(text, 80, "  cache arena     %6lu (GIF file, cache, frame queue, LZW decoder %lu)\n", arena, decoder);
+	decoder = 0;                // part of the arena
+#else
+	snprintf(text, 80, "  LZW decoder     %6lu\n", decoder);
+#endif
+	btWriteString(text);
+	snprintf(text, 80, "  scaler line     %6lu\n", scaler);
+	btWriteString(text);
+	snprintf(text, 80, "  column maps     %6lu\n", maps);
+	btWriteString(text);
+	snprintf(text, 80, "  other           %6lu\n", total - pictures - decoder - arena - scaler - maps);
+	btWriteString(text);
+}
+
 //----------------------------------------------------------------------------------------
   unsigned long GifDisplay::mem_read(void *ptr, unsigned long size, unsigned long count) {
 //----------------------------------------------------------------------------------------
-    unsigned char *p = (unsigned char *) ptr;
-    unsigned long i;
-    
-    for (i=0; i<count*size; i++) {
-        if (gifFileIndex >= gifFileDataLen) error("Error in mem_read");
-        *p++ = gifFileData[gifFileIndex++];
-    }
-    return i/size;
+    unsigned long n = count*size;
+
+    if (n > gifFileDataLen - gifFileIndex) error("Error in mem_read");
+    memcpy(ptr, gifFileData + gifFileIndex, n);
+    gifFileIndex += n;
+    return count;
 }
 
 //----------------------------------------------------------------------------------------
   int GifDisplay::mem_getc(void) {
 //----------------------------------------------------------------------------------------
-    unsigned char ch;
-    
-    mem_read(&ch, 1, 1);
-    return (int) ch;
+    if (gifFileIndex >= gifFileDataLen) error("Error in mem_read");
+    return gifFileData[gifFileIndex++];
 }
 
 
-//!< This functions is called by the ISR
+//!< This functions is called by the ISR once per rotation. now_ms is the display
+//!< time, derived from the index pulses (see schedule_next_picture).
 //----------------------------------------------------------------------------------------
-    void GifDisplay::nextPictureTick(void)
+    void GifDisplay::nextPictureTick(uint32_t now_ms)
 //----------------------------------------------------------------------------------------
 {
     volatile GifPicture *tmp;
     ++tickc;        
 	//trace.log('T', tickc);
-    if (thisPicture->delay_ms > 0) {
-        thisPicture->delay_ms -= ROTATION_PERIOD_MS;
-    }
+    tick_ms = now_ms - clock_ms;
+    clock_ms = now_ms;
 
-    if (thisPicture->delay_ms <= 0 && isNextPicturePending()) {    
+    if (isNextPictureDue(now_ms)) {
+        swap_ms = now_ms;
         thisPicture->is_pending = 0;
         tmp = thisPicture;
         thisPicture = nextPicture;
         nextPicture = tmp;
-#ifdef SIMULATION
-        if (thisPicture->has_cmap) {
-            xAllocateColorMap(thisPicture->cmap.length, (unsigned long *)thisPicture->cmap.colours);
-        } else {
-            xAllocateColorMap(gifScreen.cmap.length, gifScreen.cmap.colours);
-        }
-        xShowFrameBuffer(this);
-#endif        
+        picture_generation++;
     }
 }
 
@@ -124,8 +166,13 @@ void debug_print(const char *function, int line, const char *format, int value)
 //----------------------------------------------------------------------------------------
 {
 #ifdef SIMULATION
-        usleep(ROTATION_PERIOD_MS*1000);      // 50 ms corresponds to one rotation at 20Hz
-        nextPictureTick();
+        volatile GifPicture *shown = thisPicture;
+        xWaitRotation(this);      // one rotation (50 ms at 20Hz) - host decides how long it takes
+        nextPictureTick(clock_ms + ROTATION_PERIOD_MS);
+        if (thisPicture != shown) {     // host display, kept out of the ISR part
+            xAllocateColorMap(frame_palette(thisPicture)->length, frame_palette(thisPicture)->rgb);
+            xShowFrameBuffer(this);
+        }
 #endif 
 #if 0
         if (singleStepMode) {
@@ -137,79 +184,1062 @@ void debug_print(const char *function, int line, const char *format, int value)
 }
 
         
+/*
+ *  Dirty rectangles.
+ *
+ *  Each picture buffer keeps the bounding rectangle of the pixels written into
+ *  it since both buffers were last equal (dirty_*: frame buffer columns and
+ *  rows). Outside of the union of both rectangles the buffers are equal, so
+ *  sync_next_picture only copies this union from thisPicture into nextPicture.
+ */
+
+// Adds the rectangle (screen coordinates) to the dirty rectangle of pic.
+//----------------------------------------------------------------------------------------
+  void GifDisplay::mark_dirty(volatile GifFrame *pic, int left, int top, int width, int height)
+//----------------------------------------------------------------------------------------
+{
+#if FRAME_STRIP_MAJOR
+    top = 0;                    // rows of the rectangle are spread over the column
+    height = MAXROW;
+#endif
+    if (left < pic->dirty_left) pic->dirty_left = left;
+    if (left + width > pic->dirty_right) pic->dirty_right = left + width;
+    if (top < pic->dirty_top) pic->dirty_top = top;
+    if (top + height > pic->dirty_bottom) pic->dirty_bottom = top + height;
+}
+
+//----------------------------------------------------------------------------------------
+  void GifDisplay::clear_dirty(volatile GifFrame *pic)
+//----------------------------------------------------------------------------------------
+{
+    pic->dirty_left = MAXCOL;
+    pic->dirty_right = 0;
+    pic->dirty_top = MAXROW;
+    pic->dirty_bottom = 0;
+}
+
+// Copies the dirty rectangles of both pictures from thisPicture into nextPicture,
+// except the rectangle of thisPicture if restore is set (disposal method 3).
+// Afterwards both pictures are equal outside that rectangle.
+//----------------------------------------------------------------------------------------
+  void GifDisplay::sync_next_picture(bool restore)
+//----------------------------------------------------------------------------------------
+{
+    volatile GifPicture *p = thisPicture;
+    volatile GifPicture *q = nextPicture;
+    int left, right, top, bottom;
+    int row, col, fr;
+    int hole_left = 0, hole_right = 0, hole_top = 0, hole_bottom = 0;
+    int n = 0;
+
+    left   = p->dirty_left   < q->dirty_left   ? p->dirty_left   : q->dirty_left;
+    right  = p->dirty_right  > q->dirty_right  ? p->dirty_right  : q->dirty_right;
+    top    = p->dirty_top    < q->dirty_top    ? p->dirty_top    : q->dirty_top;
+    bottom = p->dirty_bottom > q->dirty_bottom ? p->dirty_bottom : q->dirty_bottom;
+    if (restore) {
+        hole_left = p->left;
+        hole_right = p->left + p->width;
+        hole_top = p->top;
+        hole_bottom = p->top + p->height;
+    }
+
+    if (left == 0 && right == MAXCOL && top == 0 && bottom == MAXROW && !restore) {
+        memcpy((void *)&q->data, (void *)&p->data, MAXROW*MAXCOL);
+        n = MAXROW*MAXCOL;
+    }
+    else if (top < bottom) {
+        for (col=left; col<right; col++) {
+            if (col >= hole_left && col < hole_right) {
+                // restore to previous (means: do not copy current)
+                for (row = 0; row < YSIZE; row++) {
+                    fr = FRAME_ROW(row);
+                    if ((row < hole_top || row >= hole_bottom) && fr >= top && fr < bottom) {
+                        q->data[col][fr] = p->data[col][fr];
+                        n++;
+                    }
+                }
+            }
+            else {
+                memcpy((void *)&q->data[col][top], (void *)&p->data[col][top], bottom - top);
+                n += bottom - top;
+            }
+        }
+    }
+    bytes_copied = n;
+    bytes_copied_total += n;
+    clear_dirty(p);
+    clear_dirty(q);
+    if (restore) mark_dirty(q, p->left, p->top, p->width, p->height);
+}
+
+/*
+ *  Virtual tiling.
+ *
+ *  A GIF narrower than the cylinder is shown as often as it fits, with
+ *  REPLICA_DISTANCE columns between the copies. The copies are not stored in
+ *  the frame buffer: the column_map of a picture tells the column fetch
+ *  (render_strips) which frame buffer column is shown at each cylinder column.
+ *  Each picture has its own map, as the ISR fetches the columns of thisPicture
+ *  while nextPicture is prepared.
+ */
+
+// Sets the column_map of pic for a GIF screen of the given width (0: no copies).
+//----------------------------------------------------------------------------------------
+  void GifDisplay::set_column_map(volatile GifPicture *pic, int width)
+//----------------------------------------------------------------------------------------
+{
+    int x, cwidth, n_copies;
+
+    if (width == pic->column_map_width) return;
+    pic->column_map_width = width;
+    cwidth = width + REPLICA_DISTANCE;
+    n_copies = width > 0 ? MAXCOL / cwidth : 0;
+    for (x = 0; x < XSIZE; x++)
+        pic->column_map[x] = x < n_copies*cwidth && x % cwidth < width ? x % cwidth : x;
+#if FRAME_STRIP_MAJOR
+    int w, s;
+    for (w = 0; w < XSIZE; w++)
+        for (s = 0; s < STRIPS; s++)
+            pic->column_source[w][s] = pic->column_map[(w + stripGeometry[s].x) % XSIZE] * MAXROW + s * STRIP_LEDS;
+#endif
+}
+
+// Stores the copies shown by column_map in the frame buffer of thisPicture and
+// switches to the identity map, so that single pixels can be drawn over it.
+//----------------------------------------------------------------------------------------
+  void GifDisplay::expand_column_map(void)
+//----------------------------------------------------------------------------------------
+{
+    int x;
+
+    for (x = 0; x < XSIZE; x++)     // column_map[x] <= x, the sources are not overwritten
+        if (thisPicture->column_map[x] != x)
+            memcpy((void *)&thisPicture->data[x], (void *)&thisPicture->data[thisPicture->column_map[x]], MAXROW);
+    if (thisPicture->column_map_width > 0) mark_dirty(thisPicture, 0, 0, MAXCOL, MAXROW);
+    set_column_map(thisPicture, 0);
+}
+
 // Added by HBA: rendering
 //----------------------------------------------------------------------------------------
   void GifDisplay::render_gif_picture_data(void)
 //----------------------------------------------------------------------------------------
 {
-	const int DISTANCE = 5;
+    bool droppable = nextPicture->disposal_method != 3;   // its successor needs the frame before it
+
+#if GIF_CACHE_SIZE > 0
+    if (cache_state == CACHE_RECORDING) {
+        cache_record();
+        droppable = false;      // records are differences between consecutive frames
+    }
+#endif
+    if (!schedule_next_picture(droppable)) {
+        dispose_gif_picture(nextPicture);
+        play_state = PLAY_BLOCK;
+        return;
+    }
+    set_led_palette(nextPicture, frame_palette(nextPicture));
+    set_column_map(nextPicture, gifScreen.width);
+    show_next_picture(PLAY_DISPOSE);
+}
+
+// Prepares nextPicture for the next GIF frame according to the disposal method
+// of pic: the frame just taken by the ISR (thisPicture) or a dropped frame, which
+// is still in nextPicture and disposed of in place.
+//----------------------------------------------------------------------------------------
+  void GifDisplay::dispose_gif_picture(volatile GifPicture *pic)
+//----------------------------------------------------------------------------------------
+{
     int row, col;
     int left, top;
     int height, width;
 
-#if 1
-	int i, n_copies, cwidth;
-   
-    // replicate GIF
-	width = gifScreen.width;
-    cwidth = width+DISTANCE;
-    n_copies = MAXCOL / cwidth;
-    //printf("%d copies - width=%d\n", n_copies, width);
-    for (i=1; i<n_copies; i++)
-      for (row=0; row<YSIZE; row++)
-        for (col=0; col<width; col++)
-          nextPicture->data[col+i*cwidth][row] = nextPicture->data[col][row];
-#endif        
+    height = pic->height;
+    width = pic->width;
+    left = pic->left;
+    top = pic->top;
+    // note: nextPicture contains the previously displayed picture
+    if (pic == thisPicture) sync_next_picture(pic->disposal_method==3);
+
+    if (pic->disposal_method==2) {
+        // restore to background colour
+         for (row = 0; row < height; row++) {
+             for (col = 0; col < width; col++) {
+                  nextPicture->data[col+left][FRAME_ROW(row+top)] = gifScreen.bgcolour;
+             }
+         }
+         mark_dirty(nextPicture, left, top, width, height);
+    }
+	return;
+}
+
+
+/*
+ *  Frame scheduler.
+ *
+ *  Frames are placed on a timeline of display time (ms, see nextPictureTick):
+ *  each one starts when its predecessor ends, and the ISR swaps it in at the
+ *  first rotation after show_until of the current picture. So the animation
+ *  speed follows the measured rotation period instead of counting rotations.
+ *  Every frame is shown for at least one rotation. A player that falls behind
+ *  drops the frames whose time is already over instead of delaying all
+ *  following ones.
+ */
+
+// Places the frame in nextPicture on the timeline and sets show_until. Returns
+// false if the frame is dropped: its time is over and droppable is set. The
+// next frame is then built over it in nextPicture (play_dropped).
+//----------------------------------------------------------------------------------------
+  bool GifDisplay::schedule_next_picture(bool droppable)
+//----------------------------------------------------------------------------------------
+{
+    uint32_t now = clock_ms;
+    uint32_t rotation = tick_ms > 0 && tick_ms < (uint32_t) SCHEDULE_MAX_LAG_MS ? tick_ms : ROTATION_PERIOD_MS;
+    uint32_t start;
+
+    if (play_sync || (int32_t) (now - play_time) > SCHEDULE_MAX_LAG_MS) {
+        // start of playback or stalled player: frame is due at the next rotation
+        play_time = now + rotation;
+        play_sync = false;
+    }
+    start = play_time;
+    play_time += nextPicture->delay_ms > (int) rotation ? nextPicture->delay_ms : rotation;
+    if (droppable && (int32_t) (now - play_time) >= 0) {
+        trace.log('D', nextPicture->delay_ms);
+        frames_dropped++;
+        play_dropped = true;
+        return false;
+    }
+    // a rotation at or after its start has passed since the last swap
+    if (now != swap_ms && (int32_t) (now - start) >= 0) frames_late++;
+    nextPicture->show_until = play_time;
+    return true;
+}
+
+// Hands the rendered next picture to the ISR; step() continues with state next
+// when the ISR has made it the current picture.
+//----------------------------------------------------------------------------------------
+  void GifDisplay::show_next_picture(int next)
+//----------------------------------------------------------------------------------------
+{
     trace.log('R', nextPicture->delay_ms);
+    play_dropped = false;
     nextPicture->is_pending = 1;
-	while (isNextPicturePending()) {
-        isr_simulation();
-		delay(1);	//  1 ms
+    play_state = PLAY_WAIT;
+    play_next = next;
+}
+
+
+#if GIF_CACHE_SIZE > 0
+/*
+ *  Decode-once animation cache.
+ *
+ *  The first loop of a GIF stores each displayed frame (after disposal) as a
+ *  record in the arena (cache_arena between the GIF file and the LZW decoder, see
+ *  reserveFile):
+ *      size      2 bytes  record size including this header
+ *      delay     2 bytes  delay_ms / 10
+ *      length    2 bytes  length of local palette, 0 = global palette,
+ *                         | CACHE_PACKED if the pixels are 4-bit packed
+ *                         | CACHE_COLUMNS if the record has column runs
+ *      palette   3*length bytes RGB
+ *      runs      skip (1 byte), count (1 byte), count pixels
+ *                (packed: (count+1)/2 bytes, see pack_pixels)
+ *  The runs are the difference of the frame buffer to the previous frame, or to
+ *  the background colour for the first frame. Pixels behind the last run are
+ *  unchanged. Later loops apply the records instead of decoding the GIF file.
+ *
+ *  Column runs (GIF_CACHE_COLUMNS) store every changed frame buffer column
+ *  run-length encoded instead:
+ *      column    1 byte   frame buffer column
+ *      bytes     1 byte   size of its runs, i.e. offset of the next column
+ *      runs      count (1 byte), pixel (1 byte), or packed 1 byte:
+ *                count-1 (high nibble), pixel (low nibble)
+ *  The runs of a column cover all MAXROW pixels. cache_record uses them when
+ *  they are shorter than the difference runs, typically for key frames and
+ *  cartoon frames with large areas of one colour (20-35% smaller). Replay
+ *  expands them into the frame buffer of nextPicture (expand_column), from
+ *  which the columns are rendered as for a decoded frame.
+ */
+
+//----------------------------------------------------------------------------------------
+  void GifDisplay::cache_reset(void)
+//----------------------------------------------------------------------------------------
+{
+    cache_state = CACHE_EMPTY;
+    cache_used = 0;
+    cache_frames = 0;
+    cache_file = 0;
+    cache_file_len = 0;
+    cache_shown = false;
+}
+
+// Reserves the first length bytes of cache_arena for the GIF file, the cache
+// (and the frame queue) use the rest up to the LZW decoder. A POV stream may
+// cover the decoder, then nothing is left for the cache.
+//----------------------------------------------------------------------------------------
+  void GifDisplay::set_arena(unsigned long length)
+//----------------------------------------------------------------------------------------
+{
+    arena = cache_arena + length;
+    arena_size = length < (unsigned long) ARENA_DECODER ? ARENA_DECODER - length : 0;
+#if GIF_QUEUE_DEPTH > 0
+    queue_canvas = (unsigned char (*)[MAXROW]) arena;
+    queue_size = arena_size - MAXCOL*MAXROW;
+    queue_head = queue_tail = 0;
+    queue_put = queue_get = 0;
+#endif
+}
+
+//----------------------------------------------------------------------------------------
+    unsigned char *GifDisplay::reserveFile(unsigned long length)  //!< returns buffer for a GIF file (or POV stream) of length bytes at the start of the cache arena, 0 if too large
+//----------------------------------------------------------------------------------------
+{
+    length = (length + 3) & ~3UL;       // arena stays word aligned
+    if (length > GIF_CACHE_SIZE) return 0;
+    stopGif();
+    cache_reset();
+    set_arena(length);
+    return cache_arena;
+}
+
+/*
+ *  4-bit packed pixels of frames with palettes of up to 16 colours: pixel 2k in
+ *  the low nibble, pixel 2k+1 in the high nibble of byte k.
+ */
+static inline void pack_pixels(unsigned char *dst, const volatile unsigned char *src, int n)
+{
+    for (; n > 1; n -= 2, src += 2)
+        *dst++ = src[0] | src[1] << 4;
+    if (n) *dst = src[0];
+}
+
+static inline void unpack_pixels(volatile unsigned char *dst, const unsigned char *src, int n)
+{
+    for (; n > 1; n -= 2, src++) {
+        *dst++ = *src & 0x0F;
+        *dst++ = *src >> 4;
     }
-    trace.log('r', 0);
-	printInfo(0);
+    if (n) *dst = *src & 0x0F;
+}
 
-    height = thisPicture->height;
-    width = thisPicture->width;
-    left = thisPicture->left;
-    top = thisPicture->top;
-    // note: nextPicture contains the previously displayed picture
-    if  (thisPicture->disposal_method==3) {
-        // restore to previous (means: do not copy current)
-        for (row = 0; row < YSIZE; row++) {
-            for (col = 0; col < XSIZE; col++) {
-                if (row<top  || row>=top+height || col<left || col>=left+width)
-                    nextPicture->data[col][row] = thisPicture->data[col][row];
+// Returns true if the n pixels at src (pixel distance 1) fit into 4 bits.
+static inline bool packable(const volatile unsigned char *src, int n)
+{
+    unsigned char c = 0;
+
+    while (n--) c |= *src++;
+    return c < 16;
+}
+
+// Expands the column runs at r (bytes long) into the frame buffer column d.
+static inline void expand_column(volatile unsigned char *d, const unsigned char *r, int bytes, bool packed)
+{
+    const unsigned char *end = r + bytes;
+    unsigned char c;
+    int n;
+
+    while (r < end) {
+        if (packed) {
+            n = (*r >> 4) + 1;
+            c = *r++ & 0x0F;
+        } else {
+            n = r[0];
+            c = r[1];
+            r += 2;
+        }
+        while (n--) *d++ = c;
+    }
+}
+
+#if GIF_CACHE_COLUMNS
+// Stores the changed columns of nextPicture as column runs at r and returns their
+// size (r = 0: only counts it), -1 if packed and a changed column has pixels
+// outside of 4 bits.
+//----------------------------------------------------------------------------------------
+  int GifDisplay::cache_columns(unsigned char *r, bool packed)
+//----------------------------------------------------------------------------------------
+{
+    const volatile unsigned char *p, *q;
+    unsigned char bg = gifScreen.bgcolour;
+    bool first = cache_frames == 0;
+    int col, y, n, runs, size = 0;
+
+    for (col = 0; col < MAXCOL; col++) {
+        p = nextPicture->data[col];
+        q = thisPicture->data[col];
+        for (y = 0; y < MAXROW && p[y] == (first ? bg : q[y]); y++)
+            ;
+        if (y == MAXROW) continue;      // unchanged
+        if (packed && !packable(p, MAXROW)) return -1;
+        for (y = 0, runs = 0; y < MAXROW; y += n, runs++) {
+            for (n = 1; n < (packed ? 16 : 255) && y + n < MAXROW && p[y+n] == p[y]; n++)
+                ;
+            if (!r) continue;
+            if (packed) r[2+runs] = (n - 1) << 4 | p[y];
+            else {
+                r[2+2*runs] = n;
+                r[3+2*runs] = p[y];
             }
         }
+        n = packed ? runs : 2*runs;
+        if (r) {
+            r[0] = col;
+            r[1] = n;
+            r += 2 + n;
+        }
+        size += 2 + n;
     }
-    else memcpy((void *)&nextPicture->data, (void *)&thisPicture->data, MAXROW*MAXCOL);
+    return size;
+}
+#endif
 
-    if (thisPicture->disposal_method==2) {
-        // restore to background colour
-         for (row = 0; row < height; row++) {
-             for (col = 0; col < width; col++) {
-                  nextPicture->data[col+left][row+top] = gifScreen.bgcolour;
-             }
-         }
+// Stores nextPicture as next record. Called before the picture is displayed,
+// i.e. thisPicture still contains the previous frame.
+//----------------------------------------------------------------------------------------
+  void GifDisplay::cache_record(void)
+//----------------------------------------------------------------------------------------
+{
+    const int N = MAXCOL*MAXROW;
+    const volatile unsigned char *p = &nextPicture->data[0][0];
+    const volatile unsigned char *q = &thisPicture->data[0][0];
+    unsigned char *r = arena + cache_used;
+    unsigned char *end = arena + arena_size;
+    unsigned char *runs;
+    unsigned char bg = gifScreen.bgcolour;
+    bool first = cache_frames == 0;
+    bool packed = GIF_PACK_PIXELS && frame_palette(nextPicture)->length <= 16;
+    bool column_packed = packed;
+    int i, n, m, skip, length, delay, columns = -1;
+
+    length = nextPicture->has_cmap ? nextPicture->cmap.length : 0;
+    delay = nextPicture->delay_ms > 0 ? nextPicture->delay_ms / 10 : 0;
+    if (r + 6 + 3*length > end) goto overflow;
+    r[2] = delay;
+    r[3] = delay >> 8;
+    r[4] = length;
+    r[5] = length >> 8;
+    r += 6;
+    memcpy(r, nextPicture->cmap.rgb, 3*length);
+    r += 3*length;
+    runs = r;
+#if GIF_CACHE_COLUMNS
+    columns = cache_columns(0, column_packed);      // size of the column runs
+    if (columns < 0) columns = cache_columns(0, column_packed = false);
+#endif
+
+#define CHANGED(i) (p[i] != (first ? bg : q[i]))
+restart:
+    r = runs;
+    i = 0;
+    while (i < N) {
+        for (skip=0; skip<255 && i<N && !CHANGED(i); skip++) i++;
+        if (i == N) break;
+        // a run ends before 3 unchanged pixels
+        for (n=0; n<255 && i+n<N && (CHANGED(i+n) || (i+n+2<N && (CHANGED(i+n+1) || CHANGED(i+n+2)))); n++)
+            ;
+        m = packed ? (n + 1) / 2 : n;       // bytes of the pixels
+#if GIF_CACHE_COLUMNS
+        if (r + 2 + m - runs > columns) goto column_runs;
+#endif
+        if (r + 2 + m > end) goto overflow;
+        *r++ = skip;
+        *r++ = n;
+#if GIF_PACK_PIXELS
+        if (packed) {
+            if (!packable(p + i, n)) {      // pixel outside of the palette
+                packed = false;
+                goto restart;
+            }
+            pack_pixels(r, p + i, n);
+            r += m;
+            i += n;
+            continue;
+        }
+#endif
+        while (n--) *r++ = p[i++];
+    }
+#undef CHANGED
+#if GIF_CACHE_COLUMNS
+    goto stored;
+
+column_runs:
+    if (runs + columns > end) goto overflow;
+    cache_columns(runs, column_packed);
+    r = runs + columns;
+    packed = column_packed;
+    arena[cache_used+5] |= CACHE_COLUMNS >> 8;
+stored:
+#endif
+
+    n = r - (arena + cache_used);
+    arena[cache_used]   = n;
+    arena[cache_used+1] = n >> 8;
+    if (packed) arena[cache_used+5] |= CACHE_PACKED >> 8;
+    cache_used += n;
+    cache_frames++;
+    return;
+
+overflow:
+    cache_state = CACHE_LIVE;
+    cache_used = 0;
+    cache_frames = 0;
+}
+
+// Builds the cached frame play_record in nextPicture and hands it to the ISR.
+//----------------------------------------------------------------------------------------
+  void GifDisplay::cache_replay(void)
+//----------------------------------------------------------------------------------------
+{
+    const unsigned char *r = play_record;
+    const unsigned char *next = r + (r[0] | r[1] << 8);
+    volatile unsigned char *d;
+    int i, n, length;
+    bool packed, columns;
+
+    if (r == arena) {
+        memset((void *)&nextPicture->data, gifScreen.bgcolour, MAXROW*MAXCOL);
+        mark_dirty(nextPicture, 0, 0, MAXCOL, MAXROW);
+    }
+    else if (!play_dropped) sync_next_picture(false);   // else it holds the dropped predecessor
+    nextPicture->delay_ms = 10*(r[2] | r[3] << 8);
+    length = r[4] | r[5] << 8;
+    packed = length & CACHE_PACKED;
+    columns = length & CACHE_COLUMNS;
+    length &= ~(CACHE_PACKED | CACHE_COLUMNS);
+    r += 6;
+    nextPicture->has_cmap = length > 0;
+    nextPicture->cmap.length = length;
+    nextPicture->cmap.rgb = r;      // the record stays in the arena while the picture is shown
+    r += 3*length;
+    set_led_palette(nextPicture, frame_palette(nextPicture));
+    while (columns && r < next) {
+        // column runs: column, size of its runs, runs
+        expand_column(nextPicture->data[r[0]], r + 2, r[1], packed);
+        mark_dirty(nextPicture, r[0], 0, 1, MAXROW);
+        r += 2 + r[1];
+    }
+    d = &nextPicture->data[0][0];
+    i = 0;
+    while (r < next) {
+        d += r[0];
+        i += r[0];
+        n = r[1];
+        r += 2;
+        // columns of the run
+        if (n) mark_dirty(nextPicture, i/MAXROW, 0, (i+n-1)/MAXROW - i/MAXROW + 1, MAXROW);
+        i += n;
+#if GIF_PACK_PIXELS
+        if (packed) {
+            unpack_pixels(d, r, n);
+            d += n;
+            r += (n + 1) / 2;
+            continue;
+        }
+#endif
+        while (n--) *d++ = *r++;
+    }
+    play_record = next;
+    if (!schedule_next_picture(true)) {
+        cache_shown = false;
+        play_state = next < arena + cache_used ? PLAY_REPLAY : PLAY_IDLE;
+        return;
+    }
+    set_column_map(nextPicture, gifScreen.width);
+
+    if (next < arena + cache_used) {
+        show_next_picture(PLAY_REPLAY);
+    } else {
+        cache_shown = cache_frames == 1;
+        show_next_picture(PLAY_IDLE);
+    }
+}
+#endif
+
+
+#if GIF_QUEUE_DEPTH > 0
+/*
+ *  Decoded frame queue.
+ *
+ *  GIFs that are not replayed from the cache are decoded into queue_canvas at
+ *  the start of the arena. Each frame is queued as a record in the rest of
+ *  the arena, used as a ring buffer of queue_size bytes:
+ *      delay     2 bytes  delay_ms / 10
+ *      length    2 bytes  length of local palette, 0 = global palette
+ *      palette   pointer to the local palette in the GIF file (length > 0)
+ *      rectangle left, top, width, height (2 bytes each, frame buffer rows)
+ *      flags     1 byte   QUEUE_CANVAS: pixels are read from queue_canvas,
+ *                         QUEUE_PACKED: pixels are 4-bit packed
+ *      pixels    width columns of height pixels (not QUEUE_CANVAS), height
+ *                bytes or (height+1)/2 bytes if packed (see pack_pixels)
+ *  The rectangle is the dirty rectangle of the canvas since the previous record,
+ *  so applying the records in order rebuilds every frame. A record too large for
+ *  the ring (e.g. the first frame) keeps its pixels in the canvas, and the
+ *  decoder waits until it has been shown. The decoder (producer) only writes
+ *  queue_head and queue_put, queue_show (consumer) only queue_tail and queue_get.
+ */
+
+// Copies n bytes into the ring at pos, returns the position behind them.
+//----------------------------------------------------------------------------------------
+  uint32_t GifDisplay::queue_write(uint32_t pos, const unsigned char *src, int n)
+//----------------------------------------------------------------------------------------
+{
+    unsigned char *ring = arena + MAXCOL*MAXROW;
+    int k = queue_size - pos;
+
+    if (k > n) k = n;
+    memcpy(ring + pos, src, k);
+    memcpy(ring, src + k, n - k);
+    return (pos + n) % queue_size;
+}
+
+// Copies n bytes from the ring at pos, returns the position behind them.
+//----------------------------------------------------------------------------------------
+  uint32_t GifDisplay::queue_read(uint32_t pos, unsigned char *dst, int n)
+//----------------------------------------------------------------------------------------
+{
+    const unsigned char *ring = arena + MAXCOL*MAXROW;
+    int k = queue_size - pos;
+
+    if (k > n) k = n;
+    memcpy(dst, ring + pos, k);
+    memcpy(dst + k, ring, n - k);
+    return (pos + n) % queue_size;
+}
+
+// Counts the display time the decoder waits for the queue. Returns stalled.
+//----------------------------------------------------------------------------------------
+  bool GifDisplay::queue_stall(bool stalled)
+//----------------------------------------------------------------------------------------
+{
+    if (stalled && !queue_stalled) queue_stall_start = clock_ms;
+    if (!stalled && queue_stalled) queue_stall_ms += clock_ms - queue_stall_start;
+    queue_stalled = stalled;
+    return stalled;
+}
+
+// Queues the decoded frame. Returns false if the queue is full.
+//----------------------------------------------------------------------------------------
+  bool GifDisplay::queue_put_frame(void)
+//----------------------------------------------------------------------------------------
+{
+    GifFrame *f = &queue_frame;
+    int left = f->dirty_left, top = f->dirty_top;
+    int width = f->dirty_right - left, height = f->dirty_bottom - top;
+    int length = f->has_cmap ? f->cmap.length : 0;
+    int col, size, bytes;
+    bool canvas, packed = false;
+    uint32_t used, pos = queue_head;
+    unsigned char r[9];
+#if GIF_PACK_PIXELS
+    unsigned char b[(MAXROW + 1) / 2];
+#endif
+
+    if (width <= 0 || height <= 0) left = top = width = height = 0;
+#if GIF_PACK_PIXELS
+    if (frame_palette(f)->length <= 16)
+        for (packed = true, col = left; packed && col < left + width; col++)
+            packed = packable(&queue_canvas[col][top], height);
+#endif
+    bytes = packed ? (height + 1) / 2 : height;     // per column
+    size = 4 + (length > 0 ? sizeof(f->cmap.rgb) : 0) + 9;
+    canvas = size + width*bytes > queue_size;       // pixels stay in the canvas
+    if (!canvas) size += width*bytes;
+    used = queue_put == queue_get ? 0 : (queue_head + queue_size - queue_tail - 1) % queue_size + 1;
+    if (queue_stall(queue_put - queue_get >= GIF_QUEUE_DEPTH || used + size > (uint32_t) queue_size)) return false;
+
+    r[0] = f->delay_ms / 10;
+    r[1] = f->delay_ms / 10 >> 8;
+    r[2] = length;
+    r[3] = length >> 8;
+    pos = queue_write(pos, r, 4);
+    if (length > 0) pos = queue_write(pos, (const unsigned char *) &f->cmap.rgb, sizeof(f->cmap.rgb));
+    queue_canvas_held = canvas;
+    r[0] = left;   r[1] = left >> 8;
+    r[2] = top;    r[3] = top >> 8;
+    r[4] = width;  r[5] = width >> 8;
+    r[6] = height; r[7] = height >> 8;
+    r[8] = queue_canvas_held ? QUEUE_CANVAS : packed ? QUEUE_PACKED : 0;
+    pos = queue_write(pos, r, 9);
+    if (!queue_canvas_held)
+        for (col = left; col < left + width; col++) {
+#if GIF_PACK_PIXELS
+            if (packed) {
+                pack_pixels(b, &queue_canvas[col][top], height);
+                pos = queue_write(pos, b, bytes);
+                continue;
+            }
+#endif
+            pos = queue_write(pos, &queue_canvas[col][top], height);
+        }
+    clear_dirty(f);
+
+    queue_head = pos;           // publish the record
+    queue_put++;
+    if (queue_put - queue_get > queue_max) queue_max = queue_put - queue_get;
+    trace.log('Q', queue_put - queue_get);
+    return true;
+}
+
+// Applies the disposal method of the queued frame to the canvas. Returns false
+// while the canvas is still needed by a record.
+//----------------------------------------------------------------------------------------
+  bool GifDisplay::queue_dispose(void)
+//----------------------------------------------------------------------------------------
+{
+    GifFrame *f = &queue_frame;
+    int row, col;
+
+    if (queue_stall(queue_canvas_held && queue_get != queue_put)) return false;
+    queue_canvas_held = false;
+    if (f->disposal_method != 2) return true;
+    for (row = 0; row < f->height; row++)
+        for (col = 0; col < f->width; col++)
+            queue_canvas[col+f->left][FRAME_ROW(row+f->top)] = gifScreen.bgcolour;
+    mark_dirty(f, f->left, f->top, f->width, f->height);
+    return true;
+}
+
+// Builds the oldest queued frame in nextPicture and hands it to the ISR, or drops
+// it if its time is over (see schedule_next_picture).
+//----------------------------------------------------------------------------------------
+  void GifDisplay::queue_show(void)
+//----------------------------------------------------------------------------------------
+{
+    volatile GifPicture *pic = nextPicture;
+    uint32_t pos = queue_tail;
+    int col, length, left, top, width, height, flags;
+    unsigned char r[9];
+#if GIF_PACK_PIXELS
+    unsigned char b[(MAXROW + 1) / 2];
+#endif
+
+    pos = queue_read(pos, r, 4);
+    pic->delay_ms = 10*(r[0] | r[1] << 8);
+    length = r[2] | r[3] << 8;
+    pic->has_cmap = length > 0;
+    pic->cmap.length = length;
+    if (length > 0) pos = queue_read(pos, (unsigned char *) &pic->cmap.rgb, sizeof(pic->cmap.rgb));
+    set_led_palette(pic, frame_palette(pic));
+
+    pos = queue_read(pos, r, 9);
+    left = r[0] | r[1] << 8;
+    top = r[2] | r[3] << 8;
+    width = r[4] | r[5] << 8;
+    height = r[6] | r[7] << 8;
+    flags = r[8];
+    if (!play_dropped) {        // else nextPicture holds the dropped frame, the record applies to it
+        if (width == MAXCOL && height == MAXROW) {
+            clear_dirty(thisPicture);
+            clear_dirty(pic);
+        }
+        else sync_next_picture(false);
+    }
+    for (col = left; col < left + width; col++) {
+        if (flags & QUEUE_CANVAS) memcpy((void *)&pic->data[col][top], &queue_canvas[col][top], height);
+#if GIF_PACK_PIXELS
+        else if (flags & QUEUE_PACKED) {
+            pos = queue_read(pos, b, (height + 1) / 2);
+            unpack_pixels(&pic->data[col][top], b, height);
+        }
+#endif
+        else pos = queue_read(pos, (unsigned char *) &pic->data[col][top], height);
+    }
+    if (width > 0 && height > 0) mark_dirty(pic, left, top, width, height);
+
+    queue_tail = pos;           // free the record
+    queue_get++;
+    if (!schedule_next_picture(true)) return;
+    set_column_map(pic, gifScreen.width);
+    trace.log('R', pic->delay_ms);
+    play_dropped = false;
+    queue_shown = true;
+    pic->is_pending = 1;
+}
+#endif
+
+
+/*
+ *  POV stream player (format see mpcgif.h).
+ *
+ *  The picture buffers alternate, so nextPicture holds the frame before the
+ *  current one. Once both buffers hold frames of the stream (pov_depth 2), the
+ *  next frame is built by applying the record of the current frame and the
+ *  record of the next frame instead of copying the current picture; the ISR
+ *  renders every column from the picture buffer when it is output.
+ */
+
+// Returns the record following record r; the stream is checked, a record must not
+// run past play_end (truncated or corrupt download).
+//----------------------------------------------------------------------------------------
+  const unsigned char *GifDisplay::pov_next(const unsigned char *r)
+//----------------------------------------------------------------------------------------
+{
+    int size;
+
+    if (play_end - r < POV_RECORD_SIZE) error("Error: Truncated POV stream");
+    size = r[0] | r[1] << 8;
+    if (size < POV_RECORD_SIZE || size > play_end - r) error("Error: Wrong POV record size");
+    return r + size;
+}
+
+// Applies the runs of record r to nextPicture. Returns the next record.
+//----------------------------------------------------------------------------------------
+  const unsigned char *GifDisplay::pov_apply(const unsigned char *r)
+//----------------------------------------------------------------------------------------
+{
+    const unsigned char *next = pov_next(r);
+    volatile unsigned char *data = &nextPicture->data[0][0];
+    int i = 0, n;
+
+    for (r += POV_RECORD_SIZE; r < next; r += n) {
+        if (next - r < 2) error("Error: Wrong POV run");
+        i += r[0];
+        n = r[1];
+        r += 2;
+        if (n > next - r || i + n > MAXCOL*MAXROW) error("Error: Wrong POV run");
+        memcpy((void *)(data + i), r, n);
+        i += n;
+    }
+    return next;
+}
+
+// Checks the POV stream and continues it if its frames are in the picture buffers.
+//----------------------------------------------------------------------------------------
+  void GifDisplay::pov_start(unsigned long length, const unsigned char *dataPtr)
+//----------------------------------------------------------------------------------------
+{
+    const unsigned char *key;
+    int colours;
+
+    if (length < POV_HEADER_SIZE || memcmp(dataPtr, POV_MAGIC, 4) != 0 || dataPtr[4] != XSIZE || dataPtr[5] != YSIZE ||
+        (dataPtr[6] & POV_STRIP_MAJOR) != (FRAME_STRIP_MAJOR ? POV_STRIP_MAJOR : 0))
+        error("Error: Wrong POV stream");
+    colours = dataPtr[10] | dataPtr[11] << 8;
+    if (colours < 1 || colours > 256 || length < POV_HEADER_SIZE + 3UL*colours) error("Error: Wrong POV stream");
+    key = dataPtr + POV_HEADER_SIZE + 3*colours;
+    play_end = dataPtr + length;
+    play_record = pov_next(key);   // record 0
+    if (pov_data != dataPtr) {
+        pov_data = dataPtr;
+        pov_depth = 0;
+        play_record = key;
+    }
+#if GIF_CACHE_SIZE > 0
+    cache_shown = false;
+#endif
+    play_state = play_record < play_end ? PLAY_POV : PLAY_IDLE;
+}
+
+// Builds the POV frame play_record in nextPicture and hands it to the ISR.
+//----------------------------------------------------------------------------------------
+  void GifDisplay::pov_frame(void)
+//----------------------------------------------------------------------------------------
+{
+    const unsigned char *palette = pov_data + POV_HEADER_SIZE;
+    const unsigned char *key, *r, *next;
+    int colours;
+
+    colours = pov_data[10] | pov_data[11] << 8;
+    key = palette + 3*colours;
+    r = play_record;
+    if (pov_depth < 2 || play_dropped) {
+        nextPicture->has_cmap = 1;
+        nextPicture->cmap.length = colours;
+        nextPicture->cmap.rgb = palette;
+        set_led_palette(nextPicture, frame_palette(nextPicture));
+        if (r == key) memset((void *)&nextPicture->data, pov_data[7], MAXROW*MAXCOL);
+        else if (!play_dropped) memcpy((void *)&nextPicture->data, (void *)&thisPicture->data, MAXROW*MAXCOL);
+        next = pov_apply(r);        // over a dropped frame, which the other buffer lacks
+        pov_depth = play_dropped ? 1 : pov_depth + 1;
+    } else {
+        pov_apply(pov_prev);
+        next = pov_apply(r);
+    }
+    mark_dirty(nextPicture, 0, 0, MAXCOL, MAXROW);
+    nextPicture->delay_ms = (r[2] | r[3] << 8) * ROTATION_PERIOD_MS;
+
+    pov_prev = r;
+    if (r == key && next < play_end) next = pov_next(next);   // key frame replaces record 0
+    play_record = next;
+    if (!schedule_next_picture(true)) {
+        play_state = next < play_end ? PLAY_POV : PLAY_IDLE;
+        return;
+    }
+    set_column_map(nextPicture, 0);     // frames are stored with their copies
+    show_next_picture(next < play_end ? PLAY_POV : PLAY_IDLE);
+}
+
+//----------------------------------------------------------------------------------------
+    void GifDisplay::showPov(unsigned long length, const unsigned char *dataPtr)  //!< shows POV stream in memory
+//----------------------------------------------------------------------------------------
+{
+    stopGif();
+    pov_start(length, dataPtr);
+    while (step(YSIZE) != STEP_DONE)
+        delay(1);   // 1 ms
+}
+
+
+// added by HBA - Format for LED strip is BRG not RGB (and not GRB)
+//----------------------------------------------------------------------------------------
+  Colour GifDisplay::rgb(unsigned char r, unsigned char g, unsigned char b) {
+//----------------------------------------------------------------------------------------
+    // round colors to 7 bits
+    r = (r==0xFF ? 0xFF : r+1) & 0xFE;
+    b = (b==0xFF ? 0xFF : b+1) & 0xFE;
+    g = (g==0xFF ? 0xFF : g+1) & 0xFE;
+    return (Colour) r << 7  |
+           (Colour) g >> 1  | 
+           (Colour) b << 15; 
+}
+
+
+
+// gamma correction as described in
+// https://learn.adafruit.com/led-tricks-gamma-correction/the-issue
+static const unsigned char gamma8[256] = {
+	0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  1,  1,  1,  1,
+	1,  1,  1,  1,  1,  1,  1,  1,  1,  2,  2,  2,  2,  2,  2,  2,
+	2,  3,  3,  3,  3,  3,  3,  3,  4,  4,  4,  4,  4,  5,  5,  5,
+	5,  6,  6,  6,  6,  7,  7,  7,  7,  8,  8,  8,  9,  9,  9, 10,
+	10, 10, 11, 11, 11, 12, 12, 13, 13, 13, 14, 14, 15, 15, 16, 16,
+	17, 17, 18, 18, 19, 19, 20, 20, 21, 21, 22, 22, 23, 24, 24, 25,
+	25, 26, 27, 27, 28, 29, 29, 30, 31, 32, 32, 33, 34, 35, 35, 36,
+	37, 38, 39, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 50,
+	51, 52, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63, 64, 66, 67, 68,
+	69, 70, 72, 73, 74, 75, 77, 78, 79, 81, 82, 83, 85, 86, 87, 89,
+	90, 92, 93, 95, 96, 98, 99,101,102,104,105,107,109,110,112,114,
+	115,117,119,120,122,124,126,127,129,131,133,135,137,138,140,142,
+	144,146,148,150,152,154,156,158,160,162,164,167,169,171,173,175,
+	177,180,182,184,186,189,191,193,196,198,200,203,205,208,210,213,
+    215,218,220,223,225,228,231,233,236,239,241,244,247,249,252,255 };
+
+// Converts a palette into the LED strip format (BRG, 7 bit gamma corrected, bit 7 set).
+// The ISR only copies these byte triplets to the strips. A picture whose led[] was
+// built from the same palette keeps it: palettes are stored in the GIF file, the
+// cache records or the POV stream, which stay unchanged until startGif.
+//----------------------------------------------------------------------------------------
+  void GifDisplay::set_led_palette(volatile GifPicture *pic, const GifPalette *cmap)
+//----------------------------------------------------------------------------------------
+{
+    static const unsigned char black[3] = { 0, 0, 0 };
+    const unsigned char *c;
+    int i;
+
+    if (pic->led_rgb == cmap->rgb && pic->led_length == cmap->length) return;
+    pic->led_rgb = cmap->rgb;
+    pic->led_length = cmap->length;
+    for (i=0; i<COLORMAPSIZE; i++) {
+        c = i < cmap->length ? cmap->rgb + 3*i : black;     // unused entries are black
+        pic->led[i][0] = gamma8[c[2]] >> 1 | 0x80;  // B
+        pic->led[i][1] = gamma8[c[0]] >> 1 | 0x80;  // R
+        pic->led[i][2] = gamma8[c[1]] >> 1 | 0x80;  // G
+    }
+}
+
+
+#if GIF_MERGE_PALETTE
+// LED colour of a palette entry: the 7 bit LED values of set_led_palette
+static inline uint32_t led_colour(const unsigned char *c)
+{
+    return (uint32_t) (gamma8[c[0]] >> 1) << 16 | (gamma8[c[1]] >> 1) << 8 | gamma8[c[2]] >> 1;
+}
+
+/*
+ *  Palette merging: the roots of the string table of palette entries with the
+ *  same LED colour are set to the first of these entries, so the decoder writes
+ *  equal pixels for them. The picture looks the same, but the cache records
+ *  and queued rectangles see fewer changed pixels and more frames have pixels
+ *  below 16 (see GIF_PACK_PIXELS). Only done for GIF files without local
+ *  palettes: a pixel keeps its index when a later frame is shown with another
+ *  palette. The transparent index is neither merged nor merged into.
+ */
+//----------------------------------------------------------------------------------------
+  void GifDisplay::merge_gif_palette(GifDecoder *decoder, const GifPalette *cmap)
+//----------------------------------------------------------------------------------------
+{
+    static const int SLOTS = 2*COLORMAPSIZE;   // hash table of the first entry of each LED colour
+    short slot[SLOTS];
+    uint32_t led;
+    int i, j, h, n;
+
+    n = cmap->length < decoder->clear_code ? cmap->length : decoder->clear_code;
+    for (h = 0; h < SLOTS; h++) slot[h] = -1;
+    for (i = 0; i < n; i++) {
+        if (i == decoder->transp_index) continue;
+        led = led_colour(cmap->rgb + 3*i);
+        for (h = (led * 2654435761u) >> 23; (j = slot[h]) >= 0; h = (h + 1) % SLOTS)
+            if (led_colour(cmap->rgb + 3*j) == led) break;
+        if (j < 0) slot[h] = i;
+        else decoder->suffix[i] = decoder->first[i] = j;
+    }
+}
+#endif
+
+// Renders strip S and the following strips of column w of pic.
+// The strip parameters are compile-time constants (geometry.h), so the strips
+// are unrolled and the row addressing of each strip is folded into its loop.
+//----------------------------------------------------------------------------------------
+template<int S>
+  inline void GifDisplay::render_strips(volatile GifPicture *pic, unsigned char *column, int w)
+//----------------------------------------------------------------------------------------
+{
+    constexpr int offset = stripOffset(S);
+    constexpr bool last = stripLast(S);
+    int n;
+    unsigned char *p = column + offset;
+    volatile unsigned char *led;
+#if FRAME_STRIP_MAJOR
+    // pixels of the strip are contiguous, the source address is precomputed
+    const volatile unsigned char *src = &pic->data[0][0] + pic->column_source[w][S];
+
+    for (n=0; n<STRIP_LEDS; n++) {
+        led = pic->led[src[n]];
+#else
+    constexpr int x0 = stripGeometry[S].x;
+    constexpr int y = stripGeometry[S].y;
+    constexpr int dy = stripGeometry[S].dy;
+    int x;
+
+    x = w + x0;
+    if (x >= XSIZE) x -= XSIZE;
+    x = pic->column_map[x];
+    for (n=0; n<STRIP_LEDS; n++) {
+        led = pic->led[pic->data[x][y + n*dy]];
+#endif
+        *p++ = led[0];
+        *p++ = led[1];
+        *p++ = led[2];
     }
-	return;
+    if (last) *p = 0;   // latch byte
+    render_strips<S + 1>(pic, column, w);
 }
 
+template<>
+  inline void GifDisplay::render_strips<STRIPS>(volatile GifPicture *pic, unsigned char *column, int w)
+{
+}
 
-// added by HBA - Format for LED strip is BRG not RGB (and not GRB)
+// Converts column w of the current picture into the byte streams of all channels
+// (COLUMN_BYTES, see geometry.h). Called by the main loop of mpc.ino some columns
+// ahead of their output, or by the ISR if the main loop did not get to it; the
+// result stays valid as long as getPictureGeneration() is unchanged.
 //----------------------------------------------------------------------------------------
-  Colour GifDisplay::rgb(unsigned char r, unsigned char g, unsigned char b) {
+  void GifDisplay::renderThisColumn(int w, unsigned char *column)
 //----------------------------------------------------------------------------------------
-    // round colors to 7 bits
-    r = (r==0xFF ? 0xFF : r+1) & 0xFE;
-    b = (b==0xFF ? 0xFF : b+1) & 0xFE;
-    g = (g==0xFF ? 0xFF : g+1) & 0xFE;
-    return (Colour) r << 7  |
-           (Colour) g >> 1  | 
-           (Colour) b << 15; 
+{
+    render_strips<0>(thisPicture, column, w);
 }
 
+// Renders column w of the pending next picture, so the columns after the switch
+// can be rendered before it (see isNextPictureDue).
+//----------------------------------------------------------------------------------------
+  void GifDisplay::renderNextColumn(int w, unsigned char *column)
+//----------------------------------------------------------------------------------------
+{
+    render_strips<0>(nextPicture, column, w);
+}
 
 
 /*
@@ -226,17 +1256,6 @@ void debug_print(const char *function, int line, const char *format, int value)
     return ch;
 }
 
-//----------------------------------------------------------------------------------------
-  int GifDisplay::read_stream(unsigned char buffer[], int length)
-//----------------------------------------------------------------------------------------
-{
-    int count = (int) mem_read(buffer, 1, length);
-    int i = count;
-    while (i < length)
-        buffer[i++] = '\0';
-    return count;
-}
-
 //----------------------------------------------------------------------------------------
   int GifDisplay::read_gif_int(void)
 //----------------------------------------------------------------------------------------
@@ -250,52 +1269,32 @@ void debug_print(const char *function, int line, const char *format, int value)
 }
 
 /*
- *  Gif data blocks:
- */
-
-//----------------------------------------------------------------------------------------
-  GifDisplay::GifData * GifDisplay::new_gif_data(int size)
-//----------------------------------------------------------------------------------------
-{
-    GifData *data = &gifdata;
-
-    memset (&gifdata_bytes, 0, MAXDATA);
-    memset (&gifdata, 0, sizeof(GifData));
-    //assert(size < MAXDATA);
-	if (size >= MAXDATA) error("Error in new_gif_data");
-    
-    if (data) {
-        data->byte_count = size;
-        data->bytes = &gifdata_bytes[0];
-    }
-    return data;
-}
-
-/*
- *  Read one code block from the Gif file.
- *  This routine should be called until NULL is returned.
- *  Use app_free() to free the returned array of bytes.
+ *  Start the next data sub-block of the image at decoder->src.
+ *
+ *  The sub-block is read in place from the GIF file in memory; its
+ *  bounds are checked here once. Returns 0 at the zero block (end of
+ *  the image data).
  */
 //----------------------------------------------------------------------------------------
-  GifDisplay::GifData * GifDisplay::read_gif_data(void)
+  int GifDisplay::next_gif_block(GifDecoder *decoder)
 //----------------------------------------------------------------------------------------
 {
-    GifData *data;
+    const unsigned char *end = gifFileData + gifFileDataLen;
     int size;
 
-    size = read_byte();
-
-    if (size > 0) {
-        data = new_gif_data(size);
-        read_stream(data->bytes, size);
-    }
-    else {
-        data = NULL;
+    if (decoder->file_state == IMAGE_COMPLETE)
+        return 0;
+    if (decoder->src >= end) error("Error in mem_read");
+    size = *decoder->src++;
+    if (size == 0) {
+        decoder->file_state = IMAGE_COMPLETE;
+        return 0;
     }
-    return data;
+    if (size > end - decoder->src) error("Error in mem_read");
+    decoder->avail = size;
+    return size;
 }
 
-
 /*
  *  Read the next byte from a Gif file.
  *
@@ -307,29 +1306,10 @@ void debug_print(const char *function, int line, const char *format, int value)
   unsigned char GifDisplay::read_gif_byte(GifDecoder *decoder)
 //----------------------------------------------------------------------------------------
 {
-    unsigned char *buf = decoder->buf;
-    unsigned char next;
-
-    if (decoder->file_state == IMAGE_COMPLETE)
+    if (decoder->avail == 0 && next_gif_block(decoder) == 0)
         return '\0';
-
-    if (decoder->position == decoder->bufsize)
-    {   /* internal buffer now empty! */
-        /* read the block size */
-        decoder->bufsize = read_byte();
-        if (decoder->bufsize == 0) {
-            decoder->file_state = IMAGE_COMPLETE;
-            return '\0';
-        }
-        read_stream(buf, decoder->bufsize);
-        next = buf[0];
-        decoder->position = 1;  /* where to get chars */
-    }
-    else {
-        next = buf[decoder->position++];
-    }
-
-    return next;
+    decoder->avail--;
+    return *decoder->src++;
 }
 
 /*
@@ -339,16 +1319,11 @@ void debug_print(const char *function, int line, const char *format, int value)
   void GifDisplay::finish_gif_picture(GifDecoder *decoder)
 //----------------------------------------------------------------------------------------
 {
-    unsigned char *buf = decoder->buf;
-
-    while (decoder->bufsize != 0) {
-        decoder->bufsize = read_byte();
-        if (decoder->bufsize == 0) {
-            decoder->file_state = IMAGE_COMPLETE;
-            break;
-        }
-        read_stream(buf, decoder->bufsize);
-    }
+    do {
+        decoder->src += decoder->avail;
+        decoder->avail = 0;
+    } while (next_gif_block(decoder) != 0);
+    gifFileIndex = decoder->src - gifFileData;
 }
 
 
@@ -356,19 +1331,10 @@ void debug_print(const char *function, int line, const char *format, int value)
   void GifDisplay::read_gif_palette(GifPalette *cmap)
 //----------------------------------------------------------------------------------------
 {
-    int i;
-    unsigned int r, g, b;
-
-    // cmap->colours = ledColorMap; //app_alloc(cmap->length * sizeof(Colour));
-
-    for (i=0; i<cmap->length; i++) {
-        r = read_byte();
-        g = read_byte();
-        b = read_byte();
-        //cmap->colours[i] = rgb(r,g,b);
-        cmap->colours[i] = r<<16 | g<<8 | b;  
-    }
-    // xAllocateColorMap(cmap->colours, cmap->length);
+    // the palette is used in place, the GIF file stays in memory while it is shown
+    if (3UL*cmap->length > gifFileDataLen - gifFileIndex) error("Error in mem_read");
+    cmap->rgb = gifFileData + gifFileIndex;
+    gifFileIndex += 3*cmap->length;
 }
 
 
@@ -380,7 +1346,11 @@ void debug_print(const char *function, int line, const char *format, int value)
 
     screen->width       = read_gif_int();
     screen->height      = read_gif_int();
+#if GIF_SCALE_MAXWIDTH > 0
+    scale_gif_screen(screen);
+#else
 	if (screen->width>MAXCOL || screen->height>MAXROW) error("Error: GifScreenSizeOutOfRange");
+#endif
 
     info                = read_byte();
     screen->has_cmap    =  (info & 0x80) >> 7;
@@ -397,39 +1367,44 @@ void debug_print(const char *function, int line, const char *format, int value)
         read_gif_palette(&screen->cmap);
         //xxxxxxxxxxxxxxxxscreen->cmap.colours[screen->bgcolour] = 0; //HBA: Set Background colour to black!!!
     }
+#if GIF_QUEUE_DEPTH > 0
+    if (play_queued) {
+        memset(queue_canvas, screen->bgcolour, MAXCOL*MAXROW);
+        mark_dirty(&queue_frame, 0, 0, MAXCOL, MAXROW);
+        return;
+    }
+#endif
     memset((void *)nextPicture->data, screen->bgcolour, MAXCOL*MAXROW);
+    mark_dirty(nextPicture, 0, 0, MAXCOL, MAXROW);
 }
 
 
 //----------------------------------------------------------------------------------------
-  void GifDisplay::read_gif_extension(GifPicture *pic)
+  void GifDisplay::read_gif_extension(GifFrame *pic)
 //----------------------------------------------------------------------------------------
 {
-    GifData *data;
-    int marker;
+    const unsigned char *data;
+    int marker, size;
     int transparencyFlag;
+    bool first = true;
 
     marker = read_byte();
 
-    data = read_gif_data();
-    // added by HBA:
-    if (marker==0xF9) {
-        // extract graphics control extension parameter
-        transparencyFlag     = data->bytes[0]>>0 & 1;
-        pic->user_flag       = data->bytes[0]>>1 & 1;
-        pic->disposal_method = data->bytes[0]>>2 & 0x07;
-        pic->delay_ms        = 10*(data->bytes[1]+(data->bytes[2]<<8));
-        pic->transp_index    = transparencyFlag ? data->bytes[3] : -1;
-    }
-    // ext->data_count = 1;
-    // ext->data[0] = data;
-    
-    while (data) {
-        /* Append the data object: */
-        // i = ++ext->data_count;
-        // ext->data = app_realloc(ext->data, i * sizeof(GifData *));
-        // ext->data[i-1] = data;
-        data = read_gif_data();
+    // data sub-blocks are parsed in place in the GIF file
+    while ((size = read_byte()) > 0) {
+        if ((unsigned long) size > gifFileDataLen - gifFileIndex) error("Error in read_gif_extension");
+        data = gifFileData + gifFileIndex;
+        gifFileIndex += size;
+        // added by HBA:
+        if (marker==0xF9 && first && size >= 4) {
+            // extract graphics control extension parameter
+            transparencyFlag     = data[0]>>0 & 1;
+            pic->user_flag       = data[0]>>1 & 1;
+            pic->disposal_method = data[0]>>2 & 0x07;
+            pic->delay_ms        = 10*(data[1]+(data[2]<<8));
+            pic->transp_index    = transparencyFlag ? data[3] : -1;
+        }
+        first = false;
     }
 }
 
@@ -442,8 +1417,10 @@ void debug_print(const char *function, int line, const char *format, int value)
   GifDisplay::GifDecoder * GifDisplay::new_gif_decoder(void)
 //----------------------------------------------------------------------------------------
 {
-    memset (&gifdecoder, 0, sizeof(GifDecoder));
-    return &gifdecoder;  // gif_alloc(sizeof(GifDecoder));
+    GifDecoder *decoder = gif_decoder();
+
+    memset (decoder, 0, sizeof(GifDecoder));
+    return decoder;  // gif_alloc(sizeof(GifDecoder));
 }
 
 //----------------------------------------------------------------------------------------
@@ -452,29 +1429,61 @@ void debug_print(const char *function, int line, const char *format, int value)
 {
     int i, depth;
     int lzw_min;
-    unsigned int *prefix;
 
     lzw_min = read_byte();
     depth = lzw_min;
 
     decoder->file_state   = IMAGE_LOADING;
-    decoder->position     = 0;
-    decoder->bufsize      = 0;
-    decoder->buf[0]       = 0;
+    decoder->src          = gifFileData + gifFileIndex;
+    decoder->avail        = 0;
     decoder->depth        = depth;
     decoder->clear_code   = (1 << depth);
     decoder->eof_code     = decoder->clear_code + 1;
     decoder->running_code = decoder->eof_code + 1;
     decoder->running_bits = depth + 1;
     decoder->max_code_plus_one = 1 << decoder->running_bits;
-    decoder->stack_ptr    = 0;
+    decoder->pending      = 0;
     decoder->prev_code    = NO_SUCH_CODE;
     decoder->shift_state  = 0;
     decoder->shift_data   = 0;
 
-    prefix = decoder->prefix;
-    for (i = 0; i <= LZ_MAX_CODE; i++)
-        prefix[i] = NO_SUCH_CODE;
+    /* roots of the string table: one pixel strings */
+    for (i = 0; i < decoder->clear_code; i++) {
+        decoder->suffix[i] = i;
+        decoder->first[i]  = i;
+        decoder->length[i] = 1;
+    }
+}
+
+/*
+ *  Refill the bit buffer of the decoder.
+ *
+ *  Inside a sub-block 32 bits are loaded at once and the whole bytes
+ *  that fit into the bit buffer are consumed. Near the end of a
+ *  sub-block the bytes are read one at a time across the block boundary.
+ */
+//----------------------------------------------------------------------------------------
+  void GifDisplay::fill_gif_bits(GifDecoder *decoder)
+//----------------------------------------------------------------------------------------
+{
+    uint32_t word;
+    int n;
+
+    if (decoder->avail >= 4) {
+        memcpy(&word, decoder->src, 4);      /* little endian, unaligned load */
+        n = (32 - decoder->shift_state) >> 3;
+        if (n < 4) word &= (1UL << 8*n) - 1;
+        decoder->shift_data |= word << decoder->shift_state;
+        decoder->shift_state += 8*n;
+        decoder->src += n;
+        decoder->avail -= n;
+    }
+    else {
+        while (decoder->shift_state < decoder->running_bits) {
+            decoder->shift_data |= (uint32_t) read_gif_byte(decoder) << decoder->shift_state;
+            decoder->shift_state += 8;
+        }
+    }
 }
 
 /*
@@ -482,29 +1491,18 @@ void debug_print(const char *function, int line, const char *format, int value)
  *
  *  This function looks in the decoder to find out how many
  *  bits to read, and uses a buffer in the decoder to remember
- *  bits from the last byte input.
+ *  bits from the last bytes input.
  */
-int GifDisplay::read_gif_code(GifDecoder *decoder)
+//----------------------------------------------------------------------------------------
+  int GifDisplay::read_gif_code(GifDecoder *decoder)
+//----------------------------------------------------------------------------------------
 {
     int code;
-    unsigned char next_byte;
-    static int code_masks[] = {
-        0x0000, 0x0001, 0x0003, 0x0007,
-        0x000f, 0x001f, 0x003f, 0x007f,
-        0x00ff, 0x01ff, 0x03ff, 0x07ff,
-        0x0fff
-    };
-
-    while (decoder->shift_state < decoder->running_bits)
-    {
-        /* Need more bytes from input file for next code: */
-        next_byte = read_gif_byte(decoder);
-        decoder->shift_data |=
-          ((unsigned long) next_byte) << decoder->shift_state;
-        decoder->shift_state += 8;
-    }
 
-    code = decoder->shift_data & code_masks[decoder->running_bits];
+    if (decoder->shift_state < decoder->running_bits)
+        fill_gif_bits(decoder);
+
+    code = decoder->shift_data & ((1 << decoder->running_bits) - 1);
 
     decoder->shift_data >>= decoder->running_bits;
     decoder->shift_state -= decoder->running_bits;
@@ -522,52 +1520,70 @@ int GifDisplay::read_gif_code(GifDecoder *decoder)
 }
 
 /*
- *  Routine to trace the prefix-linked-list until we get
- *  a prefix which is a pixel value (less than clear_code).
- *  Returns that pixel value.
- *
- *  If the picture is defective, we might loop here forever,
- *  so we limit the loops to the maximum possible if the
- *  picture is okay, i.e. LZ_MAX_CODE times.
+ *  Writes n pixels of the string of code back to front into a frame buffer
+ *  row (pixel distance STRIDE), so that the last pixel written is out[0]. The
+ *  last skip pixels of the string are not written (they have been output before
+ *  or follow in the next line). With TRANSPARENT pixels equal to ti are not written.
  */
 //----------------------------------------------------------------------------------------
-  int GifDisplay::trace_prefix(unsigned int *prefix, int code, int clear_code)
+template<bool TRANSPARENT, int STRIDE>
+static inline void write_gif_string(const unsigned short *prefix, const unsigned char *suffix,
+                                    int code, int skip, unsigned char *out, int n, int ti)
 //----------------------------------------------------------------------------------------
 {
-    int i = 0;
+    unsigned char c;
 
-    while (code > clear_code && i++ <= LZ_MAX_CODE)
+    while (skip-- > 0)
         code = prefix[code];
-    return code;
+    out += n*STRIDE;
+    while (n-- > 0) {
+        out -= STRIDE;
+        c = suffix[code];
+        if (!TRANSPARENT || c != ti) *out = c;
+        code = prefix[code];
+    }
 }
 
 /*
  *  The LZ decompression routine:
- *  Call this function once per scanline to fill in a picture.
+ *  Call this function once per scanline to fill in a picture. The pixels
+ *  are written directly into the frame buffer row starting at line (pixel
+ *  distance STRIDE: MAXROW, or 1 for the line buffer of the scaler), without
+ *  transparent pixels if TRANSPARENT.
+ *
+ *  The string table stores for every code its prefix code, its last pixel
+ *  (suffix), its first pixel and its length. A string is written back to front
+ *  directly into the line, a new code takes its first pixel from the table.
+ *  Codes below running_code - 2 are defined, so a clear code only resets the
+ *  counters. A string that does not fit into the line is continued in the
+ *  next line (decoder->pending pixels of prev_code).
  */
 //----------------------------------------------------------------------------------------
-  void GifDisplay::read_gif_line(GifDecoder *decoder, unsigned char *line, int length)
+template<bool TRANSPARENT, int STRIDE>
+  void GifDisplay::read_gif_line(GifDecoder *decoder, unsigned char *line, int length, int ti)
 //----------------------------------------------------------------------------------------
 {
-    int i = 0, j;
-    int current_code, eof_code, clear_code;
-    int current_prefix, prev_code, stack_ptr;
-    unsigned char *stack, *suffix;
-    unsigned int *prefix;
+    int i = 0, n, len;
+    int current_code, eof_code, clear_code, new_code;
+    int prev_code, pending;
+    unsigned char *suffix, *first;
+    unsigned short *prefix, *size;
 
     prefix  = decoder->prefix;
     suffix  = decoder->suffix;
-    stack   = decoder->stack;
-    stack_ptr   = decoder->stack_ptr;
+    first   = decoder->first;
+    size    = decoder->length;
+    pending     = decoder->pending;
     eof_code    = decoder->eof_code;
     clear_code  = decoder->clear_code;
     prev_code   = decoder->prev_code;
 
-    if (stack_ptr != 0) {
-        /* Pop the stack */
-        while (stack_ptr != 0 && i < length) {
-            line[i++] = stack[--stack_ptr];
-        }    
+    if (pending != 0) {
+        /* Rest of the string of the previous line */
+        n = pending < length ? pending : length;
+        pending -= n;
+        write_gif_string<TRANSPARENT, STRIDE>(prefix, suffix, prev_code, pending, line, n, ti);
+        i = n;
     }
 
     while (i < length)
@@ -582,103 +1598,46 @@ int GifDisplay::read_gif_code(GifDecoder *decoder)
     }
     else if (current_code == clear_code)
     {
-        /* reset prefix table etc */
-        for (j = 0; j <= LZ_MAX_CODE; j++)
-        prefix[j] = NO_SUCH_CODE;
+        /* reset string table: only the roots stay defined */
         decoder->running_code = decoder->eof_code + 1;
         decoder->running_bits = decoder->depth + 1;
         decoder->max_code_plus_one = 1 << decoder->running_bits;
         prev_code = decoder->prev_code = NO_SUCH_CODE;
     }
     else {
-        /* Regular code - if in pixel range
-         * simply add it to output pixel stream,
-         * otherwise trace code-linked-list until
-         * the prefix is in pixel range. */
-        if (current_code < clear_code) {
-            /* Simple case. */
-            line[i++] = current_code;
+        new_code = decoder->running_code - 2;
+        if (prev_code == NO_SUCH_CODE) {
+            /* first code after clear code must be a pixel */
+            if (current_code >= clear_code)
+                error("Error: Image defect"); /* image defect */
         }
         else {
-            /* This code needs to be traced:
-             * trace the linked list until the prefix is a
-             * pixel, while pushing the suffix pixels on
-             * to the stack. If finished, pop the stack
-             * to output the pixel values. */
-            if ((current_code < 0) || (current_code > LZ_MAX_CODE))
-                error("Error: Image defect"); /* image defect */
-            if (prefix[current_code] == NO_SUCH_CODE) {
-                /* Only allowed if current_code is exactly
-                 * the running code:
-                 * In that case current_code = XXXCode,
-                 * current_code or the prefix code is the
-                 * last code and the suffix char is
-                 * exactly the prefix of last code! */
-                if (current_code == decoder->running_code - 2) {
-                current_prefix = prev_code;
-                suffix[decoder->running_code - 2]
-                    = stack[stack_ptr++]
-                    = trace_prefix(prefix, prev_code, clear_code);
-                }
-                else {
-                error("Error: Image defect"); /* image defect */
-                }
-            }
-            else
-                current_prefix = current_code;
-            
-            /* Now (if picture is okay) we should get
-             * no NO_SUCH_CODE during the trace.
-             * As we might loop forever (if picture defect)
-             * we count the number of loops we trace and
-             * stop if we get LZ_MAX_CODE.
-             * Obviously we cannot loop more than that. */
-            j = 0;
-            while (j++ <= LZ_MAX_CODE
-                && current_prefix > clear_code
-                && current_prefix <= LZ_MAX_CODE)
-            {
-                stack[stack_ptr++] = suffix[current_prefix];
-                current_prefix = prefix[current_prefix];
-            }
-            if (j >= LZ_MAX_CODE || current_prefix > LZ_MAX_CODE)
+            /* Only the code defined by this code may be used before its
+             * definition (current_code = XXXCode): its last pixel is the
+             * first pixel of the previous code. */
+            if (current_code > new_code || current_code > LZ_MAX_CODE)
                 error("Error: Image defect"); /* image defect */
-            
-            /* Push the last character on stack: */
-            stack[stack_ptr++] = current_prefix;
-
-            /* Now pop the entire stack into output: */
-            while (stack_ptr != 0 && i < length) {
-                line[i++] = stack[--stack_ptr];
+            if (new_code <= LZ_MAX_CODE) {
+                prefix[new_code] = prev_code;
+                first[new_code]  = first[prev_code];
+                suffix[new_code] = first[current_code == new_code ? prev_code : current_code];
+                size[new_code]   = size[prev_code] + 1;
             }
         }
-        if (prev_code != NO_SUCH_CODE) {
-        if ((decoder->running_code < 2) ||
-          (decoder->running_code > LZ_MAX_CODE+2))
-            error("Error: Image defect"); /* image defect */
-        prefix[decoder->running_code - 2] = prev_code;
-
-        if (current_code == decoder->running_code - 2) {
-            /* Only allowed if current_code is exactly
-             * the running code:
-             * In that case current_code = XXXCode,
-             * current_code or the prefix code is the
-             * last code and the suffix char is
-             * exactly the prefix of the last code! */
-            suffix[decoder->running_code - 2]
-            = trace_prefix(prefix, prev_code, clear_code);
-        }
-        else {
-            suffix[decoder->running_code - 2]
-            = trace_prefix(prefix, current_code, clear_code);
-        }
-        }
+
+        /* output string, the rest follows in the next line */
+        len = size[current_code];
+        n = length - i;
+        if (len < n) n = len;
+        pending = len - n;
+        write_gif_string<TRANSPARENT, STRIDE>(prefix, suffix, current_code, pending, line + i*STRIDE, n, ti);
+        i += n;
         prev_code = current_code;
     }
     }
 
     decoder->prev_code = prev_code;
-    decoder->stack_ptr = stack_ptr;
+    decoder->pending = pending;
 }
 
 /*
@@ -696,23 +1655,13 @@ int GifDisplay::read_gif_code(GifDecoder *decoder)
 #define HT_PUT_CODE(x)  ((x) & 0x0FFF)
 
 
+// Starts decoding the image data of pic; the rows are decoded by read_gif_rows.
 //----------------------------------------------------------------------------------------
-  void GifDisplay::read_gif_picture_data(GifPicture *pic)
+  void GifDisplay::read_gif_picture_data(GifFrame *pic)
 //----------------------------------------------------------------------------------------
 {
     GifDecoder *decoder; //*decoder;
-    long w, h, top, left;
-    int interlace_start[] = {0, 4, 2, 1};
-    int interlace_step[]  = {8, 8, 4, 2};
-    int scan_pass, row, ti;
-    unsigned char line[MAXCOL];
-    int i;
 
-    w = pic->width;
-    h = pic->height;
-    top = pic->top;             // HBA
-    left = pic->left;           // HBA
-    ti = pic->transp_index;     // HBA
 #if 0    
     pic->data = app_alloc(h * sizeof(unsigned char *));
     if (pic->data == NULL)
@@ -722,35 +1671,168 @@ int GifDisplay::read_gif_code(GifDecoder *decoder)
 #endif
     decoder = new_gif_decoder();
     init_gif_decoder(decoder);
-    if (pic->interlace) {
-      for (scan_pass = 0; scan_pass < 4; scan_pass++) {
-        row = interlace_start[scan_pass];
-        while (row < h) {
-          read_gif_line(decoder, line, w);
-          for (i=0; i<w; i++) if(line[i]!=ti) pic->data[left+i][row+top] = line[i];
-          row += interlace_step[scan_pass];
-        }
-      }
-    }
-    else {
-      row = 0;
-      while (row < h) {
-        read_gif_line(decoder, line, w);
-        for (i=0; i<w; i++) if(line[i]!=ti) pic->data[left+i][row+top] = line[i];
-        row += 1;
-      }
+    decoder->width = pic->width;
+    decoder->height = pic->height;
+    decoder->top = pic->top;                // HBA
+    decoder->transp_index = pic->transp_index;  // HBA
+    decoder->pic = pic;
+    pixels_decoded += (unsigned long) pic->width * pic->height;
+#if GIF_MERGE_PALETTE
+    if (merge_palette) merge_gif_palette(decoder, frame_palette(pic));
+#endif
+#if GIF_QUEUE_DEPTH > 0
+    if (play_queued) decoder->data = queue_canvas;
+    else
+#endif
+    decoder->data = (unsigned char (*)[MAXROW]) nextPicture->data;
+#if GIF_SCALE_MAXWIDTH > 0
+    if (scale_step) scale_gif_picture(pic, decoder);   // pic gets the scaled rectangle
+    else
+#endif
+    if (pic->left + pic->width > MAXCOL || pic->top + pic->height > MAXROW) error("Error: GifPictureOutOfRange");
+    mark_dirty(pic, pic->left, pic->top, pic->width, pic->height);
+    decoder->line = &decoder->data[pic->left][0];
+    decoder->rows_left = decoder->height;
+    decoder->row = 0;
+    decoder->row_step = pic->interlace ? 8 : 1;
+    decoder->scan_pass = pic->interlace ? 0 : 3;   // last interlace pass has the following rows
+}
+
+#if GIF_SCALE_MAXWIDTH > 0
+/*
+ *  Scaler for GIF files larger than the frame buffer.
+ *
+ *  The GIF screen (or the crop window set by setCrop) is scaled down with one
+ *  factor for both directions, so that it fits into MAXCOL x MAXROW. Output
+ *  pixel i shows source pixel (i*scale_step + scale_step/2) >> 16 (16.16 fixed
+ *  point step, point sampling at the pixel centres). Every image row is decoded
+ *  into scale_line; only the rows shown by an output row are sampled into the
+ *  frame buffer, so no full size buffer is needed. Palette indices can not be
+ *  averaged, therefore the scaler samples instead of filtering.
+ */
+
+// Sets the scaler for the screen and replaces its size by the scaled size.
+//----------------------------------------------------------------------------------------
+  void GifDisplay::scale_gif_screen(GifScreen *screen)
+//----------------------------------------------------------------------------------------
+{
+    int left = 0, top = 0, width = screen->width, height = screen->height;
+    uint32_t sx, sy;
+
+    scale_step = 0;
+    if (crop_width > 0 && crop_height > 0) {
+        left = crop_left < width ? crop_left : width;
+        top = crop_top < height ? crop_top : height;
+        width = crop_width < width - left ? crop_width : width - left;
+        height = crop_height < height - top ? crop_height : height - top;
     }
+    if (width == screen->width && height == screen->height && width <= MAXCOL && height <= MAXROW) return;
+    if (width <= 0 || height <= 0 || screen->width > SCALE_MAX_SIZE || screen->height > SCALE_MAX_SIZE)
+        error("Error: GifScreenSizeOutOfRange");
+    sx = (((uint32_t) width << 16) + MAXCOL - 1) / MAXCOL;
+    sy = (((uint32_t) height << 16) + MAXROW - 1) / MAXROW;
+    scale_step = sx > sy ? sx : sy;
+    if (scale_step < 0x10000) scale_step = 0x10000;     // crop window only
+    scale_left = left;
+    scale_top = top;
+    screen->width = ((uint32_t) width << 16) / scale_step;
+    screen->height = ((uint32_t) height << 16) / scale_step;
+}
 
-    finish_gif_picture(decoder);
+// First output pixel showing a source pixel at distance s or more from the crop origin.
+//----------------------------------------------------------------------------------------
+  int GifDisplay::scale_index(int s)
+//----------------------------------------------------------------------------------------
+{
+    uint32_t v = (uint32_t) s << 16;
 
-    //del_gif_decoder(decoder);
-    
-    // Added by HBA - immediate rendering
-    render_gif_picture_data();
+    if (s <= 0 || v <= scale_step/2) return 0;
+    return (v - scale_step/2 + scale_step - 1) / scale_step;
+}
+
+// Replaces the rectangle of pic by the scaled rectangle; the decoder keeps the
+// source rectangle.
+//----------------------------------------------------------------------------------------
+  void GifDisplay::scale_gif_picture(GifFrame *pic, GifDecoder *decoder)
+//----------------------------------------------------------------------------------------
+{
+    int x0, x1, y0, y1;
+
+    if (pic->width > GIF_SCALE_MAXWIDTH) error("Error: GifPictureTooWide");
+    x0 = scale_index(pic->left - scale_left);
+    x1 = scale_index(pic->left + pic->width - scale_left);
+    y0 = scale_index(pic->top - scale_top);
+    y1 = scale_index(pic->top + pic->height - scale_top);
+    if (x1 > gifScreen.width) x1 = gifScreen.width;
+    if (y1 > gifScreen.height) y1 = gifScreen.height;
+    if (x0 > x1) x0 = x1;
+    if (y0 > y1) y0 = y1;
+    decoder->left = pic->left;
+    pic->left = x0;
+    pic->top = y0;
+    pic->width = x1 - x0;
+    pic->height = y1 - y0;
+}
+
+// Decodes the next row into scale_line and samples it into the frame buffer if
+// an output row shows it.
+//----------------------------------------------------------------------------------------
+  void GifDisplay::read_scaled_gif_line(GifDecoder *decoder)
+//----------------------------------------------------------------------------------------
+{
+    GifFrame *pic = decoder->pic;
+    int sy = decoder->row + decoder->top - scale_top;
+    int y = scale_index(sy);
+    int x, fr, sx, ti = decoder->transp_index;
+    unsigned char c;
+
+    read_gif_line<false, 1>(decoder, scale_line, decoder->width, -1);
+    if (y >= gifScreen.height || (int) ((y*scale_step + scale_step/2) >> 16) != sy) return;
+    fr = FRAME_ROW(y);
+    for (x = pic->left; x < pic->left + pic->width; x++) {
+        sx = ((x*scale_step + scale_step/2) >> 16) + scale_left - decoder->left;
+        c = scale_line[sx];
+        if (ti < 0 || c != ti) decoder->data[x][fr] = c;
+    }
+}
+#endif
+
+// Decodes up to budget rows of the picture, returns the number of rows decoded.
+// The decoder writes the rows directly into the frame buffer; the transparent
+// path skips pixels equal to the transparent index.
+//----------------------------------------------------------------------------------------
+  int GifDisplay::read_gif_rows(GifDecoder *decoder, int budget)
+//----------------------------------------------------------------------------------------
+{
+    static const int interlace_start[] = {0, 4, 2, 1};
+    static const int interlace_step[]  = {8, 8, 4, 2};
+    unsigned char *line;
+    int n;
+
+    for (n = 0; n < budget && decoder->rows_left > 0; n++) {
+#if GIF_SCALE_MAXWIDTH > 0
+        if (scale_step) read_scaled_gif_line(decoder);
+        else {
+#endif
+        line = decoder->line + FRAME_ROW(decoder->row + decoder->top);
+        if (decoder->transp_index < 0) read_gif_line<false, MAXROW>(decoder, line, decoder->width, -1);
+        else                           read_gif_line<true, MAXROW>(decoder, line, decoder->width, decoder->transp_index);
+#if GIF_SCALE_MAXWIDTH > 0
+        }
+#endif
+        decoder->rows_left--;
+        decoder->row += decoder->row_step;
+        while (decoder->row >= decoder->height && decoder->scan_pass < 3) {
+            decoder->scan_pass++;
+            decoder->row = interlace_start[decoder->scan_pass];
+            decoder->row_step = interlace_step[decoder->scan_pass];
+        }
+    }
+    return n;
 }
 
 //----------------------------------------------------------------------------------------
-  void GifDisplay::read_gif_picture(GifPicture *pic)
+  void GifDisplay::read_gif_picture(GifFrame *pic)
 //----------------------------------------------------------------------------------------
 {
     unsigned char info;
@@ -771,12 +1853,7 @@ int GifDisplay::read_gif_code(GifDecoder *decoder)
         pic->cmap.length = 1 << pic->cmap_depth;
         read_gif_palette(&pic->cmap);
         //pic->cmap.colours[gifScreen.bgcolour] = 0; // HBA: set background colour to black
-        pic->colours = pic->cmap.colours;
-    } else {
-        pic->colours = gifScreen.cmap.colours;
     }
-
-
     read_gif_picture_data(pic);
 }
 
@@ -786,7 +1863,7 @@ int GifDisplay::read_gif_code(GifDecoder *decoder)
 //----------------------------------------------------------------------------------------
 {
     int i;
-    GifBlock *block = &gifblock;
+    GifBlock *block = &this->block;
 
     for (i=0; i<6; i++)
         header[i] = read_byte();
@@ -831,25 +1908,114 @@ int GifDisplay::read_gif_code(GifDecoder *decoder)
 //----------------------------------------------------------------------------------------
 {
     block->intro = read_byte();
+#if GIF_QUEUE_DEPTH > 0
+    if (play_queued) block->pic = &queue_frame;
+    else
+#endif
+    block->pic = (GifPicture *) nextPicture; //new_gif_picture();
     if (block->intro == 0x2C) {
-        block->pic = (GifPicture *) nextPicture; //new_gif_picture();
         read_gif_picture(block->pic);
     }
     else if (block->intro == 0x21) {
         // block->ext = new_gif_extension();
         // read_gif_extension(block->ext);
-        block->pic = (GifPicture *) nextPicture; // new_gif_picture();
         read_gif_extension(block->pic);
     }
 }
 
 
+/*
+ *  Scans the block structure of a GIF file without decoding it and returns
+ *  GIF_FILE_RESTORES_PREVIOUS if an image uses disposal method 3 (restore to
+ *  previous; such a file is played without the queue: the restored frame must
+ *  stay in a picture buffer) and GIF_FILE_LOCAL_PALETTE if an image has a local
+ *  palette (its palette is not merged, see merge_gif_palette).
+ */
 //----------------------------------------------------------------------------------------
-    void GifDisplay::showGif(unsigned long length, const unsigned char *dataPtr)  //!< shows GIF file in memory
+  int GifDisplay::scan_gif_file(unsigned long length, const unsigned char *data)
 //----------------------------------------------------------------------------------------
 {
-    int i;
-    
+    unsigned long i = 13;       // header and logical screen descriptor
+    int flags = 0;
+
+    if (length < i) return 0;
+    if (data[10] & 0x80) i += 3 << ((data[10] & 0x07) + 1);
+    while (i < length) {
+        if (data[i] == 0x21) {
+            if (i + 3 < length && data[i+1] == 0xF9 && (data[i+3] >> 2 & 0x07) == 3) flags |= GIF_FILE_RESTORES_PREVIOUS;
+            i += 2;
+        }
+        else if (data[i] == 0x2C) {
+            if (i + 9 >= length) break;
+            if (data[i+9] & 0x80) {
+                flags |= GIF_FILE_LOCAL_PALETTE;
+                i += 3 << ((data[i+9] & 0x07) + 1);
+            }
+            i += 11;            // image descriptor and LZW code size
+        }
+        else break;             // terminator or error
+        while (i < length && data[i] != 0) i += data[i] + 1;     // data sub-blocks
+        i++;
+    }
+    return flags;
+}
+
+/*
+ *  Resumable player: startGif() selects the file, step() does a bounded amount
+ *  of work and returns, so the caller can do other work between the steps.
+ *  All decoder state is kept in gif_decoder() and the play_* members.
+ */
+
+//----------------------------------------------------------------------------------------
+    void GifDisplay::startGif(unsigned long length, const unsigned char *dataPtr)  //!< starts one loop of a GIF file (or POV stream) in memory
+//----------------------------------------------------------------------------------------
+{
+    int i, flags;
+
+    stopGif();
+    thisPicture->led_rgb = nextPicture->led_rgb = 0;   // the file may have been overwritten
+    if (length >= POV_HEADER_SIZE && memcmp(dataPtr, POV_MAGIC, 4) == 0) {
+        pov_start(length, dataPtr);
+        return;
+    }
+    pov_data = 0;
+#if GIF_CACHE_SIZE > 0
+    if (dataPtr < cache_arena + GIF_CACHE_SIZE && dataPtr + length > cache_arena + ARENA_DECODER)
+        error("Error: GIF file overlaps the LZW decoder");   // only a POV stream may fill the arena
+    if (dataPtr != cache_file || length != cache_file_len) {
+        cache_reset();
+        cache_file = dataPtr;
+        cache_file_len = length;
+        flags = scan_gif_file(length, dataPtr);
+#if GIF_QUEUE_DEPTH > 0
+        queue_allowed = queue_size >= (int) (4 + sizeof(const unsigned char *) + 9) && !(flags & GIF_FILE_RESTORES_PREVIOUS);
+#endif
+#if GIF_MERGE_PALETTE
+        merge_palette = !(flags & GIF_FILE_LOCAL_PALETTE);
+#endif
+    }
+    if (cache_state == CACHE_COMPLETE) {
+        cache_hits++;
+        if (cache_frames == 1 && cache_shown) {
+            // static picture is current: only wait for one rotation
+            play_tick = tickc;
+            play_state = PLAY_PAUSE;
+        } else {
+            play_record = arena;
+            play_state = PLAY_REPLAY;
+        }
+        return;
+    }
+    cache_misses++;
+    cache_shown = false;
+    if (cache_state == CACHE_EMPTY && cache_enabled) cache_state = CACHE_RECORDING;
+#elif GIF_MERGE_PALETTE
+    flags = scan_gif_file(length, dataPtr);
+    merge_palette = !(flags & GIF_FILE_LOCAL_PALETTE);
+#endif
+#if GIF_QUEUE_DEPTH > 0
+    play_queued = queue_allowed && cache_state != CACHE_RECORDING;
+#endif
     gifFileDataLen = length;
     gifFileData = dataPtr;
     gifFileIndex = 0;
@@ -865,29 +2031,187 @@ int GifDisplay::read_gif_code(GifDecoder *decoder)
         error("Error: Wrong GIF header"); /* error */
 
     read_gif_screen(&gifScreen);
-    while (1) {
-        //block = new_gif_block();
-        read_gif_block(&block);
+    play_state = PLAY_BLOCK;
+}
 
-        if (block.intro == 0x3B) { /* terminator */
-            //del_gif_block(block);
-            break;
-        }
-        else  if (block.intro == 0x2C) {   /* image */
-            /* Append the block: */
-            i = ++block_count;
-            //gif->blocks = app_realloc(gif->blocks, i * sizeof(GifBlock *));
-            //gif->blocks[i-1] = block;
-        }
-        else  if (block.intro == 0x21) {   /* extension */
-            /* Append the block: */
-            i = ++block_count;
-            //gif->blocks = app_realloc(gif->blocks, i * sizeof(GifBlock *));
-            //gif->blocks[i-1] = block;
+// Does up to budget units of work: a decoded row, a block header, the rendering
+// or disposal of a frame, a replayed cached or POV frame. Returns STEP_WAIT while
+// a frame waits for the ISR, STEP_DONE at the end of the loop.
+//----------------------------------------------------------------------------------------
+    int GifDisplay::step(int budget)  //!< continues the loop started by startGif()
+//----------------------------------------------------------------------------------------
+{
+    GifDecoder *decoder = gif_decoder();
+
+    while (budget > 0) {
+#if GIF_QUEUE_DEPTH > 0
+        if (play_queued && !isNextPicturePending()) {
+            if (queue_shown) {      // queued frame taken by the ISR
+                trace.log('r', 0);
+                printInfo(0);
+                queue_shown = false;
+            }
+            if (queue_get != queue_put) {
+                budget--;
+                queue_show();
+                continue;
+            }
         }
-        else {  /* error */
-            //del_gif_block(block);
+#endif
+        switch (play_state) {
+        case PLAY_IDLE:
+            return STEP_DONE;
+
+        case PLAY_BLOCK:
+            budget--;
+            //block = new_gif_block();
+            read_gif_block(&block);
+            if (block.intro == 0x3B) { /* terminator */
+                //del_gif_block(block);
+#if GIF_CACHE_SIZE > 0
+                if (cache_state == CACHE_RECORDING) {
+                    cache_state = cache_frames > 0 ? CACHE_COMPLETE : CACHE_LIVE;
+                    cache_shown = cache_frames == 1;
+                }
+#endif
+                play_state = PLAY_IDLE;
+#if GIF_QUEUE_DEPTH > 0
+                if (play_queued) play_state = PLAY_DRAIN;
+#endif
+            }
+            else  if (block.intro == 0x2C) {   /* image */
+                /* Append the block: */
+                ++block_count;
+                play_state = PLAY_ROWS;
+            }
+            else  if (block.intro == 0x21) {   /* extension */
+                /* Append the block: */
+                ++block_count;
+            }
+            else {  /* error */
+                //del_gif_block(block);
+#if GIF_CACHE_SIZE > 0
+                if (cache_state == CACHE_RECORDING) cache_state = CACHE_LIVE;
+#endif
+                play_state = PLAY_IDLE;
+#if GIF_QUEUE_DEPTH > 0
+                if (play_queued) play_state = PLAY_DRAIN;
+#endif
+            }
+            break;
+
+        case PLAY_ROWS:
+            budget -= read_gif_rows(decoder, budget);
+            if (decoder->rows_left == 0) {
+                finish_gif_picture(decoder);
+                play_state = PLAY_RENDER;
+            }
+            break;
+
+        case PLAY_RENDER:
+#if GIF_QUEUE_DEPTH > 0
+            if (play_queued) {
+                if (!queue_put_frame()) {   // queue full: wait for the ISR to take a frame
+                    isr_simulation();
+                    return STEP_WAIT;
+                }
+                budget--;
+                play_state = PLAY_DISPOSE;
+                break;
+            }
+#endif
+            budget--;
+            render_gif_picture_data();
+            break;
+
+        case PLAY_WAIT:
+            if (isNextPicturePending()) {
+                isr_simulation();
+                return STEP_WAIT;
+            }
+            trace.log('r', 0);
+            printInfo(0);
+            play_state = play_next;
+            break;
+
+        case PLAY_DISPOSE:
+            budget--;
+#if GIF_QUEUE_DEPTH > 0
+            if (play_queued) {
+                if (!queue_dispose()) {     // wait until the canvas has been shown
+                    isr_simulation();
+                    return STEP_WAIT;
+                }
+            }
+            else
+#endif
+            dispose_gif_picture(thisPicture);
+            play_state = PLAY_BLOCK;
+            break;
+
+#if GIF_QUEUE_DEPTH > 0
+        case PLAY_DRAIN:
+            if (queue_get != queue_put || queue_shown) {
+                isr_simulation();
+                return STEP_WAIT;
+            }
+            play_queued = false;
+            play_state = PLAY_IDLE;
+            break;
+#endif
+
+#if GIF_CACHE_SIZE > 0
+        case PLAY_REPLAY:
+            budget--;
+            cache_replay();
+            break;
+
+        case PLAY_PAUSE:
+            if (tickc == play_tick) {
+                isr_simulation();
+                return STEP_WAIT;
+            }
+            printInfo(0);
+            play_state = PLAY_IDLE;
+            break;
+#endif
+
+        case PLAY_POV:
+            budget--;
+            pov_frame();
             break;
         }
     }
+    return play_state == PLAY_IDLE ? STEP_DONE : STEP_BUSY;
+}
+
+// Stops the current loop. A frame that waits for the ISR is dropped.
+//----------------------------------------------------------------------------------------
+    void GifDisplay::stopGif(void)  //!< stops the loop started by startGif()
+//----------------------------------------------------------------------------------------
+{
+    if (play_state == PLAY_IDLE) return;
+    nextPicture->is_pending = 0;
+    picture_generation += 2;    // columns rendered from the dropped frame never become current
+    play_state = PLAY_IDLE;
+    play_sync = true;
+    pov_data = 0;
+#if GIF_CACHE_SIZE > 0
+    cache_shown = false;
+    if (cache_state == CACHE_RECORDING) cache_state = CACHE_EMPTY;
+#endif
+#if GIF_QUEUE_DEPTH > 0
+    play_queued = queue_shown = queue_stalled = queue_canvas_held = false;
+    queue_tail = queue_head;
+    queue_get = queue_put;
+#endif
+}
+
+//----------------------------------------------------------------------------------------
+    void GifDisplay::showGif(unsigned long length, const unsigned char *dataPtr)  //!< shows GIF file in memory
+//----------------------------------------------------------------------------------------
+{
+    startGif(length, dataPtr);
+    while (step(YSIZE) != STEP_DONE)
+        delay(1);   // 1 ms
 }
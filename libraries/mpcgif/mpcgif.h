@@ -12,18 +12,81 @@
 //#define SIMULATION
 //void btWriteString(const char *textPtr);
 // global constants & variables 
-#define XSIZE 151     
-#define YSIZE  40
+#include <stdint.h>
+#include "geometry.h"
+
 #define MAXROW YSIZE // (YSIZE+20)
 #define MAXCOL XSIZE //(XSIZE+49)
 
+static_assert(MAXCOL <= 256, "GifPicture::column_map stores frame buffer columns in bytes");
+
+// frame buffer row of screen row y (see FRAME_STRIP_MAJOR in geometry.h)
+#if FRAME_STRIP_MAJOR
+#define FRAME_ROW(y) frame_row[y]
+#else
+#define FRAME_ROW(y) (y)
+#endif
+
 //#define LZ_MAX_CODE     4095    /*!< Largest 12 bit code */
 //#define LZ_BITS         12
-                                 
-#define MAXDATA 256
+
 #define COLORMAPSIZE 256
 #define ROTATION_PERIOD_MS 50
 
+// RAM available for GifDisplay on the target (SAM3X8E: 96 KB SRAM, shared with the
+// sketch, the libraries and the stack), checked at compile time on 32-bit targets
+#ifndef GIF_RAM_BUDGET
+#define GIF_RAM_BUDGET 65536
+#endif
+
+// Size of the cache arena in bytes (0 disables the cache). It holds the downloaded
+// GIF file at its start (see reserveFile), the LZW decoder at its end and the
+// decode-once animation cache in between: the first loop of a GIF stores every
+// displayed frame as difference to its predecessor, the following loops replay it
+// without decoding. GIFs that do not fit are decoded live. A POV stream needs no
+// decoder and may fill the whole arena. By default the arena gets the part of
+// GIF_RAM_BUDGET left by the rest of GifDisplay (picture buffers, scaler line and
+// player state: about 15 KB on the target).
+#ifndef GIF_CACHE_SIZE
+#define GIF_CACHE_SIZE (GIF_RAM_BUDGET - 18*1024)
+#endif
+
+// Depth of the decoded frame queue (0 disables it). GIFs that are decoded live in
+// every loop (too large for the cache, or cache disabled) are decoded into a canvas
+// and queued as the changed rectangle of each frame, so the decoder can run up to
+// GIF_QUEUE_DEPTH frames ahead of the display. Canvas and queue use the part of the
+// cache arena that the cache would use, which is not needed by these GIFs. GIFs with
+// disposal method 3 (restore to previous) are decoded directly into the picture buffers.
+#ifndef GIF_QUEUE_DEPTH
+#define GIF_QUEUE_DEPTH (GIF_CACHE_SIZE > 0 ? 4 : 0)
+#endif
+
+// Palette entries of a GIF file with the same LED colour are decoded as the same
+// pixel (see GifDisplay::merge_gif_palette, 0 disables it)
+#ifndef GIF_MERGE_PALETTE
+#define GIF_MERGE_PALETTE 1
+#endif
+
+// Frames with a palette of up to 16 colours (cmap_depth <= 4) are stored with 4 bits
+// per pixel in the animation cache and the frame queue (0: always 8 bits per pixel).
+// The picture buffers keep 8 bits per pixel: they must hold GIFs of 256 colours as
+// well, and reading nibbles makes renderThisColumn about 25% slower (colbench).
+#ifndef GIF_PACK_PIXELS
+#define GIF_PACK_PIXELS 1
+#endif
+
+// Cached frames are stored as run-length encoded columns when that is shorter than
+// their difference to the previous frame (see GifDisplay::cache_columns, 0 disables it)
+#ifndef GIF_CACHE_COLUMNS
+#define GIF_CACHE_COLUMNS 1
+#endif
+
+// Widest GIF image that can be scaled down to the frame buffer (size of the line
+// buffer, see GifDisplay::scale_gif_screen), 0 = GIF files must fit MAXCOL x MAXROW
+#ifndef GIF_SCALE_MAXWIDTH
+#define GIF_SCALE_MAXWIDTH 640
+#endif
+
 // Default color map after init
 #define COLORMASK  0xFF
 #define BLACK  0
@@ -35,8 +98,41 @@
 #define VIOLET 6
 #define WHITE  7
 
+static const unsigned char defaultPalette[8*3] = {
+    0x00,0x00,0x00,  0xFF,0x00,0x00,  0xFF,0xFF,0x00,  0x00,0xFF,0x00,     // black, red, yellow, green
+    0x00,0xFF,0xFF,  0x00,0x00,0xFF,  0xFF,0x00,0xFF,  0xFF,0xFF,0xFF };   // cyan, blue, violet, white
+
 
 
+/*
+ *  POV stream: pre-rendered animation for this display (converted on the host
+ *  with sim/gif2pov, played by GifDisplay::showPov). All values little endian.
+ *
+ *  Header      4 bytes  POV_MAGIC
+ *              1 byte   XSIZE
+ *              1 byte   YSIZE
+ *              1 byte   flags (POV_STRIP_MAJOR: frame buffer rows ordered by FRAME_ROW)
+ *              1 byte   background: palette index of the frame buffer before the key frame
+ *              2 bytes  number of frames
+ *              2 bytes  palette length (1..256)
+ *  Palette     3 bytes RGB per entry, shared by all frames
+ *  Key frame   frame 0 as record relative to the background
+ *  Frames      one record per frame, relative to the previous frame
+ *              (record 0 relative to the last frame, used when looping)
+ *
+ *  Record      2 bytes  record size including this header
+ *              2 bytes  display time in rotations
+ *              runs     skip (1 byte), count (1 byte), count pixels
+ *
+ *  Frames are composited (disposal, transparency, replication) and stored in
+ *  the column-major frame buffer layout, so playing a frame only writes and
+ *  renders the changed pixels.
+ */
+#define POV_MAGIC         "POV1"
+#define POV_HEADER_SIZE   12
+#define POV_RECORD_SIZE   4     // record header
+#define POV_STRIP_MAJOR   0x01
+
 /*
  *  Gif structures:
  */
@@ -50,42 +146,144 @@ class GifDisplay
         GifDisplay(void) { //!< constructor
           thisPicture = &picture0;
           nextPicture = &picture1;
+#if GIF_CACHE_SIZE > 0
+          cache_enabled = true;
+          cache_hits = cache_misses = 0;
+#endif
+#if GIF_QUEUE_DEPTH > 0
+          queue_allowed = false;
+#endif
+#if GIF_CACHE_SIZE > 0
+          set_arena(0);
+#endif
+#if GIF_MERGE_PALETTE
+          merge_palette = false;
+#endif
+          clock_ms = tick_ms = swap_ms = 0;
+          picture_generation = 0;
+          picture0.column_map_width = picture1.column_map_width = -1;
+#if GIF_SCALE_MAXWIDTH > 0
+          crop_left = crop_top = crop_width = crop_height = 0;
+          scale_step = 0;
+#endif
+          set_column_map(&picture0, 0);
+          set_column_map(&picture1, 0);
           init();
         }
         //!< set default colour map in 24-bit RGB format
         void init(void) {
       	    singleStepMode = false;
+            play_state = PLAY_IDLE;
+            play_sync = true;
+            play_dropped = false;
+            frames_late = frames_dropped = 0;
+            thisPicture->show_until = nextPicture->show_until = clock_ms;
+            bytes_copied = 0;
+            bytes_copied_total = 0;
+            pixels_decoded = 0;
+            clear_dirty(thisPicture);
+#if GIF_QUEUE_DEPTH > 0
+            play_queued = queue_shown = queue_stalled = queue_canvas_held = false;
+            queue_head = queue_tail = 0;
+            queue_put = queue_get = queue_max = 0;
+            queue_stall_ms = 0;
+            clear_dirty(&queue_frame);
+#endif
+            clear_dirty(nextPicture);
+            mark_dirty(thisPicture, 0, 0, MAXCOL, MAXROW);
+            pov_data = 0;
+#if GIF_CACHE_SIZE > 0
+            cache_reset();
+#endif
+#if FRAME_STRIP_MAJOR
+            int s;
+            for (s = 0; s < YSIZE; s++) frame_row[s] = frameRow(s);
+#endif
+            expand_column_map();
             gifScreen.has_cmap = 1;
             gifScreen.cmap.length = 8;
-            gifScreen.cmap.colours[0] = 0x000000;   // Black
-            gifScreen.cmap.colours[1] = 0xFF0000;   // Red
-            gifScreen.cmap.colours[2] = 0xFFFF00;   // Yellow
-            gifScreen.cmap.colours[3] = 0x00FF00;   // Green
-            gifScreen.cmap.colours[4] = 0x00FFFF;   // Cyan
-            gifScreen.cmap.colours[5] = 0x0000FF;   // Blue
-            gifScreen.cmap.colours[6] = 0xFF00FF;   // Violet
-            gifScreen.cmap.colours[7] = 0xFFFFFF;   // White
+            gifScreen.cmap.rgb = defaultPalette;
             thisPicture->has_cmap = 0;
             nextPicture->has_cmap = 0;
-            thisPicture->colours = gifScreen.cmap.colours;
-            nextPicture->colours = gifScreen.cmap.colours;
+            thisPicture->led_rgb = nextPicture->led_rgb = 0;
+            set_led_palette(thisPicture, &gifScreen.cmap);
+            set_led_palette(nextPicture, &gifScreen.cmap);
+            picture_generation += 2;
          }
 
         volatile int isNextPicturePending(void) { return nextPicture->is_pending; }; //!< return 1 if next GIF picture is ready
+        bool isNextPictureDue(uint32_t now_ms) {  //!< true if nextPictureTick(now_ms) would switch to the next picture
+            return (int32_t) (now_ms - thisPicture->show_until) >= 0 && isNextPicturePending();
+        }
         
-        void showGif(unsigned long length, const unsigned char *data);  //!< shows GIF file in memory
-        void nextPictureTick(void);  //!< switches to next picture (to be called from ISR) - must only be called if nextPictureIsPending()==1
+        void showGif(unsigned long length, const unsigned char *data);  //!< shows GIF file (or POV stream) in memory
+        void showPov(unsigned long length, const unsigned char *data);  //!< shows POV stream in memory
+        void startGif(unsigned long length, const unsigned char *data); //!< starts one loop of a GIF file (or POV stream), played by step()
+        int  step(int budget);                                          //!< continues the loop with at most budget decoded rows (or frames)
+        void stopGif(void);                                             //!< stops the loop, drops a pending frame
+        static const int STEP_DONE = 0;    /*!< step(): loop finished (or no loop started) */
+        static const int STEP_BUSY = 1;    /*!< step(): budget used up */
+        static const int STEP_WAIT = 2;    /*!< step(): frame waits for the ISR */
+        void nextPictureTick(uint32_t now_ms);  //!< switches to next picture when its time has come (to be called from ISR once per rotation, now_ms: display time)
 
         inline Colour getThisPixelRGB(int x, int y) {  //!< returns pixel of current picture in RGB format (to be called by ISR)
-//          return thisPicture->colours[thisPicture->data[x][y]]; 
-            return thisPicture->has_cmap ? thisPicture->cmap.colours[thisPicture->data[x][y]] 
-                                         : gifScreen.cmap.colours[thisPicture->data[x][y]]; 
+            const GifPalette *cmap = frame_palette(thisPicture);
+            int i = thisPicture->data[thisPicture->column_map[x]][FRAME_ROW(y)];
+            return i < cmap->length ? (Colour) cmap->rgb[3*i] << 16 | cmap->rgb[3*i+1] << 8 | cmap->rgb[3*i+2] : 0;
+        }
+        inline const volatile unsigned char *getThisPixelLED(int x, int y) {  //!< returns pixel of current picture as 3 bytes in LED strip format (to be called by ISR)
+            return thisPicture->led[thisPicture->data[thisPicture->column_map[x]][FRAME_ROW(y)]];
+        }
+        void renderThisColumn(int w, unsigned char *column);  //!< renders current picture for wheel position w into COLUMN_BYTES in LED strip format (see getPictureGeneration)
+        void renderNextColumn(int w, unsigned char *column);  //!< same for the pending next picture, valid after the switch to it (generation + 1)
+        void renderThisPicture(void) {  //!< shows the frame buffer as written by setThisPixel()
+            pov_data = 0;
+            mark_dirty(thisPicture, 0, 0, MAXCOL, MAXROW);
+            set_column_map(thisPicture, 0);
+            picture_generation += 2;
+#if GIF_CACHE_SIZE > 0
+            cache_shown = false;
+#endif
         }
         inline unsigned char getThisPixel(int x, int y) {  //!< returns pixel of current picture in RGB format (to be called by ISR)
-          return thisPicture->data[x][y]; 
+          return thisPicture->data[thisPicture->column_map[x]][FRAME_ROW(y)]; 
         }
         inline void setThisPixel(int x, int y, unsigned char p) {  //!< sets pixel of current picture
-          thisPicture->data[x][y] = p; }
+          thisPicture->data[x][FRAME_ROW(y)] = p; }
+#if GIF_CACHE_SIZE > 0
+        void enableCache(bool on) { cache_enabled = on; cache_reset(); }  //!< enables/disables the animation cache
+        void flushCache(void) { cache_reset(); }  //!< to be called when the GIF file in memory has been overwritten
+        unsigned char *reserveFile(unsigned long length);  //!< returns buffer for a GIF file (or POV stream) of length bytes at the start of the cache arena, 0 if too large
+        int getArenaSize(void) { return arena_size; }  //!< bytes of cache arena left for the cache and frame queue (without the LZW decoder)
+        int getCacheUsed(void) { return cache_state == CACHE_COMPLETE ? cache_used : -1; }  //!< bytes used by cached GIF, -1 if not cached
+        unsigned long getCacheHits(void) { return cache_hits; }      //!< number of loops replayed from the cache
+        unsigned long getCacheMisses(void) { return cache_misses; }  //!< number of loops decoded
+#endif
+#if GIF_QUEUE_DEPTH > 0
+        unsigned long getQueueFrames(void) { return queue_put - queue_get; }  //!< decoded frames waiting in the queue
+        unsigned long getQueuePeak(void) { return queue_max; }               //!< largest number of frames queued
+        unsigned long getQueueStallMs(void) { return queue_stall_ms; }       //!< display time (ms) the decoder waited for a full queue
+#endif
+#if GIF_SCALE_MAXWIDTH > 0
+        void setCrop(int left, int top, int width, int height) {  //!< shows only this window of the GIF screen (width 0: whole screen), scaled down to fit
+            crop_left = left; crop_top = top; crop_width = width; crop_height = height;
+#if GIF_CACHE_SIZE > 0
+            cache_reset();
+#endif
+        }
+#endif
+        void printRamBudget(void);  //!< prints the RAM used by each part of GifDisplay
+        int getBytesCopied(void) { return bytes_copied; }  //!< frame buffer bytes copied for the last frame
+        unsigned long getBytesCopiedTotal(void) { return bytes_copied_total; }  //!< frame buffer bytes copied for all frames
+        unsigned long getFramesLate(void) { return frames_late; }        //!< frames shown at least one rotation after their time
+        unsigned long getFramesDropped(void) { return frames_dropped; }  //!< frames skipped because their time was over
+        unsigned long getPixelsDecoded(void) { return pixels_decoded; }  //!< pixels of all frames decoded from GIF data (not replayed)
+        uint32_t getPictureGeneration(void) { return picture_generation; }  //!< changes whenever renderThisColumn may render other columns (+ 1 only at the switch to the pending next picture)
+#ifdef SIMULATION
+        friend void xShowFrameBuffer(GifDisplay *display);  //!< host display hooks (sim/xwin.h)
+        friend void xWaitRotation(GifDisplay *display);
+        friend struct GifRamTarget;  //!< sizes on the 32 bit target (sim/ramsize.cpp)
+#endif
 		     
     private:
         //!< local constants
@@ -103,10 +301,35 @@ class GifDisplay
         static const int IMAGE_SAVING   = 0;       /*!< file_state = processing */
         static const int IMAGE_COMPLETE = 1;       /*!< finished reading or writing */
 
+        static const int CACHE_EMPTY     = 0;      /*!< cache_state: nothing cached */
+        static const int CACHE_RECORDING = 1;      /*!< first loop is stored while decoding */
+        static const int CACHE_COMPLETE  = 2;      /*!< all frames cached, loops are replayed */
+        static const int CACHE_LIVE      = 3;      /*!< GIF does not fit, loops are decoded */
+        static const int CACHE_PACKED    = 0x8000; /*!< palette length of a cache record: pixels are 4-bit packed */
+        static const int CACHE_COLUMNS   = 0x4000; /*!< palette length of a cache record: record has column runs */
+        static const int QUEUE_CANVAS    = 1;      /*!< flags of a queue record: pixels are read from queue_canvas */
+        static const int QUEUE_PACKED    = 2;      /*!< flags of a queue record: pixels are 4-bit packed */
+
+        static const int SCALE_MAX_SIZE = 16383;   /*!< largest GIF screen that can be scaled (16.16 fixed point) */
+        static const int REPLICA_DISTANCE = 5;     /*!< columns between the copies of a GIF around the cylinder */
+
+        static const int SCHEDULE_MAX_LAG_MS = 1000;  /*!< a player further behind restarts its timeline */
+
+        static const int PLAY_IDLE       = 0;      /*!< play_state: no loop started or loop finished */
+        static const int PLAY_BLOCK      = 1;      /*!< read next block of the GIF file */
+        static const int PLAY_ROWS       = 2;      /*!< decode rows of an image */
+        static const int PLAY_RENDER     = 3;      /*!< hand decoded image to the ISR (or the frame queue) */
+        static const int PLAY_WAIT       = 4;      /*!< next picture waits for the ISR, then play_next */
+        static const int PLAY_DISPOSE    = 5;      /*!< prepare nextPicture after shown image */
+        static const int PLAY_REPLAY     = 6;      /*!< build next cached frame */
+        static const int PLAY_PAUSE      = 7;      /*!< cached static picture: wait one rotation */
+        static const int PLAY_POV        = 8;      /*!< build next POV stream frame */
+        static const int PLAY_DRAIN      = 9;      /*!< loop decoded, wait until the queued frames are shown */
+
         //!< Local data types
         typedef struct {
             int      length;
-            Colour   colours[COLORMAPSIZE];
+            const unsigned char *rgb;   //!< 3 bytes per entry, where the palette is stored (GIF file, cache record, POV stream)
           } GifPalette;
         
         typedef struct {
@@ -117,34 +340,35 @@ class GifDisplay
           } GifScreen;
         
         typedef struct {
-            int             byte_count;
-            unsigned char * bytes;
-          } GifData;
-        
-        typedef struct {
-            int        marker;
-            int        data_count;
-            //GifData ** data;
-            GifData *  data[2];
-          } GifExtension;
-        
-        typedef struct {
-            int is_pending;   // added by HBA
             int left, top, width, height;
             int has_cmap, interlace, sorted, reserved, cmap_depth;
             GifPalette cmap;
-            Colour *colours;
             // Graphics control extension (added by HBA)
             int user_flag;
             int disposal_method;
             int delay_ms;
             int transp_index;    
-            unsigned char    data[MAXCOL][MAXROW];
-          } GifPicture;
+            int dirty_left, dirty_right,             //!< rectangle written since both pictures were equal
+                dirty_top, dirty_bottom;             //!< (frame buffer rows, see mark_dirty)
+          } GifFrame;
+
+        struct GifPicture : GifFrame {
+            int is_pending;   // added by HBA
+            uint32_t show_until;                     //!< display time at which the next picture may replace it
+            unsigned char    led[COLORMAPSIZE][3];   //!< palette in LED strip format (see set_led_palette)
+            const unsigned char *led_rgb;            //!< palette led was built from (0: rebuild)
+            int              led_length;             //!< its number of entries
+            unsigned char    data[MAXCOL][MAXROW];   //!< frame buffer, rows ordered by FRAME_ROW
+            unsigned char    column_map[XSIZE];      //!< frame buffer column shown at cylinder column x (see set_column_map)
+            int              column_map_width;       //!< GIF screen width of column_map
+#if FRAME_STRIP_MAJOR
+            unsigned short   column_source[XSIZE][STRIPS];  //!< data offset of each strip's pixels for wheel position w
+#endif
+          };
         
         typedef struct {
             int            intro;
-            GifPicture *   pic;
+            GifFrame *     pic;
             // GifExtension * ext;   HBA extension is stored in pic!
           } GifBlock;
         
@@ -154,15 +378,25 @@ class GifDisplay
                 running_code, running_bits,
                 max_code_plus_one,
                 prev_code, current_code,
-                stack_ptr,
+                pending,                            //!< pixels of prev_code still to be output
                 shift_state;
-            unsigned long shift_data;
+            uint32_t      shift_data;
             unsigned long pixel_count;
-            int           file_state, position, bufsize;
-            unsigned char buf[256];
-            unsigned char stack[LZ_MAX_CODE+1];
-            unsigned char suffix[LZ_MAX_CODE+1];
-            unsigned int  prefix[LZ_MAX_CODE+1];
+            int           file_state;
+            const unsigned char *src;               //!< next byte of the image data in the GIF file
+            int           avail;                    //!< bytes left in current sub-block
+            GifFrame      *pic;                     //!< frame being decoded
+            unsigned char (*data)[MAXROW];          //!< frame buffer it is decoded into
+            unsigned char *line;                    //!< frame buffer column of image's left edge
+            int           width, height, top, left, //!< image rectangle (left: only set when scaled)
+                          transp_index,
+                          rows_left,                //!< rows still to be decoded
+                          row, row_step,            //!< next image row and distance in current interlace pass
+                          scan_pass;                //!< interlace pass (3 = last or not interlaced)
+            unsigned char  suffix[LZ_MAX_CODE+1];   //!< last pixel of string
+            unsigned char  first[LZ_MAX_CODE+1];    //!< first pixel of string
+            unsigned short length[LZ_MAX_CODE+1];   //!< number of pixels of string
+            unsigned short prefix[LZ_MAX_CODE+1];   //!< code of string without last pixel
           } GifDecoder;
 
 
@@ -174,14 +408,95 @@ class GifDisplay
         volatile GifPicture *nextPicture;     //!< includes next picture to be output. pointers are swapped by ISR
         volatile GifPicture picture0;
         volatile GifPicture picture1;
+#if FRAME_STRIP_MAJOR
+        unsigned char frame_row[YSIZE];                  //!< FRAME_ROW(y)
+#endif
         GifScreen gifScreen;
+
+        int           bytes_copied;                 //!< bytes copied by last sync_next_picture
+        unsigned long bytes_copied_total;
+        unsigned long pixels_decoded;               //!< see getPixelsDecoded
+
+#if GIF_SCALE_MAXWIDTH > 0
+        //!> scaler (see scale_gif_screen)
+        int           crop_left, crop_top, crop_width, crop_height;  //!< window of GIF screen set by setCrop
+        uint32_t      scale_step;                   //!< source pixels per output pixel (16.16), 0 = not scaled
+        int           scale_left, scale_top;        //!< origin of scaled window in GIF screen
+        unsigned char scale_line[GIF_SCALE_MAXWIDTH];
+#endif
+
+        //!> resumable player (see step)
+        int                  play_state;
+        int                  play_next;             //!< state after PLAY_WAIT
+        const unsigned char *play_record;           //!< next cached frame or POV record
+        const unsigned char *play_end;              //!< end of POV stream
+        int                  play_tick;             //!< tickc at start of PLAY_PAUSE
+        uint32_t             play_time;             //!< display time at which the last queued frame ends
+        bool                 play_sync;             //!< next frame restarts the timeline
+        bool                 play_dropped;          //!< nextPicture holds a dropped frame (see schedule_next_picture)
+        unsigned long        frames_late, frames_dropped;
+
+        //!> display time (ms) of the last nextPictureTick, time since the one before, time of the last swap
+        volatile uint32_t    clock_ms, tick_ms, swap_ms;
+        volatile uint32_t    picture_generation;    //!< + 1 at the switch to nextPicture, + 2 at any other change of the columns of thisPicture or of a pending nextPicture
+
+#if GIF_MERGE_PALETTE
+        bool                 merge_palette;         //!< GIF file has no local palettes (see merge_gif_palette)
+#endif
+
+        //!> POV stream player (see showPov)
+        const unsigned char *pov_data;              //!< stream of the frames in the picture buffers
+        const unsigned char *pov_prev;              //!< record of the current picture
+        int                  pov_depth;             //!< number of picture buffers with frames of pov_data
+
+#if GIF_CACHE_SIZE > 0
+        //!> decode-once animation cache (see cache_record)
+        bool          cache_enabled;
+        bool          cache_shown;                  //!< cached static picture is current
+        int           cache_state;
+        int           cache_used;                   //!< bytes used in arena
+        int           cache_frames;                 //!< number of cached frames
+        const unsigned char *cache_file;            //!< GIF file of cached frames
+        unsigned long cache_file_len;
+        unsigned long cache_hits, cache_misses;
+        unsigned char *arena;                       //!< cache_arena behind the GIF file (see reserveFile)
+        int           arena_size;                   //!< bytes from arena to the LZW decoder
+        alignas(GifDecoder) unsigned char cache_arena[GIF_CACHE_SIZE];
+        static const int ARENA_DECODER = (GIF_CACHE_SIZE - sizeof(GifDecoder)) & ~(alignof(GifDecoder) - 1);
+                                                    //!< offset of the LZW decoder in cache_arena (see gif_decoder)
+#endif
+#if GIF_CACHE_SIZE > 0 && GIF_QUEUE_DEPTH > 0
+        static_assert(GIF_CACHE_SIZE >= sizeof(GifDecoder) + MAXCOL*MAXROW + 4 + 8 + 9,
+                      "GIF_QUEUE_DEPTH needs a cache arena (GIF_CACHE_SIZE) larger than the LZW decoder and the frame buffer");
+#elif GIF_CACHE_SIZE > 0
+        static_assert(GIF_CACHE_SIZE >= sizeof(GifDecoder), "cache arena (GIF_CACHE_SIZE) smaller than the LZW decoder");
+#endif
+
+#if GIF_QUEUE_DEPTH > 0
+        //!> decoded frame queue (see queue_put_frame), a ring of records in the arena
+        bool          queue_allowed;                //!< GIF file can be queued (no disposal method 3)
+        bool          play_queued;                  //!< loop is decoded into queue_canvas
+        bool          queue_shown;                  //!< a queued frame waits for the ISR
+        bool          queue_stalled;                //!< decoder waits for the queue
+        bool          queue_canvas_held;            //!< last record is shown from queue_canvas
+        GifFrame      queue_frame;                  //!< frame being decoded, dirty rectangle of queue_canvas
+        unsigned char (*queue_canvas)[MAXROW];      //!< frame buffer of the decoder, start of the arena
+        uint32_t      queue_head, queue_tail;       //!< ring positions written by the decoder and read by queue_show
+        unsigned long queue_put, queue_get;         //!< frames written and read
+        unsigned long queue_max;                    //!< largest number of queued frames
+        uint32_t      queue_stall_start;            //!< display time when the decoder started to wait
+        unsigned long queue_stall_ms;               //!< display time the decoder waited for the queue
+        int           queue_size;                   //!< ring behind queue_canvas
+#endif
         
         //!> working buffers (were in original code allocated with malloc)
         GifBlock block;
-        GifBlock gifblock;
+#if GIF_CACHE_SIZE > 0
+        GifDecoder *gif_decoder(void) { return (GifDecoder *) (cache_arena + ARENA_DECODER); }  //!< LZW decoder, needed only while a GIF is decoded
+#else
         GifDecoder gifdecoder;
-        unsigned char gifdata_bytes[MAXDATA];
-        GifData gifdata;
+        GifDecoder *gif_decoder(void) { return &gifdecoder; }
+#endif
 
 
         unsigned long gifFileDataLen; //!< size of GIF file in memory
@@ -194,13 +509,10 @@ class GifDisplay
         
         int 	read_gif_int(void);
         
-        GifData * new_gif_data(int size);
-        GifData * read_gif_data(void);
-        void	del_gif_data(GifData *data);
-        void	write_gif_data(GifData *data);
-        void	print_gif_data(GifData *data);
-        
         void	read_gif_palette(GifPalette *cmap);
+#if GIF_MERGE_PALETTE
+        void	merge_gif_palette(GifDecoder *decoder, const GifPalette *cmap);
+#endif
         //void	write_gif_palette(FILE *file, GifPalette *cmap);
         //void	print_gif_palette(FILE *file, GifPalette *cmap);
         
@@ -210,19 +522,25 @@ class GifDisplay
         void	write_gif_screen(GifScreen *screen);
         void	print_gif_screen(GifScreen *screen);
         
-        GifExtension *new_gif_extension(void);
-        void	read_gif_extension(GifPicture *pic);
+        void	read_gif_extension(GifFrame *pic);
         
         GifDecoder * new_gif_decoder(void);
         void	del_gif_decoder(GifDecoder *decoder);
         void	init_gif_decoder(GifDecoder *decoder);
         
         int	read_gif_code(GifDecoder *decoder);
-        void	read_gif_line(GifDecoder *decoder, unsigned char *line, int length);
+        template<bool TRANSPARENT, int STRIDE>
+        void	read_gif_line(GifDecoder *decoder, unsigned char *line, int length, int ti);
+#if GIF_SCALE_MAXWIDTH > 0
+        void	scale_gif_screen(GifScreen *screen);
+        int	scale_index(int s);
+        void	scale_gif_picture(GifFrame *pic, GifDecoder *decoder);
+        void	read_scaled_gif_line(GifDecoder *decoder);
+#endif
         
         GifPicture * new_gif_picture(void);
         void	del_gif_picture(GifPicture *pic);
-        void	read_gif_picture(GifPicture *pic);
+        void	read_gif_picture(GifFrame *pic);
         void	write_gif_picture(GifPicture *pic);
         void	print_gif_picture(GifPicture *pic);
         
@@ -242,21 +560,63 @@ class GifDisplay
         //void	write_gif_file(const char *filename, Gif *gif);
         
         Colour rgb(unsigned char r, unsigned char g, unsigned char b);
+        void   set_led_palette(volatile GifPicture *pic, const GifPalette *cmap);
+        const GifPalette *frame_palette(const volatile GifFrame *pic) {  //!< palette used by pic
+            return pic->has_cmap ? (const GifPalette *) &pic->cmap : &gifScreen.cmap;
+        }
+        template<int S> void render_strips(volatile GifPicture *pic, unsigned char *column, int w);
         
         //void    print_gif(char *filename, Gif *gif);
         void    render_gif(void);
         
         void isr_simulation();
+        void mark_dirty(volatile GifFrame *pic, int left, int top, int width, int height);
+        void clear_dirty(volatile GifFrame *pic);
+        void sync_next_picture(bool restore);
+        void set_column_map(volatile GifPicture *pic, int width);
+        void expand_column_map();
         void render_gif_picture_data();
+        void dispose_gif_picture(volatile GifPicture *pic);
+        bool schedule_next_picture(bool droppable);
+        void show_next_picture(int next);
+        const unsigned char *pov_next(const unsigned char *r);
+        const unsigned char *pov_apply(const unsigned char *r);
+        void pov_start(unsigned long length, const unsigned char *data);
+        void pov_frame();
+#if GIF_CACHE_SIZE > 0
+        void set_arena(unsigned long length);
+        void cache_reset();
+        void cache_record();
+#if GIF_CACHE_COLUMNS
+        int  cache_columns(unsigned char *r, bool packed);
+#endif
+        void cache_replay();
+#endif
+#if GIF_QUEUE_DEPTH > 0
+        uint32_t queue_write(uint32_t pos, const unsigned char *src, int n);
+        uint32_t queue_read(uint32_t pos, unsigned char *dst, int n);
+        bool queue_stall(bool stalled);
+        bool queue_put_frame();
+        bool queue_dispose();
+        void queue_show();
+#endif
+        int  scan_gif_file(unsigned long length, const unsigned char *data);
+        static const int GIF_FILE_RESTORES_PREVIOUS = 1;   /*!< scan_gif_file(): an image uses disposal method 3 */
+        static const int GIF_FILE_LOCAL_PALETTE = 2;       /*!< scan_gif_file(): an image has a local palette */
         unsigned char read_byte();
-        int read_stream(unsigned char*, int);
+        int next_gif_block(GifDecoder*);
         unsigned char read_gif_byte(GifDecoder*);
+        void fill_gif_bits(GifDecoder*);
         void finish_gif_picture(GifDecoder*);
-        int trace_prefix(unsigned int*, int, int);
-        void read_gif_picture_data(GifPicture*);
+        void read_gif_picture_data(GifFrame*);
+        int read_gif_rows(GifDecoder*, int);
 		void error(const char *errmsg);
 };
 
+#if UINTPTR_MAX == 0xFFFFFFFF
+static_assert(sizeof(GifDisplay) <= GIF_RAM_BUDGET, "GifDisplay exceeds GIF_RAM_BUDGET");
+#endif
+
 
 
 
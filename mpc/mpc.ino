@@ -13,29 +13,24 @@
 #pragma GCC optimize ("-O0")
 
 #define NO_INTERRUPT 0
+// 1: a DMAC linked list per channel outputs the rotation, paced by the SPI/USART
+//    byte clocks; the TC interrupt restarts the lists at the index pulse and refills them
+#ifndef COLUMN_DMA_CHAIN
+#define COLUMN_DMA_CHAIN 0
+#endif
 static int MOTOR_OFF;
 
-// Mapping of LED strips to frameBuffer (for wheel=0)
-#define STRIP0X     8
-#define STRIP1X    12
-#define STRIP2X     0
-#define STRIP3X     4
-
-#define STRIP0Y     0
-#define STRIP1Y     1
-#define STRIP2Y     2
-#define STRIP3Y     3
-
-#define STRIP0DY    4
-#define STRIP1DY    4
-#define STRIP2DY    4
-#define STRIP3DY    4
-
-#define MAXFILESIZE 5000
+// GIF rows decoded between two polls of the Bluetooth input (see GifDisplay::step)
+#define GIF_STEP_ROWS 8
 
 // download GIF image is stored here
 unsigned int gifFileDataLen;
+#if GIF_CACHE_SIZE > 0
+unsigned char *gifFileData;                 // start of the animation cache (see GifDisplay::reserveFile)
+#else
+#define MAXFILESIZE 5000
 unsigned char gifFileData[MAXFILESIZE];
+#endif
 
 
 
@@ -55,6 +50,24 @@ unsigned char gifFileData[MAXFILESIZE];
 // TC2, 1, TC7_IRQn  =>  TC7_Handler()
 // TC2, 2, TC8_IRQn  =>  TC8_Handler()
 #define TCCHAN 1
+#ifndef TC_DIVIDER
+#define TC_DIVIDER 32    // TC clock = MCK/TC_DIVIDER (2, 8, 32 or 128)
+#endif
+#if TC_DIVIDER == 2
+#define TC_CLOCK TC_CMR_TCCLKS_TIMER_CLOCK1
+#elif TC_DIVIDER == 8
+#define TC_CLOCK TC_CMR_TCCLKS_TIMER_CLOCK2
+#elif TC_DIVIDER == 32
+#define TC_CLOCK TC_CMR_TCCLKS_TIMER_CLOCK3
+#elif TC_DIVIDER == 128
+#define TC_CLOCK TC_CMR_TCCLKS_TIMER_CLOCK4
+#else
+#error TC_DIVIDER must be 2, 8, 32 or 128
+#endif
+// conversion between us and TC ticks; all TC times are compared modulo 2^32
+#define US_TO_TICKS(us)   ((us) * (F_CPU / 1000000) / TC_DIVIDER)
+#define TICKS_TO_US(t)    (((t) * TC_DIVIDER + F_CPU / 2000000) / (F_CPU / 1000000))
+#define DEFAULT_PERIOD    US_TO_TICKS(57143)    // rotation period with MOTOR_OFF
 #define NMAX 9
 #define TCIRQ TC1_IRQn
 
@@ -64,9 +77,7 @@ unsigned char gifFileData[MAXFILESIZE];
 
 GifDisplay gifDisplay;
 
-// the screen has 151x40 pixels
-#define XSIZE 151
-#define YSIZE  40
+// the screen size (XSIZE x YSIZE) and the LED strips are defined in geometry.h
 
 // text buffer for sprintf
 #define TEXTSIZE 128
@@ -84,6 +95,7 @@ Trace trace;
   for (y=0; y<YSIZE; y++) 
     for (x=0; x<XSIZE; x++) 
 	   gifDisplay.setThisPixel(x, y, pic_prost_neujahr[i++]); 
+  gifDisplay.renderThisPicture();
 }
 
 // Example to control LPD8806-based RGB LED Modules in a strip
@@ -92,18 +104,22 @@ Trace trace;
 
 // Number of RGB LEDs in one LED strip:
 // Note: SPI has too strip connected
-int nLEDs = 10;    // HBA: was 32
-
-
-LPD8806 strip0[2]  = { LPD8806(nLEDs, USART0, USART_CLOCK_RATE),
-                       LPD8806(nLEDs, USART0, USART_CLOCK_RATE)
-                     };
-LPD8806 strip1[2] = { LPD8806(nLEDs, USART1, USART_CLOCK_RATE),
-                      LPD8806(nLEDs, USART1, USART_CLOCK_RATE)
-                    };
-LPD8806 strip23[2] = { LPD8806(2*nLEDs, SPI_CLOCK_RATE),
-                       LPD8806(2*nLEDs, SPI_CLOCK_RATE)
-                     };
+int nLEDs = STRIP_LEDS;    // HBA: was 32
+
+// used for initialization and test pattern only - columns are output from the column ring
+LPD8806 strip0(channelLeds(CHANNEL_USART0), USART0, USART_CLOCK_RATE);
+LPD8806 strip1(channelLeds(CHANNEL_USART1), USART1, USART_CLOCK_RATE);
+LPD8806 strip23(channelLeds(CHANNEL_SPI), SPI_CLOCK_RATE);
+
+// byte streams of the output channels in a rendered column
+static_assert(CHANNEL_USART0 == SHOW_USART0 && CHANNEL_USART1 == SHOW_USART1 && CHANNEL_SPI == SHOW_SPI &&
+              CHANNELS == SHOW_CHANNELS, "column channels must match showAll()");
+constexpr int COLUMN_OFFSET_USART0 = channelOffset(CHANNEL_USART0);
+constexpr int COLUMN_OFFSET_USART1 = channelOffset(CHANNEL_USART1);
+constexpr int COLUMN_OFFSET_SPI    = channelOffset(CHANNEL_SPI);
+constexpr int COLUMN_BYTES_USART0  = channelBytes(CHANNEL_USART0);
+constexpr int COLUMN_BYTES_USART1  = channelBytes(CHANNEL_USART1);
+constexpr int COLUMN_BYTES_SPI     = channelBytes(CHANNEL_SPI);
 
 // initialization of timer counter (TC)
 //----------------------------------------------------------------------------------------
@@ -116,7 +132,7 @@ void tcInit(void)
 
 	// configure TC channel 1:
 	TC_Configure(TC0, TCCHAN,
-	TC_CMR_TCCLKS_TIMER_CLOCK3 |    // 3=MCK/32  (2=MCK/8)
+	TC_CLOCK                   |    // MCK/TC_DIVIDER
 	TC_CMR_BURST_NONE          |    // The clock is not gated by an external signal
 	TC_CMR_ETRGEDG_NONE        |    // External trigger signal not used
 	TC_CMR_ABETRG              |    // TIOA External Trigger Selection
@@ -145,7 +161,7 @@ uint32_t tcReadRA(void)
 {
 	if (MOTOR_OFF) {
 		static uint32_t ra;
-		return ra += 150000;
+		return ra += DEFAULT_PERIOD;
 		} else {
 		// wait until register RA has be loaded
 		while (tcReadStatusBit(TC_SR_LDRAS) == 0)
@@ -182,55 +198,6 @@ inline void tcWriteRC(uint32_t value)
 }
 
 
-//----------------------------------------------------------------------------------------
-inline Colour rgb2led(Colour x)   // from 3*8bit RGB to 3*7bit BRG
-//----------------------------------------------------------------------------------------
-{
-  // gamma correction as described in 
-  // https://learn.adafruit.com/led-tricks-gamma-correction/the-issue
-  
-  const uint8_t gamma[] PROGMEM = {
-	0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-	0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  1,  1,  1,  1,
-	1,  1,  1,  1,  1,  1,  1,  1,  1,  2,  2,  2,  2,  2,  2,  2,
-	2,  3,  3,  3,  3,  3,  3,  3,  4,  4,  4,  4,  4,  5,  5,  5,
-	5,  6,  6,  6,  6,  7,  7,  7,  7,  8,  8,  8,  9,  9,  9, 10,
-	10, 10, 11, 11, 11, 12, 12, 13, 13, 13, 14, 14, 15, 15, 16, 16,
-	17, 17, 18, 18, 19, 19, 20, 20, 21, 21, 22, 22, 23, 24, 24, 25,
-	25, 26, 27, 27, 28, 29, 29, 30, 31, 32, 32, 33, 34, 35, 35, 36,
-	37, 38, 39, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 50,
-	51, 52, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63, 64, 66, 67, 68,
-	69, 70, 72, 73, 74, 75, 77, 78, 79, 81, 82, 83, 85, 86, 87, 89,
-	90, 92, 93, 95, 96, 98, 99,101,102,104,105,107,109,110,112,114,
-	115,117,119,120,122,124,126,127,129,131,133,135,137,138,140,142,
-	144,146,148,150,152,154,156,158,160,162,164,167,169,171,173,175,
-	177,180,182,184,186,189,191,193,196,198,200,203,205,208,210,213,
-    215,218,220,223,225,228,231,233,236,239,241,244,247,249,252,255 };	
-	
-  return (gamma[x>>16]      <<  7 |    // R
-          gamma[x>>8 & 255] >>  1 |    // G
-          gamma[x & 255]    << 15)     // B
-		  & 0x7F7F7F;
-}
-
-//----------------------------------------------------------------------------------------
-void updateStrip(LPD8806 & strip, int t, int i, int x, int y, int dy, int n)   //, Colour *colours)
-//----------------------------------------------------------------------------------------
-{
-  int x1 = x + t;
-  int x2 = x1 - XSIZE;
-  x = x2 < 0 ? x1 : x2;
-
-  while (n--) {
-    //strip.setPixelColor(i, colorPalette[frameBuffer[x][y]&COLORMASK]);
-    strip.setPixelColor(i, rgb2led(gifDisplay.getThisPixelRGB(x, y)));
-    y += dy;
-    i++;
-  }
-
-}
-
-
 //----------------------------------------------------------------------------------------
 void fillColumn(int x, int color)
 //----------------------------------------------------------------------------------------
@@ -251,6 +218,7 @@ void fillScreen(int color)
   for (x = 0; x < XSIZE; x++) {
     fillColumn(x, color);
   }
+  gifDisplay.renderThisPicture();
 }
 
 // create triangle curve
@@ -272,6 +240,7 @@ void drawTriangleCurve(void)
     }
     y += ystep;
   }
+  gifDisplay.renderThisPicture();
 }
 
 
@@ -306,6 +275,7 @@ void drawRow(void)
   for (x = 0; x < XSIZE; x++) {
     gifDisplay.setThisPixel(x, row, color);
   }
+  gifDisplay.renderThisPicture();
 }
 
 
@@ -321,6 +291,7 @@ void drawColumn(void)
   if (col >= XSIZE) return;
   if (color > WHITE) return;
   fillColumn(col, color);
+  gifDisplay.renderThisPicture();
 }
 
 
@@ -415,8 +386,15 @@ void download_gif_file(void)
     return;
   }
   btReadData((uint8_t *)&fileSize, 4);
+  gifFileDataLen = 0;
+#if GIF_CACHE_SIZE > 0
+  gifFileData = gifDisplay.reserveFile(fileSize);
+  sprintf(text, "fileSize (0x%08lX) > GIF_CACHE_SIZE (0x%08X)", fileSize, GIF_CACHE_SIZE);
+  if (gifFileData == 0) halt(text);
+#else
   sprintf(text, "fileSize (0x%08lX) > MAXFILESIZE (0x%08X)", fileSize, MAXFILESIZE);
   if (fileSize > MAXFILESIZE) halt(text);
+#endif
 
   btReadData(gifFileData, fileSize);
 
@@ -427,42 +405,44 @@ void download_gif_file(void)
 
   btWriteString("CRC OK\n");
   gifFileDataLen = fileSize;
+  gifDisplay.flushCache();
 }
 
 #if 1
-  unsigned int top2()
+  uintptr_t top2()
   {
 	  char top2=0;
-	  unsigned int addr;
+	  uintptr_t addr;
 	  char dummy[5000];
 	  dummy[99]=top2;
-	  addr = (unsigned int) &dummy[50];
+	  addr = (uintptr_t) &dummy[50];
 	  return addr;
   }
 
 extern "C" char* sbrk(int incr);
 extern volatile int tickc;
   
+  // addresses are printed with 32 bits (the upper half is cut off on a 64 bit host)
   void check_stack()
   {
-	  static unsigned int size, heap;
+	  static uintptr_t size, heap;
 	  char top;
 
-	  sprintf(text, "\ntickc: 0x%08X\n", (unsigned) &tickc);
+	  sprintf(text, "\ntickc: 0x%08X\n", (unsigned) (uintptr_t) &tickc);
 	  btWriteString(text);
 	  
-	  sprintf(text, "top:   0x%08X\n", (unsigned) &top);
+	  sprintf(text, "top:   0x%08X\n", (unsigned) (uintptr_t) &top);
 	  btWriteString(text);
 
-	  sprintf(text, "top2:  0x%08X\n", top2());
+	  sprintf(text, "top2:  0x%08X\n", (unsigned) top2());
 	  btWriteString(text);
 
-	  heap=(unsigned int) reinterpret_cast<char*>(sbrk(0));
-	  sprintf(text, "heap:  0x%08X\n", heap);
+	  heap=(uintptr_t) reinterpret_cast<char*>(sbrk(0));
+	  sprintf(text, "heap:  0x%08X\n", (unsigned) heap);
 	  btWriteString(text);
 
-	  size = (unsigned int)&top - heap;
-	  sprintf(text, "Free: %d\n", size);
+	  size = (uintptr_t)&top - heap;
+	  sprintf(text, "Free: %d\n", (int) size);
 	  btWriteString(text); 
   }
 #endif
@@ -493,6 +473,7 @@ void setup()
   btReadChar();
 
   btWriteString("\n\n\n\nPOV Cylinder - 2015-04-22\n");
+  gifDisplay.printRamBudget();
   while (1) {
     btWriteString("\nPlease ensure that LED power supply switched on!\n");
     btWriteString("  Press 'n' to start in NORMAL mode\n");
@@ -509,22 +490,18 @@ void setup()
   }
 
   // Start up the LED strips
-  strip0[0].begin();
-  strip1[0].begin();
-  strip23[0].begin();
-  strip0[1].begin();
-  strip1[1].begin();
-  strip23[1].begin();
+  strip0.begin();
+  strip1.begin();
+  strip23.begin();
 
   for (x = 0; x < nLEDs; x++) {
-    strip0[0].setPixelColor(x, 0, 0, 127);
-    strip1[0].setPixelColor(x, 0, 127, 0);
-    strip23[0].setPixelColor(x, 127, 0, 0);
-    //strip23[1].setPixelColor(x, 127, 127, 0);
+    strip0.setPixelColor(x, 0, 0, 127);
+    strip1.setPixelColor(x, 0, 127, 0);
+    strip23.setPixelColor(x, 127, 0, 0);
   }
 
   // Update the strip
-  showAll(strip0[0], strip1[0], strip23[0]);
+  showAll(strip0, strip1, strip23);
 
   fillScreen(BLACK);
   //fillColumn(0, RED);
@@ -544,7 +521,7 @@ void setup()
   }
 
   for (x = 1; x < NMAX; x++) {
-    period = (ra[x] - ra[x - 1]) * 32 / 84; // in us
+    period = TICKS_TO_US(ra[x] - ra[x - 1]);
     sprintf(text, "%d: Period = %lu us = %lu RPM = %lu Hz\n", x, period, 1000000 * 60 / period, 1000000 / period);
     btWriteString(text);
   }
@@ -552,18 +529,86 @@ void setup()
   isrColumnTickInit();
 }
 
+// Rotation predictor: alpha-beta-gamma filter on the index pulse time, the rotation
+// period and its change per rotation. The rotation starts at the predicted index
+// time; the captured index pulse corrects the prediction by its deviation e.
+// Times are 32.32 fixed point TC ticks: the upper half wraps with the counter.
+// The gains (in 1/32) place the poles of the loop at 0.5 and 0.66 +- 0.26j (damping
+// ratio 0.67): a speed change settles without ringing, and the jitter of single
+// rotations is not passed on to the period in full.
+#define PLL_GAIN_SHIFT    5
+#define PLL_ALPHA         24    // index time += 3/4 e
+#define PLL_BETA          14    // period += 7/16 e
+#define PLL_GAMMA         3     // period change per rotation += 3/32 e
+#define PLL_WINDOW_SHIFT  3     // pulses more than period/8 off the prediction are rejected
+#define PLL_MAX_REJECT    3     // consecutive rejected pulses until the predictor restarts
+#define MIN_PERIOD        (F_CPU / TC_DIVIDER / 50)       // 3000 RPM
+#define MAX_PERIOD        (F_CPU / TC_DIVIDER * 2)        // 30 RPM
+#define FIX(t)            ((int64_t) (t) * ((int64_t) 1 << 32))   // TC ticks to 32.32
+// Delay from the column interrupt to the latch of the middle LED of a strip (ISR
+// entry, DMA start, half of the USART transfer), calibrated with sim/povrig.
+// Column interrupts are scheduled earlier by this time.
+#define COLUMN_LATENCY    US_TO_TICKS(24)
+#define COLUMN_TIME_MIN   US_TO_TICKS(19)    // column interrupts closer to now are skipped
+
+enum { PLL_REJECT, PLL_TRACK, PLL_RESTART };
+
 // variables used by interrupt routine
-static uint32_t lastCapture;
-static uint32_t nextColumnTimeInt;
-static uint32_t nextColumnTimeFrac;
-static uint32_t period;
-static uint32_t columnDurationInt;
-static uint32_t columnDurationFrac;
+static uint32_t lastCapture;     // last accepted index pulse
+static uint64_t rotationStart;   // index time of the current rotation (32.32)
+static uint64_t columnPhase;     // time of the next column (32.32)
+static uint32_t period;          // predicted period of the current rotation (TC ticks)
+static uint64_t pllPeriod;       // predicted period (32.32)
+static int64_t pllRate;          // change of pllPeriod per rotation (32.32)
+static uint64_t columnDuration;  // pllPeriod / XSIZE (32.32)
+static int pllRejected;          // consecutive rejected index pulses
+static bool indexSeen;           // index pulse of the current rotation accepted
+static bool indexSeenNext;       // index pulse of the next rotation accepted before its start
 static int wheel;  // wheel is incremented modulo XSIZE
 static int rotVal = 0;
 static int rotInc = 0;
-static int toggle = 0;      // index for toggle buffer - toggles between 0 and 1
+// Columns are rendered from the current picture (GifDisplay::renderThisColumn) by the
+// main loop ahead of their output (renderColumnsAhead) into the ring columnAhead; the
+// column interrupt only hands the buffer to the DMA (armColumn). A buffer is tagged
+// with the picture generation and wheel position it was rendered for; without a
+// matching buffer (main loop blocked, new picture, predictor restart) the interrupt
+// renders the column into the ring columnRing. With COLUMN_DMA_CHAIN the rings hold
+// the columns of the DMAC linked lists; otherwise one column is output, one may wait
+// in showAllWhenReady and the next one is armed. A buffer may be output until
+// COLUMN_RING further columns have been armed, so the main loop renders up to
+// COLUMN_AHEAD - COLUMN_RING columns ahead (12 columns or 4 ms at 1200 RPM,
+// 16 with COLUMN_DMA_CHAIN).
+#if COLUMN_DMA_CHAIN
+#define COLUMN_RING  16
+#define COLUMN_AHEAD 32
+#else
+#define COLUMN_RING  4
+#define COLUMN_AHEAD 16
+#endif
+#define COLUMN_TAG(generation, w) ((generation) << 8 | (w))   // 0: no column (generation 0 is never current)
+#ifndef RENDER_COLUMN
+#define RENDER_COLUMN(w, column)       gifDisplay.renderThisColumn(w, column)
+#define RENDER_NEXT_COLUMN(w, column)  gifDisplay.renderNextColumn(w, column)
+#endif
+static unsigned char columnRing[COLUMN_RING][COLUMN_BYTES];     // columns rendered by the interrupt
+static int columnRingX[COLUMN_RING];   // column of the rotation in each buffer
+static int columnSlot;                 // buffer of the next column
+static unsigned char columnAhead[COLUMN_AHEAD][COLUMN_BYTES];   // columns rendered by the main loop
+static int columnAheadX[COLUMN_AHEAD];                  // column of the rotation in each buffer
+static volatile uint32_t columnAheadTag[COLUMN_AHEAD];  // COLUMN_TAG of each buffer, 0 while it is written
+static volatile uint32_t columnAheadArmed[COLUMN_AHEAD];// columnsArmed when each buffer was last armed
+static volatile uint32_t columnsArmed = COLUMN_RING;    // columns handed to the DMA
+static volatile uint32_t columnSeq;    // number of the last armed column (consecutive columns of the rotations count up by one)
+static volatile int columnX;           // its column of the rotation
+static const unsigned char *column;    // next column (output by next showAll)
 static int numColumnsSkipped = 0;
+static int numColumnsRendered = 0;     // columns rendered by the interrupt (not ahead)
+static int numDmaOverruns = 0;   // column output not completed at the next column (or index pulse)
+static int numIndexLate = 0;     // rotations without accepted index pulse (missed or off the prediction)
+static int numIndexRejected = 0; // index pulses rejected as double trigger or glitch
+static uint32_t displayMs;       // display time of the frame scheduler (GifDisplay::nextPictureTick)
+static uint32_t displayTicks;    // TC ticks not yet counted in displayMs
+static uint32_t displayIndex;    // index time of the last rotation (TC ticks)
 uint32_t rotationCounter;
 
 
@@ -583,14 +628,15 @@ void printInfo(int repeatFlag)
 //----------------------------------------------------------------------------------------
 {
   //const double C = 84.*1000000. / 32;
-  int lastToggle = -1;
+  uint32_t lastCounter = rotationCounter - 1;
   do {
     //sprintf(text, "\rRotation: %5.2f Hz / %5d us (%d columns skipped)", C / (double) period, (period*32+41)/84, numColumnsSkipped);
-    if (lastToggle != toggle) {
-		sprintf(text, "{c%lu}{p%lu}{s%d}", rotationCounter, (period*32+41)/84, numColumnsSkipped);
+    if (lastCounter != rotationCounter) {
+		sprintf(text, "{c%lu}{p%lu}{s%d}{o%d}{i%d}{r%d}{a%d}", rotationCounter, TICKS_TO_US(period), numColumnsSkipped, numDmaOverruns, numIndexLate, numIndexRejected, numColumnsRendered);
         btWriteString(text);
-		lastToggle = toggle;
+		lastCounter = rotationCounter;
 	}
+    renderColumnsAhead();
   } while (repeatFlag && btCharAvailable() == 0);
 }
 
@@ -620,15 +666,21 @@ void playGifInRom(void)
   //btWriteString("Rotation Frequency in Hz/us:      ");
   trace.log('Y', 2);
   
+  trace.log('Y', 3);
+  gifDisplay.startGif(gifFiles[select].length, gifFiles[select].data);
   while (!btCharAvailable()) {
     //btWriteString("g");
     //printInfo(0);
     //read_gif_file("dummy");
-	trace.log('Y', 3);
-    gifDisplay.showGif(gifFiles[select].length, gifFiles[select].data);
-	trace.log('Y', 4);
+    renderColumnsAhead();
+    if (gifDisplay.step(GIF_STEP_ROWS) == GifDisplay::STEP_DONE) {
+	  trace.log('Y', 4);
+      gifDisplay.startGif(gifFiles[select].length, gifFiles[select].data);
+	  trace.log('Y', 3);
+    }
     //btWriteString("G");
   }
+  gifDisplay.stopGif();
   btWriteString("\n");
 }
 
@@ -643,13 +695,17 @@ void playGif(void)
   btWriteString("\nPlaying downloaded GIF file...\n");
   //btWriteString("Rotation Frequency in Hz:      ");
   
+  gifDisplay.startGif(gifFileDataLen, gifFileData);
   while (!btCharAvailable()) {
     //btWriteString("g");
     //printInfo(0);
     //read_gif_file("dummy");
-    gifDisplay.showGif(gifFileDataLen, gifFileData);
+    renderColumnsAhead();
+    if (gifDisplay.step(GIF_STEP_ROWS) == GifDisplay::STEP_DONE)
+      gifDisplay.startGif(gifFileDataLen, gifFileData);
     //btWriteString("G");
   }
+  gifDisplay.stopGif();
   btWriteString("\n");
 }
 
@@ -675,6 +731,21 @@ void loop(void)
   while (1) {
 	sprintf(text, "\nFree memory: %d bytes\nTrace: %s\n", freeMemory(), trace.isStopped() ? "stopped" : "running");
 	btWriteString(text);
+#if GIF_CACHE_SIZE > 0
+	sprintf(text, "Animation cache: %d of %d bytes used (GIF file: %u bytes), %lu loops replayed, %lu decoded\n",
+	        gifDisplay.getCacheUsed() < 0 ? 0 : gifDisplay.getCacheUsed(), gifDisplay.getArenaSize(), gifFileDataLen,
+	        gifDisplay.getCacheHits(), gifDisplay.getCacheMisses());
+	btWriteString(text);
+#endif
+	sprintf(text, "Frame buffer copy: %d of %d bytes for last frame\n", gifDisplay.getBytesCopied(), MAXCOL*MAXROW);
+	btWriteString(text);
+	sprintf(text, "Frames: %lu late, %lu dropped\n", gifDisplay.getFramesLate(), gifDisplay.getFramesDropped());
+	btWriteString(text);
+#if GIF_QUEUE_DEPTH > 0
+	sprintf(text, "Frame queue: %lu of %d frames (peak %lu), decoder stalled %lu ms\n", gifDisplay.getQueueFrames(),
+	        GIF_QUEUE_DEPTH, gifDisplay.getQueuePeak(), gifDisplay.getQueueStallMs());
+	btWriteString(text);
+#endif
 	btWriteString("0-7=fill screen 0=black/1=red/2=yellow/3=green/4=cyan/5=blue/6=violet/7=white\n");
 	btWriteString("t=draw triangle curve          s=set rotation increment and value\n");
 	btWriteString("r=draw row                     c=draw column\n");
@@ -723,110 +794,417 @@ void loop(void)
 //----------------------------------------------------------------------------------------
 static void prepareNextRotation(void) {
   //----------------------------------------------------------------------------------------
-  uint32_t newCapture;
   //GifPicture VOLATILE *tmp;
   if (MOTOR_OFF) {
-    newCapture = tcReadCounter();
-    period = 150000;
+    pllPeriod = FIX(DEFAULT_PERIOD);
+    pllRate = 0;
   } else {
-    newCapture = tcReadRA();
-    period = newCapture - lastCapture;
+    pllPeriod += pllRate;
   }
-  columnDurationInt = period / XSIZE;
-  columnDurationFrac = period % XSIZE;
-
-  lastCapture = newCapture;
-  nextColumnTimeInt = newCapture;
-  nextColumnTimeFrac = 0;
+  if (pllPeriod < (uint64_t) FIX(MIN_PERIOD)) pllPeriod = FIX(MIN_PERIOD);
+  if (pllPeriod > (uint64_t) FIX(MAX_PERIOD)) pllPeriod = FIX(MAX_PERIOD);
+  period = pllPeriod >> 32;
+  columnDuration = pllPeriod / XSIZE;
 
   rotationCounter++;
-  gifDisplay.nextPictureTick();
+
+  // display time advances with the index times, so animations keep their speed
+  // whatever the rotation period is (a predictor restart may step back a little)
+  int32_t dt = (uint32_t) (rotationStart >> 32) - displayIndex;
+  displayIndex = rotationStart >> 32;
+  if (dt > 0) displayTicks += dt;
+  displayMs += displayTicks / US_TO_TICKS(1000);
+  displayTicks %= US_TO_TICKS(1000);
+  gifDisplay.nextPictureTick(displayMs);
+}
+
+// Glitch rejection and period update for an index pulse captured e ticks after its
+// predicted time. Pulses off the prediction by more than period/8 or less than half
+// a period after the last accepted pulse (double trigger) are rejected. After
+// PLL_MAX_REJECT consecutive rejections (motor start, lost lock) the predictor
+// restarts with the measured interval.
+//----------------------------------------------------------------------------------------
+static int pllUpdate(int32_t e, uint32_t capture)
+//----------------------------------------------------------------------------------------
+{
+  int32_t window = period >> PLL_WINDOW_SHIFT;
+  uint32_t interval = capture - lastCapture;
+
+  if (e >= -window && e <= window && interval > period / 2) {
+    pllRejected = 0;
+    lastCapture = capture;
+    pllPeriod += FIX(e) * PLL_BETA >> PLL_GAIN_SHIFT;
+    pllRate += FIX(e) * PLL_GAMMA >> PLL_GAIN_SHIFT;
+    columnDuration = pllPeriod / XSIZE;   // remaining columns of this rotation
+    return PLL_TRACK;
+  }
+  ++numIndexRejected;
+  if (++pllRejected < PLL_MAX_REJECT) return PLL_REJECT;
+  pllRejected = PLL_MAX_REJECT - 1;   // restart at every pulse until locked again
+  if (interval < MIN_PERIOD) return PLL_REJECT;
+  lastCapture = capture;
+  if (interval > MAX_PERIOD) interval = MAX_PERIOD;
+  pllPeriod = FIX(interval);
+  pllRate = 0;
+  period = interval;
+  columnDuration = pllPeriod / XSIZE;
+  return PLL_RESTART;
+}
+
+// Returns the buffer of column x of the rotation (wheel position w), the column
+// number seq: the one rendered ahead by the main loop if its tag matches the
+// current picture, otherwise the column is rendered now into slot of columnRing.
+//----------------------------------------------------------------------------------------
+static const unsigned char *armColumn(uint32_t seq, int x, int w, int slot)
+//----------------------------------------------------------------------------------------
+{
+  int a = seq % COLUMN_AHEAD;
+
+  columnSeq = seq;
+  columnX = x;
+  ++columnsArmed;
+  if (columnAheadTag[a] == COLUMN_TAG(gifDisplay.getPictureGeneration(), w)) {
+    columnAheadArmed[a] = columnsArmed;
+    columnAheadX[a] = x;
+    return columnAhead[a];
+  }
+  ++numColumnsRendered;
+  columnRingX[slot] = x;
+  RENDER_COLUMN(w, columnRing[slot]);
+  return columnRing[slot];
+}
+
+// Renders the columns following the last armed one into columnAhead, as far as
+// their buffers are no longer output (main loop: between the steps of the GIF
+// player and while delay() waits). The columns of the next rotation come from the
+// next picture if the frame scheduler will switch to it at the rotation start
+// (its generation is the current one + 1). A buffer's tag is cleared before it is
+// written, so the interrupt never arms a buffer being written; a wrong prediction
+// (skipped columns, predictor restart) only leaves a tag that does not match, and
+// a buffer rendered while the picture changed keeps tag 0.
+//----------------------------------------------------------------------------------------
+void renderColumnsAhead(void)
+//----------------------------------------------------------------------------------------
+{
+  uint32_t seq, generation, tag, nextMs;
+  int k, x, r, inc, w, a;
+  bool next = false, due;
+
+  noInterrupts();
+  seq = columnSeq;
+  x = columnX;
+  r = rotVal;
+  inc = rotInc;
+  nextMs = displayMs + (displayTicks + period) / US_TO_TICKS(1000);   // display time of the next rotation
+  generation = gifDisplay.getPictureGeneration();
+  due = gifDisplay.isNextPictureDue(nextMs);
+  interrupts();
+
+  for (k = 1; k <= COLUMN_AHEAD - COLUMN_RING; k++) {
+    if (++x >= XSIZE) {
+      x = 0;
+      r += inc;
+      if (r >= XSIZE) r -= XSIZE;
+      next = due;
+    }
+    w = x + r;
+    if (w >= XSIZE) w -= XSIZE;
+    tag = COLUMN_TAG(generation + next, w);
+    a = (seq + k) % COLUMN_AHEAD;
+    if (columnAheadTag[a] == tag) continue;
+    columnAheadTag[a] = 0;
+    if (columnsArmed - columnAheadArmed[a] < COLUMN_RING) continue;   // still output
+    if (next) RENDER_NEXT_COLUMN(w, columnAhead[a]);
+    else      RENDER_COLUMN(w, columnAhead[a]);
+    if (gifDisplay.getPictureGeneration() != generation) return;
+    columnAheadTag[a] = tag;
+  }
+}
+
+// called by delay() of the Arduino core while it waits
+//----------------------------------------------------------------------------------------
+void yield(void)
+//----------------------------------------------------------------------------------------
+{
+  renderColumnsAhead();
+}
+
+// Called when the last column of a rotation has been output. The next rotation
+// starts at the predicted index time; the index pulse only corrects the
+// prediction (isrIndexPulse), so the column interrupts never wait for it.
+//----------------------------------------------------------------------------------------
+static void startNextRotation(void)
+//----------------------------------------------------------------------------------------
+{
+  if (!MOTOR_OFF && !indexSeen) ++numIndexLate;
+  indexSeen = indexSeenNext;
+  indexSeenNext = false;
+
+  rotationStart += pllPeriod;
+  columnPhase = rotationStart - FIX(COLUMN_LATENCY);
+  wheel = 0;
+  prepareNextRotation();
+  rotVal += rotInc;
+  if (rotVal >= XSIZE) rotVal -= XSIZE;
 }
 
 //----------------------------------------------------------------------------------------
 static void prepareNextColumn(void)
 //----------------------------------------------------------------------------------------
-{  
+{
   int w;
-  int timeAvailable;
-  int timeAvailableMin = 50; // columnDurationInt >> 2;
+  uint32_t nextColumnTime;
+  uint32_t seq = columnSeq;
   //VOLATILE GifPalette *cmap;
 
-  // compute time for next column interrupt and ensure
-  // that this is in the future, otherwise skip columns
+  // advance the column phase and ensure that the
+  // column interrupt is in the future, otherwise skip columns
   while (1) {
-      if (++wheel >= XSIZE) {
-        wheel = 0;
-        prepareNextRotation();
-        rotVal += rotInc;
-        if (rotVal >= XSIZE) rotVal -= XSIZE;
-      }
-            
-      nextColumnTimeInt += columnDurationInt;
-      nextColumnTimeFrac += columnDurationFrac;
-      if (nextColumnTimeFrac >= XSIZE) {
-        nextColumnTimeFrac -= XSIZE;
-        nextColumnTimeInt++;
-      }
-      timeAvailable = nextColumnTimeInt - tcReadCounter();
-      if (timeAvailable >= timeAvailableMin) break;
+      ++seq;
+      if (++wheel >= XSIZE) startNextRotation();
+      else columnPhase += columnDuration;
+
+      nextColumnTime = columnPhase >> 32;
+      if ((int32_t) (nextColumnTime - tcReadCounter()) >= (int32_t) COLUMN_TIME_MIN) break;
 	  ++numColumnsSkipped;
   }
-  
-  tcWriteRC(nextColumnTimeInt);
+
+  tcWriteRC(nextColumnTime);
   tcReadStatusBit(TC_SR_CPCS);   // dummy read to status register
 
-  //  update all strips for next wheel position in parallel to DMA output for last wheel position
-  //digitalWrite(TEST_RED, HIGH); // Red wire
-  toggle = !toggle;
+  // next wheel position
   w = wheel + rotVal;
   if (w >= XSIZE) w -= XSIZE;
+  if (++columnSlot >= COLUMN_RING) columnSlot = 0;
+  column = armColumn(seq, wheel, w, columnSlot);
+}
 
-  updateStrip(strip0[toggle],  w,  0, STRIP0X, STRIP0Y, STRIP0DY, 10);
-  updateStrip(strip1[toggle],  w,  0, STRIP1X, STRIP1Y, STRIP1DY, 10);
-
-  updateStrip(strip23[toggle], w,  0, STRIP2X, STRIP2Y, STRIP2DY, 10);
-  updateStrip(strip23[toggle], w, 10, STRIP3X, STRIP3Y, STRIP3DY, 10);
-  //digitalWrite(TEST_RED, LOW);
+// Index pulse captured in RA (LDRAS interrupt). A pulse in the second half of
+// the rotation is the early index of the next rotation. An accepted pulse moves
+// the start of the current rotation and the column phase towards it; after a
+// restart of the predictor the column output restarts at the pulse.
+//----------------------------------------------------------------------------------------
+void isrIndexPulse(void) {
+  //----------------------------------------------------------------------------------------
+  uint32_t capture = TC0->TC_CHANNEL[TCCHAN].TC_RA;
+  int32_t e = capture - (uint32_t) (rotationStart >> 32);
+  int64_t correction;
+  bool next = false;
+
+  if (MOTOR_OFF) return;
+  if (e > (int32_t) (period / 2)) {
+    e -= period;
+    next = true;
+  }
+  switch (pllUpdate(e, capture)) {
+    case PLL_TRACK:
+      correction = FIX(e) * PLL_ALPHA >> PLL_GAIN_SHIFT;
+      rotationStart += correction;
+      columnPhase += correction;
+      if (next) indexSeenNext = true;
+      else      indexSeen = true;
+      break;
+    case PLL_RESTART:
+      rotationStart = FIX(capture);
+      columnPhase = rotationStart - FIX(COLUMN_LATENCY) - columnDuration;
+      indexSeen = true;
+      indexSeenNext = false;
+      wheel = -1;
+      prepareNextColumn();
+      break;
+  }
 }
 
 //----------------------------------------------------------------------------------------
 void isrColumnTick(void) {
   //----------------------------------------------------------------------------------------
 #if NO_INTERRUPT
-  while (((int) (tcReadCounter() - nextColumnTimeInt) < 0)  && !btCharAvailable())
-    ;
+  while (((int) (tcReadCounter() - TC0->TC_CHANNEL[TCCHAN].TC_RC) < 0)  && !btCharAvailable()) {
+    if (tcReadStatusBit(TC_SR_LDRAS)) isrIndexPulse();
+  }
 #else
   // while(!tcReadStatusBit(TC_SR_CPCS) && !btCharAvailable());
   tcReadStatusBit(TC_SR_CPCS);
 #endif
-  // wait until all DMAs from previous showAll() are completed
-  waitShowAllReady();
-  showAll(strip0[toggle], strip1[toggle], strip23[toggle]);
+  // if the DMAs from previous showAll() are not completed yet, the DMAC interrupt
+  // starts the output of this column
+  if (!showAllWhenReady(column + COLUMN_OFFSET_USART0, COLUMN_BYTES_USART0,
+                        column + COLUMN_OFFSET_USART1, COLUMN_BYTES_USART1,
+                        column + COLUMN_OFFSET_SPI,    COLUMN_BYTES_SPI))
+    ++numDmaOverruns;
   prepareNextColumn();
 }
 
 
+#if COLUMN_DMA_CHAIN
+#if NO_INTERRUPT
+#error COLUMN_DMA_CHAIN requires interrupts
+#endif
+// The linked list of each channel runs over the COLUMN_RING column buffers. The TC compare
+// interrupt refills the columns already output every COLUMN_RING/2 columns.
+static DmacDescriptor chain[SHOW_CHANNELS][2*COLUMN_RING];  // zero padding + column data per column
+static int chainNext;                        // next column of the rotation to be put into the ring
+static uint32_t chainSeq;                    // number of column 0 of the rotation in the ring (see columnSeq)
+static uint32_t chainIndex;                  // index time of the rotation in the ring (TC ticks)
+static uint32_t chainBytes[SHOW_CHANNELS];   // bytes per rotation
+static uint32_t chainPos[SHOW_CHANNELS];     // bytes of the rotation in the ring so far
+
+// Puts the columns up to end (exclusive) into the ring. Column x starts at
+// x * period / XSIZE; the gap to the previous column is filled with zero bytes.
+// Columns which do not fit into the rotation at this byte rate are cut off by
+// the next index pulse and counted as skipped.
+//----------------------------------------------------------------------------------------
+static void fillChain(int end)
+//----------------------------------------------------------------------------------------
+{
+  static const uint16_t count[SHOW_CHANNELS]  = { COLUMN_BYTES_USART0, COLUMN_BYTES_USART1, COLUMN_BYTES_SPI };
+  static const uint16_t offset[SHOW_CHANNELS] = { COLUMN_OFFSET_USART0, COLUMN_OFFSET_USART1, COLUMN_OFFSET_SPI };
+  const unsigned char *src;
+  uint32_t start;
+  int ch, x, w, pad, slot;
+
+  if (end > XSIZE) end = XSIZE;
+  for (x = chainNext; x < end; x++) {
+    w = x + rotVal;
+    if (w >= XSIZE) w -= XSIZE;
+    slot = x % COLUMN_RING;
+    src = armColumn(chainSeq + x, x, w, slot);
+    for (ch = 0; ch < SHOW_CHANNELS; ch++) {
+      start = x * chainBytes[ch] / XSIZE;
+      pad = (int) (start - chainPos[ch]);
+      if (pad < 1) pad = 1;
+      chainSetColumn(chain[ch], COLUMN_RING, ch, slot, src + offset[ch], count[ch], pad, x == XSIZE-1);
+      chainPos[ch] += pad + count[ch];
+      if (chainPos[ch] > chainBytes[ch] && ch == SHOW_SPI) ++numColumnsSkipped;
+    }
+  }
+  chainNext = end;
+}
+
+// Schedules the next refill when the DMA starts the second half of the ring,
+// or the predicted index time when the rotation is in the ring. A time already
+// passed (DMA behind its time slots) is retried a column later.
+//----------------------------------------------------------------------------------------
+static void scheduleChainRefill(void)
+//----------------------------------------------------------------------------------------
+{
+  uint32_t t = chainNext < XSIZE ? chainIndex + (chainNext - COLUMN_RING/2) * period / XSIZE : rotationStart >> 32;
+  uint32_t now = tcReadCounter();
+
+  if ((int32_t) (t - now) < (int32_t) COLUMN_TIME_MIN) t = now + period / XSIZE;
+  tcWriteRC(t);
+}
+
+// Index pulse (RA loaded, or the predicted index time with MOTOR_OFF): restarts
+// the rings for the new rotation with the predicted period. Here rotationStart is
+// the predicted time of the next index pulse; missed pulses are skipped, rejected
+// pulses leave the rings running.
+//----------------------------------------------------------------------------------------
+void isrRotationTick(uint32_t capture) {
+  //----------------------------------------------------------------------------------------
+  int32_t e = capture - (uint32_t) (rotationStart >> 32);
+  int ch;
+
+  while (e > (int32_t) (period / 2)) {
+    e -= period;
+    ++numIndexLate;
+  }
+  if (pllUpdate(e, capture) == PLL_REJECT) return;
+  rotationStart = FIX(capture);
+  prepareNextRotation();
+  rotationStart += pllPeriod;
+  rotVal += rotInc;
+  if (rotVal >= XSIZE) rotVal -= XSIZE;
+
+  if (!showAllReady()) ++numDmaOverruns;   // last rotation's lists still running
+  chainStop();                             // before its descriptors are overwritten
+  chainIndex = capture;
+  chainNext = 0;
+  chainSeq += XSIZE;                       // columns not put into the ring are skipped
+  for (ch = 0; ch < SHOW_CHANNELS; ch++) {
+    chainBytes[ch] = period * TC_DIVIDER / showByteCycles(ch);
+    chainPos[ch] = 0;
+  }
+  fillChain(COLUMN_RING);
+  chainStart(chain[SHOW_USART0], chain[SHOW_USART1], chain[SHOW_SPI]);
+  scheduleChainRefill();
+}
+
+// TC compare: puts the next columns into the part of the rings that all channels
+// have output. With MOTOR_OFF the compare at the predicted index time starts the
+// next rotation.
+//----------------------------------------------------------------------------------------
+void isrChainRefill(void) {
+  //----------------------------------------------------------------------------------------
+  int ch, x, end = XSIZE;
+
+  if (chainNext >= XSIZE) {
+    if (MOTOR_OFF) isrRotationTick(rotationStart >> 32);
+    return;
+  }
+  for (ch = 0; ch < SHOW_CHANNELS; ch++) {
+    x = chainColumn(chain[ch], COLUMN_RING, ch);
+    if (x < 0) continue;
+    x += chainNext - chainNext % COLUMN_RING;      // column of the rotation in ring slot x
+    if (x >= chainNext) x -= COLUMN_RING;
+    if (x + COLUMN_RING < end) end = x + COLUMN_RING;
+  }
+  fillChain(end);
+  scheduleChainRefill();
+}
+#endif
+
 //----------------------------------------------------------------------------------------
 void isrColumnTickInit(void) 
 //----------------------------------------------------------------------------------------
 {  
+  uint32_t capture0, capture1, lastPeriod;
+
   //showAll(strip01[toggle], strip23[toggle], strip45[toggle]);
-  showAll(strip0[toggle], strip1[toggle], strip23[toggle]);
+  showAll(strip0, strip1, strip23);
   tcReadRA(); // dummy read for synchronization
+  // initial period and its change from the next three index pulses
+  capture0 = tcReadRA();
+  capture1 = tcReadRA();
   lastCapture = tcReadRA();
-  wheel = XSIZE-1;
-  //prepareNextRotation();
+  lastPeriod = capture1 - capture0;
+  period = lastCapture - capture1;
+  pllPeriod = FIX(period);
+  pllRate = FIX((int32_t) (period - lastPeriod));
+  rotationStart = FIX(lastCapture);
+  prepareNextRotation();
+#if COLUMN_DMA_CHAIN
+  // without motor, the rotations are started by the compare at the predicted index time
+  if (MOTOR_OFF) rotationStart = FIX(lastCapture = tcReadCounter());
+  rotationStart += pllPeriod;
+  chainNext = XSIZE;
+  columnSeq = chainSeq + XSIZE - 1;     // the main loop renders the first columns ahead
+  columnX = XSIZE - 1;
+  scheduleChainRefill();
+  TC0->TC_CHANNEL[TCCHAN].TC_IER = TC_IER_CPCS | TC_IER_LDRAS;
+  TC0->TC_CHANNEL[TCCHAN].TC_IDR = ~(TC_IER_CPCS | TC_IER_LDRAS);
+  NVIC_EnableIRQ(TCIRQ);
+#else
+  indexSeen = true;
+  columnPhase = rotationStart - FIX(COLUMN_LATENCY) - columnDuration;
+  wheel = -1;
   prepareNextColumn();
 #if NO_INTERRUPT==0
-  TC0->TC_CHANNEL[TCCHAN].TC_IER = TC_IER_CPCS;
-  TC0->TC_CHANNEL[TCCHAN].TC_IDR = ~TC_IER_CPCS;
+  TC0->TC_CHANNEL[TCCHAN].TC_IER = TC_IER_CPCS | TC_IER_LDRAS;
+  TC0->TC_CHANNEL[TCCHAN].TC_IDR = ~(TC_IER_CPCS | TC_IER_LDRAS);
   NVIC_EnableIRQ(TCIRQ);
 #endif
+#endif
 }
 
 //----------------------------------------------------------------------------------------
 void TC1_Handler(void) {
   //----------------------------------------------------------------------------------------
-  isrColumnTick();
+#if COLUMN_DMA_CHAIN
+  if (tcReadStatusBit(TC_SR_LDRAS) && !MOTOR_OFF) isrRotationTick(TC0->TC_CHANNEL[TCCHAN].TC_RA);
+  if (tcReadStatusBit(TC_SR_CPCS)) isrChainRefill();
+#else
+  if (tcReadStatusBit(TC_SR_LDRAS)) isrIndexPulse();
+  if (tcReadStatusBit(TC_SR_CPCS)) isrColumnTick();
+#endif
 }
@@ -0,0 +1,29 @@
+// Host replacement for the Arduino core header.
+// Only the parts used by the POV Cylinder libraries are provided.
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sam3x.h"
+
+typedef uint8_t byte;
+typedef bool    boolean;
+
+#define LOW     0
+#define HIGH    1
+#define INPUT   0
+#define OUTPUT  1
+
+void pinMode(uint32_t pin, uint32_t mode);
+void digitalWrite(uint32_t pin, uint32_t value);
+
+unsigned long micros(void);
+unsigned long millis(void);
+void delay(unsigned long ms);
+void yield(void);    // called by delay() while it waits
+
+#endif
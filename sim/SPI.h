@@ -0,0 +1,15 @@
+// Host replacement for the Arduino SPI library (byte transfers on SPI0)
+#ifndef SPI_H
+#define SPI_H
+
+#include "Arduino.h"
+
+class SPIClass
+{
+    public:
+        uint8_t transfer(uint8_t data);
+};
+
+extern SPIClass SPI;
+
+#endif
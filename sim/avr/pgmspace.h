@@ -0,0 +1,11 @@
+// Host replacement for <avr/pgmspace.h>
+// On the host flash and RAM share one address space, so PROGMEM is a no-op.
+#ifndef PGMSPACE_H
+#define PGMSPACE_H
+
+#define PROGMEM
+#define pgm_read_byte(addr)   (*(const unsigned char *)(addr))
+#define pgm_read_word(addr)   (*(const unsigned short *)(addr))
+#define pgm_read_dword(addr)  (*(const unsigned long *)(addr))
+
+#endif
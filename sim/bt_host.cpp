@@ -0,0 +1,69 @@
+// Bluetooth driver of the host build: the terminal takes the place of the HC06 module
+#include "Arduino.h"
+#include "bt.h"
+#include "host.h"
+
+FILE *btOut = stdout;
+
+//---------------------------------------------------------------------------------------
+void btInit(uint32_t baudrate)
+//---------------------------------------------------------------------------------------
+{
+  setvbuf(stdout, NULL, _IOLBF, 0);
+}
+
+//---------------------------------------------------------------------------------------
+void btWriteString(char const *textPtr)
+//---------------------------------------------------------------------------------------
+{
+  if (btOut) fputs(textPtr, btOut);
+}
+
+//---------------------------------------------------------------------------------------
+void btWriteChar(char ch)
+//---------------------------------------------------------------------------------------
+{
+  if (btOut) fputc(ch, btOut);
+}
+
+//---------------------------------------------------------------------------------------
+char btReadChar(void)
+//---------------------------------------------------------------------------------------
+{
+  int ch = getchar();
+  if (ch == EOF) exit(0);
+  return ch;
+}
+
+//---------------------------------------------------------------------------------------
+int btReadString(char *cp, int nmax)
+//---------------------------------------------------------------------------------------
+{
+  char ch;
+  int n = 1;
+
+  while (n < nmax) {
+    ch = btReadChar();
+    if (ch == 13 || ch == '\n') break;
+    *cp++ = ch;
+    n++;
+  }
+  *cp = 0;
+  return n;
+}
+
+//---------------------------------------------------------------------------------------
+void btReadData(uint8_t *cp, int len)
+//---------------------------------------------------------------------------------------
+{
+  while (len--) {
+    *cp++ = btReadChar();
+  }
+}
+
+//---------------------------------------------------------------------------------------
+int btCharAvailable(void)
+//---------------------------------------------------------------------------------------
+{
+  return 0;
+}
@@ -0,0 +1,42 @@
+// Arduino time functions on top of the host monotonic clock
+#include <time.h>
+#include "Arduino.h"
+
+//---------------------------------------------------------------------------------------
+static uint64_t hostNanos(void)
+//---------------------------------------------------------------------------------------
+{
+  struct timespec ts;
+  static uint64_t start;
+  uint64_t ns;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+  if (start == 0) start = ns;
+  return ns - start;
+}
+
+//---------------------------------------------------------------------------------------
+unsigned long micros(void)
+//---------------------------------------------------------------------------------------
+{
+  return (unsigned long) (hostNanos() / 1000);
+}
+
+//---------------------------------------------------------------------------------------
+unsigned long millis(void)
+//---------------------------------------------------------------------------------------
+{
+  return (unsigned long) (hostNanos() / 1000000);
+}
+
+//---------------------------------------------------------------------------------------
+void delay(unsigned long ms)
+//---------------------------------------------------------------------------------------
+{
+  struct timespec ts;
+
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000;
+  nanosleep(&ts, NULL);
+}
@@ -0,0 +1,93 @@
+// Host microbenchmark of the column fetch
+//
+// Measures GifDisplay::renderThisColumn, which fetches the pixels of every strip
+// of a column from the frame buffer and converts them into the LED byte streams
+// output by the ISR, for all columns of a picture. Built twice: colbench with the
+// row-major frame buffer and colbench-strip with FRAME_STRIP_MAJOR (geometry.h).
+// The checksum of the rendered columns must be the same for both layouts.
+//
+// Usage: colbench [-n loops]
+//   -n  number of rendered frames per run (default 2000); the fastest of
+//       RUNS runs is reported
+//
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mpcgif.h"
+#include "trace.h"
+#include "xwin.h"
+
+#define RUNS 10
+
+// objects normally defined by mpc.ino
+Trace trace;
+uint32_t rotationCounter;
+
+static GifDisplay gifDisplay;
+
+void xAllocateColorMap(int length, const unsigned char *rgb) {}
+void xWaitRotation(GifDisplay *display) {}
+void xShowFrameBuffer(GifDisplay *display) {}
+
+
+//---------------------------------------------------------------------------------------
+static double nowNs(void)
+//---------------------------------------------------------------------------------------
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//---------------------------------------------------------------------------------------
+int main(int argc, char **argv)
+//---------------------------------------------------------------------------------------
+{
+  int opt, i, r, x, y, w, loops = 2000;
+  unsigned seed = 1, sum = 0;
+  double t, ns = 0;
+  unsigned char column[COLUMN_BYTES];
+
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    switch (opt) {
+      case 'n': loops = atoi(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-n loops]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (loops < 1) loops = 1;
+  trace.stop();
+
+  // random picture using the 8 colours of the default palette
+  for (x = 0; x < XSIZE; x++)
+    for (y = 0; y < YSIZE; y++) {
+      seed = seed * 1103515245 + 12345;
+      gifDisplay.setThisPixel(x, y, (seed >> 16) & 7);
+    }
+
+  gifDisplay.renderThisPicture();
+  for (w = 0; w < XSIZE; w++)       // warm up caches
+    gifDisplay.renderThisColumn(w, column);
+  for (r = 0; r < RUNS; r++) {
+    t = nowNs();
+    for (i = 0; i < loops; i++)
+      for (w = 0; w < XSIZE; w++)
+        gifDisplay.renderThisColumn(w, column);
+    t = (nowNs() - t) / loops;
+    if (r == 0 || t < ns) ns = t;
+  }
+
+  for (w = 0; w < XSIZE; w++) {
+    gifDisplay.renderThisColumn(w, column);
+    for (i = 0; i < COLUMN_BYTES; i++) sum = sum * 31 + column[i];
+  }
+
+  printf("%-12s %9.2f us/frame %8.1f ns/column %6.2f ns/LED  checksum %08x\n",
+         FRAME_STRIP_MAJOR ? "strip-major" : "row-major",
+         ns / 1e3, ns / XSIZE, ns / (XSIZE * YSIZE), sum);
+  return 0;
+}
@@ -0,0 +1,376 @@
+// Converter of GIF files into POV streams (format see mpcgif.h)
+//
+// Decodes one loop of a GIF with the unchanged mpcgif decoder and stores every
+// displayed frame as it is handed to the ISR: composited, replicated, with the
+// palette resolved into one RGB palette for the whole stream and the delay in
+// rotations. The frames are written as differences to their predecessors.
+//
+// The stream is then played with GifDisplay::showPov for a few loops and every
+// displayed picture is rendered and compared with the one of the decoded GIF.
+//
+// Usage: gif2pov [-o file] [-c name] [-n loops] [-w left,top,width,height] [-v] [asset|file.gif ...]
+//   -o  write the POV stream of the (single) asset to a binary file
+//   -c  write it as C header with an array of the given name to stdout
+//   -n  number of loops played for the check and the timing (default 10)
+//   -w  crop window of the GIF screen (GifDisplay::setCrop); GIF files larger
+//       than the cylinder are scaled down to fit in any case
+//   -v  print one line per frame
+//   Without -o and -c all (or the given) assets of the GIF library are
+//   converted and checked; a table with the stream size, the changed pixels per
+//   frame and the decode and play time per frame is printed.
+//
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mpcgif.h"
+#include "pictures.h"
+#include "trace.h"
+#include "xwin.h"
+
+#define MAXFRAMES   256
+#define MAXSTREAM   (1 << 20)
+#define MAXFILE     (1 << 20)
+#define FRAMESIZE   (MAXCOL * MAXROW)
+
+// objects normally defined by mpc.ino
+Trace trace;
+uint32_t rotationCounter;
+
+static GifDisplay gifDisplay;
+
+// decoded frames
+static int           numFrames;
+static bool          capture;                             // store frames in xWaitRotation
+static bool          framePending;
+static unsigned char frameData[MAXFRAMES][FRAMESIZE];     // palette indices of frame palette
+static unsigned long frameColours[MAXFRAMES][COLORMAPSIZE];
+static int           frameRotations[MAXFRAMES];
+
+// checksums of the rendered columns of displayed frames
+static bool          checking;
+static unsigned      frameSum[MAXFRAMES];
+static int           numSums, numErrors;
+
+static unsigned char stream[MAXSTREAM];
+static unsigned char fileData[MAXFILE];
+
+
+//---------------------------------------------------------------------------------------
+static double nowNs(void)
+//---------------------------------------------------------------------------------------
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//---------------------------------------------------------------------------------------
+void xAllocateColorMap(int length, const unsigned char *rgb)
+//---------------------------------------------------------------------------------------
+{
+}
+
+// first call after a frame has been rendered stores the frame
+//---------------------------------------------------------------------------------------
+void xWaitRotation(GifDisplay *display)
+//---------------------------------------------------------------------------------------
+{
+  const unsigned char *rgb;
+  int i, x, length, delay;
+
+  rotationCounter++;
+  if (!capture || framePending) return;
+  framePending = true;
+  if (numFrames >= MAXFRAMES) {
+    fprintf(stderr, "gif2pov: more than %d frames\n", MAXFRAMES);
+    exit(1);
+  }
+  for (x = 0; x < MAXCOL; x++)   // with the copies of a narrow GIF (see set_column_map)
+    memcpy(frameData[numFrames] + x * MAXROW, (const void *) &display->nextPicture->data[display->nextPicture->column_map[x]], MAXROW);
+  rgb = display->frame_palette(display->nextPicture)->rgb;
+  length = display->frame_palette(display->nextPicture)->length;
+  for (i = 0; i < COLORMAPSIZE; i++)   // unused entries are black (set_led_palette)
+    frameColours[numFrames][i] = i < length ? (unsigned long) rgb[3*i] << 16 | rgb[3*i+1] << 8 | rgb[3*i+2] : 0;
+  // delay in whole rotations of ROTATION_PERIOD_MS, at least one (see schedule_next_picture)
+  delay = display->nextPicture->delay_ms;
+  frameRotations[numFrames] = delay <= 0 ? 1 : (delay + ROTATION_PERIOD_MS - 1) / ROTATION_PERIOD_MS;
+  numFrames++;
+}
+
+//---------------------------------------------------------------------------------------
+void xShowFrameBuffer(GifDisplay *display)
+//---------------------------------------------------------------------------------------
+{
+  unsigned char column[COLUMN_BYTES];
+  unsigned sum = 0;
+  int w, i;
+
+  framePending = false;
+  if (!checking) return;
+  for (w = 0; w < XSIZE; w++) {
+    display->renderThisColumn(w, column);
+    for (i = 0; i < COLUMN_BYTES; i++) sum = sum * 31 + column[i];
+  }
+  if (capture) {
+    frameSum[numSums++ % MAXFRAMES] = sum;
+  } else if (sum != frameSum[numSums++ % numFrames]) {
+    numErrors++;
+  }
+}
+
+// appends the record of frame f relative to the frame buffer base
+//---------------------------------------------------------------------------------------
+static int putRecord(unsigned char *r, const unsigned char *frame, const unsigned char *base, int rotations)
+//---------------------------------------------------------------------------------------
+{
+  unsigned char *p = r + POV_RECORD_SIZE;
+  int i = 0, n, skip, size;
+
+#define CHANGED(i) (frame[i] != base[i])
+  while (i < FRAMESIZE) {
+    for (skip = 0; skip < 255 && i < FRAMESIZE && !CHANGED(i); skip++) i++;
+    if (i == FRAMESIZE) break;
+    // a run ends before 3 unchanged pixels
+    for (n = 0; n < 255 && i + n < FRAMESIZE &&
+                (CHANGED(i + n) || (i + n + 2 < FRAMESIZE && (CHANGED(i + n + 1) || CHANGED(i + n + 2)))); n++)
+      ;
+    *p++ = skip;
+    *p++ = n;
+    memcpy(p, frame + i, n);
+    p += n;
+    i += n;
+  }
+#undef CHANGED
+
+  size = p - r;
+  if (size > 0xFFFF) {
+    fprintf(stderr, "gif2pov: record too large\n");
+    exit(1);
+  }
+  r[0] = size;
+  r[1] = size >> 8;
+  r[2] = rotations;
+  r[3] = rotations >> 8;
+  return size;
+}
+
+// converts the decoded frames into a POV stream, returns its size
+//---------------------------------------------------------------------------------------
+static int convert(void)
+//---------------------------------------------------------------------------------------
+{
+  static unsigned char frames[MAXFRAMES][FRAMESIZE];      // indices of stream palette
+  static unsigned char background[FRAMESIZE];
+  unsigned long palette[COLORMAPSIZE], c;
+  unsigned char map[COLORMAPSIZE];
+  long count[COLORMAPSIZE];
+  bool used[COLORMAPSIZE];
+  int f, i, j, colours = 0, size;
+
+  // one palette for all frames
+  for (f = 0; f < numFrames; f++) {
+    memset(used, 0, sizeof(used));
+    for (i = 0; i < FRAMESIZE; i++) used[frameData[f][i]] = true;
+    for (i = 0; i < COLORMAPSIZE; i++) {
+      map[i] = 0;
+      if (!used[i]) continue;
+      c = frameColours[f][i];
+      for (j = 0; j < colours && palette[j] != c; j++)
+        ;
+      if (j == colours) {
+        if (colours == COLORMAPSIZE) {
+          fprintf(stderr, "gif2pov: more than %d colours\n", COLORMAPSIZE);
+          exit(1);
+        }
+        palette[colours++] = c;
+      }
+      map[i] = j;
+    }
+    for (i = 0; i < FRAMESIZE; i++) frames[f][i] = map[frameData[f][i]];
+  }
+
+  // background: most frequent pixel of the key frame
+  memset(count, 0, sizeof(count));
+  for (i = 0; i < FRAMESIZE; i++) count[frames[0][i]]++;
+  for (i = j = 0; i < colours; i++)
+    if (count[i] > count[j]) j = i;
+  memset(background, j, FRAMESIZE);
+
+  memcpy(stream, POV_MAGIC, 4);
+  stream[4] = XSIZE;
+  stream[5] = YSIZE;
+  stream[6] = FRAME_STRIP_MAJOR ? POV_STRIP_MAJOR : 0;
+  stream[7] = j;
+  stream[8] = numFrames;
+  stream[9] = numFrames >> 8;
+  stream[10] = colours;
+  stream[11] = colours >> 8;
+  size = POV_HEADER_SIZE;
+  for (i = 0; i < colours; i++) {
+    stream[size++] = palette[i] >> 16;
+    stream[size++] = palette[i] >> 8;
+    stream[size++] = palette[i];
+  }
+  size += putRecord(stream + size, frames[0], background, frameRotations[0]);
+  for (f = 0; f < numFrames; f++)
+    size += putRecord(stream + size, frames[f], frames[(f + numFrames - 1) % numFrames], frameRotations[f]);
+  return size;
+}
+
+// decodes and converts one GIF, checks and times the POV stream
+//---------------------------------------------------------------------------------------
+static int gif2pov(const char *name, const unsigned char *data, unsigned length, int loops, bool verbose)
+//---------------------------------------------------------------------------------------
+{
+  int i, size, pixels = 0;
+  double decodeNs, playNs;
+  const unsigned char *r;
+
+  // one loop to start from the same frame buffer as the stream (background)
+  numFrames = numSums = numErrors = 0;
+  framePending = false;
+  gifDisplay.init();
+  capture = checking = true;
+  gifDisplay.showGif(length, data);
+  capture = false;
+  if (numFrames == 0) {
+    fprintf(stderr, "gif2pov: %s: no frames decoded\n", name);
+    exit(1);
+  }
+
+  decodeNs = nowNs();
+  checking = false;
+  for (i = 0; i < loops; i++)
+    gifDisplay.showGif(length, data);
+  decodeNs = (nowNs() - decodeNs) / loops / numFrames;
+
+  size = convert();
+
+  // check loops: key frame, depth < 2 and incremental frames
+  gifDisplay.init();
+  numSums = 0;
+  checking = true;
+  for (i = 0; i < 3; i++)
+    gifDisplay.showPov(size, stream);
+  checking = false;
+
+  playNs = nowNs();
+  for (i = 0; i < loops; i++)
+    gifDisplay.showPov(size, stream);
+  playNs = (nowNs() - playNs) / loops / numFrames;
+
+  r = stream + POV_HEADER_SIZE + 3 * (stream[10] | stream[11] << 8);
+  r += r[0] | r[1] << 8;   // key frame
+  for (i = 0; i < numFrames; i++, r += r[0] | r[1] << 8) {
+    int n = 0;
+    for (const unsigned char *p = r + POV_RECORD_SIZE; p < r + (r[0] | r[1] << 8); p += 2 + p[1]) n += p[1];
+    pixels += n;
+    if (verbose)
+      fprintf(stderr, "  frame %3d: %5d bytes %5d pixels  %3d rotations\n", i, r[0] | r[1] << 8, n, r[2] | r[3] << 8);
+  }
+
+  if (numErrors) {
+    fprintf(stderr, "gif2pov: %s: %d of %d frames of the POV stream differ from the GIF\n", name, numErrors, numSums);
+    exit(1);
+  }
+  fprintf(stderr, "%-18s %6u %6d %7d %9d %9.1f %9.1f\n",
+          name, length, numFrames, size, pixels / numFrames, decodeNs / 1e3, playNs / 1e3);
+  return size;
+}
+
+//---------------------------------------------------------------------------------------
+static bool selected(const char *name, int argc, char **argv)
+//---------------------------------------------------------------------------------------
+{
+  int i;
+
+  if (argc == 0) return true;
+  for (i = 0; i < argc; i++)
+    if (strcmp(name, argv[i]) == 0) return true;
+  return false;
+}
+
+//---------------------------------------------------------------------------------------
+int main(int argc, char **argv)
+//---------------------------------------------------------------------------------------
+{
+  int i, opt, size, loops = 10;
+  int cropLeft = 0, cropTop = 0, cropWidth = 0, cropHeight = 0;
+  const char *outFile = 0, *arrayName = 0, *name;
+  const unsigned char *data = 0;
+  unsigned length = 0;
+  bool verbose = false;
+  FILE *f;
+
+  while ((opt = getopt(argc, argv, "o:c:n:w:v")) != -1) {
+    switch (opt) {
+      case 'o': outFile = optarg;       break;
+      case 'c': arrayName = optarg;     break;
+      case 'n': loops = atoi(optarg);   break;
+      case 'w':
+        if (sscanf(optarg, "%d,%d,%d,%d", &cropLeft, &cropTop, &cropWidth, &cropHeight) != 4) {
+          fprintf(stderr, "gif2pov: -w left,top,width,height\n");
+          return 1;
+        }
+        break;
+      case 'v': verbose = true;         break;
+      default:
+        fprintf(stderr, "Usage: %s [-o file] [-c name] [-n loops] [-w left,top,width,height] [-v] [asset|file.gif ...]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (loops < 1) loops = 1;
+  trace.stop();
+  gifDisplay.enableCache(false);
+  gifDisplay.setCrop(cropLeft, cropTop, cropWidth, cropHeight);
+
+  fprintf(stderr, "%-18s %6s %6s %7s %9s %9s %9s\n",
+          "asset", "gif", "frames", "pov", "pixels", "decode", "play[us]");
+  if (!outFile && !arrayName) {
+    for (i = 0; gifFiles[i].length > 0; i++)
+      if (selected(gifFiles[i].name, argc - optind, argv + optind))
+        gif2pov(gifFiles[i].name, gifFiles[i].data, gifFiles[i].length, loops, verbose);
+    return 0;
+  }
+
+  if (argc - optind != 1) {
+    fprintf(stderr, "%s: -o and -c convert exactly one asset or GIF file\n", argv[0]);
+    return 1;
+  }
+  name = argv[optind];
+  for (i = 0; gifFiles[i].length > 0; i++)
+    if (strcmp(name, gifFiles[i].name) == 0) {
+      data = gifFiles[i].data;
+      length = gifFiles[i].length;
+    }
+  if (!data) {
+    if (!(f = fopen(name, "rb"))) {
+      fprintf(stderr, "%s: %s is neither an asset nor a readable file\n", argv[0], name);
+      return 1;
+    }
+    length = fread(fileData, 1, MAXFILE, f);
+    fclose(f);
+    data = fileData;
+  }
+  size = gif2pov(name, data, length, loops, verbose);
+
+  if (outFile) {
+    if (!(f = fopen(outFile, "wb")) || fwrite(stream, 1, size, f) != (size_t) size) {
+      fprintf(stderr, "%s: cannot write %s\n", argv[0], outFile);
+      return 1;
+    }
+    fclose(f);
+  }
+  if (arrayName) {
+    printf("// POV stream: %s (sim/gif2pov)\n", name);
+    printf("static const unsigned char %s[%d] PROGMEM = {", arrayName, size);
+    for (i = 0; i < size; i++)
+      printf("%s0x%02X%s", i % 16 ? "" : "\n  ", stream[i], i + 1 < size ? "," : "\n");
+    printf("};\n");
+  }
+  return 0;
+}
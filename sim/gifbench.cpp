@@ -0,0 +1,303 @@
+// Host benchmark of GifDisplay
+//
+// Decodes every entry of gifFiles[] (libraries/pictures) with the unchanged
+// mpcgif decoder and reports the decode time per frame, pixels/s and bytes/s
+// of each asset, and the host cycles per pixel (time stamp counter cycles on
+// x86, otherwise ns) and the frame buffer bytes copied per frame when the
+// next picture is prepared from the current one (MAXCOL*MAXROW for a full
+// copy, less with dirty rectangles). A frame is decoded while its predecessor is displayed, so its
+// budget is the predecessor's display time: its delay, at least one rotation of
+// ROTATION_PERIOD_MS. Frames exceeding that budget are shown late or dropped.
+// The decode statistics are measured with the animation cache disabled. Then
+// the asset is played with the cache: the first loop fills it, one replayed
+// loop is compared frame by frame with the decoded loop, and the replay time
+// per frame of the following loops is reported ("live" if the GIF does not fit
+// into GIF_CACHE_SIZE). Finally one loop is played with GifDisplay::step and
+// the longest step is reported, i.e. the longest time the main loop is blocked
+// (fastest of the loops).
+//
+// Usage: gifbench [-m] [-n loops] [-r rows] [-s slowdown] [-v] [asset ...]
+//   -m  print the RAM used by GifDisplay (GifDisplay::printRamBudget, host
+//       sizes) and exit
+//   -n  number of times each GIF is played (default 10)
+//   -r  rows decoded per step (default 8)
+//   -s  slowdown of the target compared to this host, applied to the budget
+//       check only (default 1, i.e. budget check for host speed)
+//   -v  print one line per frame
+//
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "mpcgif.h"
+#include "pictures.h"
+#include "trace.h"
+#include "xwin.h"
+
+#define MAXSAMPLES 8192   // decoded frames over all loops of one asset
+
+// objects normally defined by mpc.ino
+Trace trace;
+uint32_t rotationCounter;
+
+static GifDisplay gifDisplay;
+
+// per decoded frame
+static double decodeNs[MAXSAMPLES];
+static long   framePixels[MAXSAMPLES];
+static int    frameDelay[MAXSAMPLES];
+static int    numSamples;
+static int    numDecoded;     // may exceed MAXSAMPLES
+static unsigned long lastPixels;  // GifDisplay::getPixelsDecoded at the last sample
+
+static bool   framePending;   // decoded frame waits for the picture swap
+static double frameStart;     // time when decoding of current frame started
+
+// frame buffer checksums of the displayed frames (cache check)
+static bool     checking;
+static unsigned frameSum[MAXSAMPLES];
+static int      numSums;
+
+
+//---------------------------------------------------------------------------------------
+static double nowNs(void)
+//---------------------------------------------------------------------------------------
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// host cycles per ns
+//---------------------------------------------------------------------------------------
+static double cyclesPerNs(void)
+//---------------------------------------------------------------------------------------
+{
+#if defined(__x86_64__) || defined(__i386__)
+  double t = nowNs();
+  unsigned long long c = __rdtsc();
+  while (nowNs() - t < 50e6)
+    ;
+  return (__rdtsc() - c) / (nowNs() - t);
+#else
+  return 1.0;
+#endif
+}
+
+//---------------------------------------------------------------------------------------
+void xAllocateColorMap(int length, const unsigned char *rgb)
+//---------------------------------------------------------------------------------------
+{
+}
+
+// first call after a frame has been decoded stops its decode timer
+//---------------------------------------------------------------------------------------
+void xWaitRotation(GifDisplay *display)
+//---------------------------------------------------------------------------------------
+{
+  double t = nowNs();
+
+  if (!framePending && numDecoded++ < MAXSAMPLES) {
+    decodeNs[numSamples] = t - frameStart;
+    // the frame rectangle is not in nextPicture if the frame went through the queue
+    framePixels[numSamples] = display->getPixelsDecoded() - lastPixels;
+    lastPixels = display->getPixelsDecoded();
+    frameDelay[numSamples] = display->nextPicture->delay_ms;
+    numSamples++;
+  }
+  framePending = true;
+  rotationCounter++;
+}
+
+// picture swap: decoding of next frame starts
+//---------------------------------------------------------------------------------------
+void xShowFrameBuffer(GifDisplay *display)
+//---------------------------------------------------------------------------------------
+{
+  const volatile unsigned char *p = &display->thisPicture->data[0][0];
+  unsigned sum = 0;
+  int i;
+
+  if (checking && numSums < MAXSAMPLES) {
+    for (i = 0; i < MAXCOL * MAXROW; i++) sum = sum * 31 + p[i];
+    frameSum[numSums++] = sum;
+  }
+  framePending = false;
+  frameStart = nowNs();
+}
+
+// plays the GIF with the animation cache, returns the replay time per frame in ns
+// or -1 if the GIF is decoded live
+//---------------------------------------------------------------------------------------
+static double benchCache(const GifFile *gif, int loops, int frames, int *used, bool *ok)
+//---------------------------------------------------------------------------------------
+{
+  int i, n;
+  double t;
+
+  gifDisplay.enableCache(true);
+  checking = true;
+  numSums = 0;
+  gifDisplay.showGif(gif->length, gif->data);   // decode and fill cache
+  n = numSums;
+  gifDisplay.showGif(gif->length, gif->data);   // replay
+  checking = false;
+  *ok = true;
+  for (i = n; i < numSums; i++)
+    if (frameSum[i] != frameSum[i - n]) *ok = false;
+  *used = gifDisplay.getCacheUsed();
+  if (*used < 0) {
+    gifDisplay.enableCache(false);
+    return -1;
+  }
+
+  t = nowNs();
+  for (i = 0; i < loops; i++)
+    gifDisplay.showGif(gif->length, gif->data);
+  t = nowNs() - t;
+  gifDisplay.enableCache(false);
+  return t / loops / frames;
+}
+
+// plays one loop with step(rows), returns the longest step in ns
+//---------------------------------------------------------------------------------------
+static double benchStep(const GifFile *gif, int rows)
+//---------------------------------------------------------------------------------------
+{
+  double t, maxNs = 0;
+  int r;
+
+  gifDisplay.startGif(gif->length, gif->data);
+  do {
+    t = nowNs();
+    r = gifDisplay.step(rows);
+    t = nowNs() - t;
+    if (t > maxNs) maxNs = t;
+  } while (r != GifDisplay::STEP_DONE);
+  return maxNs;
+}
+
+// time a picture with the given delay stays current (see schedule_next_picture)
+//---------------------------------------------------------------------------------------
+static int displayMs(int delay_ms)
+//---------------------------------------------------------------------------------------
+{
+  return delay_ms > ROTATION_PERIOD_MS ? delay_ms : ROTATION_PERIOD_MS;
+}
+
+//---------------------------------------------------------------------------------------
+static bool selected(const char *name, int argc, char **argv)
+//---------------------------------------------------------------------------------------
+{
+  int i;
+
+  if (argc == 0) return true;
+  for (i = 0; i < argc; i++)
+    if (strcmp(name, argv[i]) == 0) return true;
+  return false;
+}
+
+//---------------------------------------------------------------------------------------
+static void benchGif(const GifFile *gif, int loops, int rows, double slowdown, double ghz, bool verbose)
+//---------------------------------------------------------------------------------------
+{
+  int i, n, frames, samples, over = 0;
+  double total = 0, maxNs = 0, load, maxLoad = 0;
+  long pixels = 0;
+  double budgetNs, cachedNs, stepNs, t;
+  unsigned long copied;
+  bool ok;
+  int used;
+  char cache[32];
+
+  numSamples = numDecoded = 0;
+  framePending = false;
+  lastPixels = gifDisplay.getPixelsDecoded();
+  frameStart = nowNs();
+  copied = gifDisplay.getBytesCopiedTotal();
+  for (i = 0; i < loops; i++)
+    gifDisplay.showGif(gif->length, gif->data);
+  copied = gifDisplay.getBytesCopiedTotal() - copied;
+
+  frames = numDecoded / loops;
+  if (frames == 0) {
+    printf("%-18s no frames decoded\n", gif->name);
+    return;
+  }
+  samples = numSamples - numSamples % frames;
+
+  for (i = 0; i < samples; i++) {
+    n = i % frames;
+    // frame n is decoded while frame n-1 is current (the last frame when looping)
+    budgetNs = displayMs(frameDelay[(n + frames - 1) % frames]) * 1e6;
+    load = decodeNs[i] * slowdown / budgetNs;
+    if (load > 1.0) over++;
+    if (load > maxLoad) maxLoad = load;
+    if (decodeNs[i] > maxNs) maxNs = decodeNs[i];
+    total += decodeNs[i];
+    pixels += framePixels[i];
+    if (verbose && i < frames)
+      printf("  frame %3d: %5ld pixels  delay %5d ms  decode %9.1f us  budget %4.0f ms  load %6.2f%%\n",
+             n, framePixels[i], frameDelay[i], decodeNs[i] / 1e3, budgetNs / 1e6, 100 * load);
+  }
+
+  cachedNs = benchCache(gif, loops, frames, &used, &ok);
+  if (cachedNs < 0) snprintf(cache, sizeof(cache), "%7s %9s", "live", "-");
+  else snprintf(cache, sizeof(cache), "%7d %9.1f", used, cachedNs / 1e3);
+  stepNs = benchStep(gif, rows);
+  for (i = 1; i < loops; i++) {     // the fastest loop filters out host interrupts
+    t = benchStep(gif, rows);
+    if (t < stepNs) stepNs = t;
+  }
+
+  printf("%-18s %6u %6d %9.1f %9.1f %9.2f %7.1f %9.2f %7lu %7.2f%% %5d %s %8.1f%s\n",
+         gif->name, gif->length, frames,
+         total / 1e3 / samples, maxNs / 1e3,
+         pixels / total * 1e3,                                   // Mpixel/s
+         total * ghz / pixels,                                   // cycles/pixel
+         (double) gif->length * samples / frames / total * 1e3,  // MB/s
+         copied / numDecoded,                                    // bytes copied per frame
+         100 * maxLoad, over, cache, stepNs / 1e3, ok ? "" : "  CACHE MISMATCH");
+}
+
+//---------------------------------------------------------------------------------------
+int main(int argc, char **argv)
+//---------------------------------------------------------------------------------------
+{
+  int i, opt, loops = 10, rows = 8;
+  double slowdown = 1.0, ghz;
+  bool verbose = false;
+
+  while ((opt = getopt(argc, argv, "mn:r:s:v")) != -1) {
+    switch (opt) {
+      case 'm': gifDisplay.printRamBudget(); return 0;
+      case 'n': loops = atoi(optarg);    break;
+      case 'r': rows = atoi(optarg);     break;
+      case 's': slowdown = atof(optarg); break;
+      case 'v': verbose = true;          break;
+      default:
+        fprintf(stderr, "Usage: %s [-m] [-n loops] [-r rows] [-s slowdown] [-v] [asset ...]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (loops < 1) loops = 1;
+  if (rows < 1) rows = 1;
+  trace.stop();
+  gifDisplay.enableCache(false);
+  ghz = cyclesPerNs();
+
+  printf("%-18s %6s %6s %9s %9s %9s %7s %9s %7s %8s %5s %7s %9s %8s\n",
+         "asset", "bytes", "frames", "avg[us]", "max[us]", "Mpixel/s", "cyc/pix", "MB/s", "copy[B]", "maxload", "over",
+         "cache", "replay", "step[us]");
+  for (i = 0; gifFiles[i].length > 0; i++) {
+    if (selected(gifFiles[i].name, argc - optind, argv + optind))
+      benchGif(&gifFiles[i], loops, rows, slowdown, ghz, verbose);
+  }
+  return 0;
+}
@@ -0,0 +1,9 @@
+// Settings of the host replacements (bt_host.cpp)
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdio.h>
+
+extern FILE *btOut;   //!< destination of btWriteString()/btWriteChar(), NULL = discard
+
+#endif
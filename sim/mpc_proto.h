@@ -0,0 +1,21 @@
+// Function prototypes of mpc.ino (generated by the Arduino IDE for the target build)
+#ifndef MPC_PROTO_H
+#define MPC_PROTO_H
+
+#include <stdint.h>
+
+void picProst(void);
+void tcInit(void);
+uint32_t tcReadRA(void);
+uint32_t tcReadStatusBit(uint32_t bitMask);
+void fillColumn(int x, int color);
+void fillScreen(int color);
+void drawTriangleCurve(void);
+void halt(char *text);
+void setup(void);
+void loop(void);
+void isrColumnTick(void);
+void isrColumnTickInit(void);
+void renderColumnsAhead(void);
+
+#endif
@@ -0,0 +1,469 @@
+// Virtual POV rig
+//
+// Runs the unchanged column engine of mpc.ino (isrColumnTick, prepareNextColumn,
+// prepareNextRotation) and the LPD8806 DMA output (showAll, DMAC_Handler)
+// on the SAM3X peripheral model of sam3x.cpp. The IR sensor is driven by a
+// synthetic RPM trace or by a recorded log of rotation timestamps, so timing
+// behaviour can be reproduced deterministically without spinning the motor.
+//
+// Columns are rendered by the main loop of the sketch ahead of their output (called
+// by delay() through yield()), or by the interrupt if the main loop was late. Host
+// execution time is not target time: each rendered column is charged a modelled
+// time (-e) instead.
+//
+// Reported are the skipped columns (numColumnsSkipped), the column phase error
+// (angle of the cylinder when the middle LED of a column is latched, i.e. half of
+// the USART0 transfer after its DMA start, compared with the column's nominal
+// angle; the mean is a constant image rotation, the standard deviation is the
+// column jitter), the interrupt occupancy and the late and dropped GIF frames of
+// the frame scheduler.
+//
+// Usage: povrig [options]
+//   -r rpm[:rpm2]   synthetic trace with constant or linearly ramped speed (default 1200)
+//   -d seconds      duration of the synthetic trace (default 2)
+//   -j percent      random variation of each rotation period
+//   -S seed         seed of the random variation (default 1)
+//   -f file         replay a trace file: one rotation timestamp in us per line,
+//                   or "time_s rpm" pairs (RPM trace, linearly interpolated)
+//   -w file         write the rotation timestamps (us) of the trace used
+//   -p us           width of the IR pulse (default 100)
+//   -x n            the sensor misses every n-th index pulse (dirty sensor)
+//   -y n            double trigger: every n-th index pulse is followed by a second
+//                   pulse 1/20 rotation later
+//   -g asset        play a GIF file of gifFiles[] instead of the triangle curve
+//   -c ticks        TC counter value at the start (e.g. 0xFF000000 to test its wraparound)
+//   -a cycles       MCK cycles per register access (default 2)
+//   -i cycles       additional MCK cycles per interrupt handler call
+//   -k scale        charge host execution time, in MCK cycles per host ns
+//   -e cycles       MCK cycles charged per rendered column (default 700: about 15 per LED)
+//   -m              debug mode of the sketch (MOTOR_OFF): the index pulses are ignored
+//                   and the rotations have the default period
+//   -b              show the Bluetooth output of the sketch
+//   -v              one line per rotation
+//
+#include <math.h>
+#include "Arduino.h"
+#include "host.h"
+#include "mpc_proto.h"
+
+static void rigRenderColumn(int w, unsigned char *column, bool next);
+#define RENDER_COLUMN(w, column)      rigRenderColumn(w, column, false)
+#define RENDER_NEXT_COLUMN(w, column) rigRenderColumn(w, column, true)
+
+#include "mpc.ino"
+
+#define COLUMN_DMA_CHANNEL  2   // USART0_DMAC_TX_CH
+#define WARMUP_ROTATIONS    3   // rotations ignored by the statistics
+#define MCK_PER_US          (F_CPU / 1000000)
+
+int freeMemory() { return 0; }
+
+// trace
+static uint64_t *rigPulses;     // index positions passing the sensor in MCK cycles
+static long      rigNumPulses;
+static long      rigMaxPulses;
+static uint64_t *rigSensor;     // falling edges of the IR sensor (rigPulses without missed ones)
+static long      rigNumSensor;
+
+static uint32_t  rigRenderCycles = 700;
+
+// statistics
+static bool      rigVerbose;
+static long      rigRotation;   // rotation of the current column
+static long      rigLastRotation = -1;
+static bool      rigMeasuring;
+static SimStats  rigStatsStart, rigStatsEnd;
+static uint64_t  rigCyclesStart, rigCyclesEnd;
+static int       rigSkippedStart, rigSkippedEnd;
+static int       rigRenderedStart, rigRenderedEnd;
+static int       rigOverrunsStart, rigOverrunsEnd;
+static int       rigLateStart, rigLateEnd;
+static int       rigRejectedStart, rigRejectedEnd;
+static long      rigColumns, rigRotations;
+static double    rigErrSum, rigErrSqSum, rigErrMaxAbs;
+static double    rigColumnUs;   // sum of true column durations in us
+static double    rigRotErrMaxAbs;
+static int       rigRotSkipped;
+
+
+//---------------------------------------------------------------------------------------
+static void addPulse(double us)
+//---------------------------------------------------------------------------------------
+{
+  if (rigNumPulses == rigMaxPulses) {
+    rigMaxPulses = rigMaxPulses ? 2 * rigMaxPulses : 1024;
+    rigPulses = (uint64_t *) realloc(rigPulses, rigMaxPulses * sizeof(uint64_t));
+  }
+  rigPulses[rigNumPulses++] = (uint64_t) (us * MCK_PER_US);
+}
+
+//---------------------------------------------------------------------------------------
+static double random01(unsigned *seed)
+//---------------------------------------------------------------------------------------
+{
+  *seed = *seed * 1103515245 + 12345;
+  return ((*seed >> 16) & 0x7FFF) / 32768.0;
+}
+
+// rotation timestamps for a speed ramping linearly from rpm1 to rpm2
+//---------------------------------------------------------------------------------------
+static void synthTrace(double rpm1, double rpm2, double seconds, double jitter, unsigned seed)
+//---------------------------------------------------------------------------------------
+{
+  double t = 1000, rpm, period;
+
+  while (t < seconds * 1e6) {
+    addPulse(t);
+    rpm = rpm1 + (rpm2 - rpm1) * t / (seconds * 1e6);
+    period = 60e6 / rpm;
+    if (jitter > 0) period *= 1 + jitter / 100 * (2 * random01(&seed) - 1);
+    t += period;
+  }
+}
+
+//---------------------------------------------------------------------------------------
+static bool readTrace(const char *fileName)
+//---------------------------------------------------------------------------------------
+{
+  FILE *file = fopen(fileName, "r");
+  char line[128];
+  double a, b, first = -1, last = 0;
+  double *tp = NULL, *rp = NULL;
+  int n, mode = 0, np = 0, maxp = 0;
+
+  if (!file) {
+    perror(fileName);
+    return false;
+  }
+  while (fgets(line, sizeof(line), file)) {
+    if (line[0] == '#') continue;
+    n = sscanf(line, "%lf %lf", &a, &b);
+    if (n <= 0) continue;
+    if (mode == 0) mode = n;
+    if (n != mode) {
+      fprintf(stderr, "%s: mixed trace formats\n", fileName);
+      return false;
+    }
+    if (mode == 1) {
+      // rotation timestamp log
+      if (first < 0) first = a;
+      if (a < last) {
+        fprintf(stderr, "%s: timestamps not increasing\n", fileName);
+        return false;
+      }
+      last = a;
+      addPulse(a - first + 1000);
+    }
+    else {
+      // RPM trace
+      if (np == maxp) {
+        maxp = maxp ? 2 * maxp : 64;
+        tp = (double *) realloc(tp, maxp * sizeof(double));
+        rp = (double *) realloc(rp, maxp * sizeof(double));
+      }
+      tp[np] = a * 1e6;
+      rp[np++] = b;
+    }
+  }
+  fclose(file);
+
+  if (mode == 2 && np > 0) {
+    double t = tp[0] + 1000, rpm;
+    int i = 0;
+    while (t < tp[np-1]) {
+      while (i + 1 < np && tp[i+1] <= t) i++;
+      rpm = i + 1 < np ? rp[i] + (rp[i+1] - rp[i]) * (t - tp[i]) / (tp[i+1] - tp[i]) : rp[i];
+      if (rpm <= 0) {
+        fprintf(stderr, "%s: motor stopped at %.3f s\n", fileName, t / 1e6);
+        return false;
+      }
+      addPulse(t - tp[0]);
+      t += 60e6 / rpm;
+    }
+  }
+  free(tp);
+  free(rp);
+  return true;
+}
+
+//---------------------------------------------------------------------------------------
+static void writeTrace(const char *fileName)
+//---------------------------------------------------------------------------------------
+{
+  FILE *file = fopen(fileName, "w");
+  long i;
+
+  if (!file) {
+    perror(fileName);
+    return;
+  }
+  fprintf(file, "# rotation timestamps in us\n");
+  for (i = 0; i < rigNumPulses; i++)
+    fprintf(file, "%.3f\n", (double) rigPulses[i] / MCK_PER_US);
+  fclose(file);
+}
+
+//---------------------------------------------------------------------------------------
+static double tcTicksPerUs(void)
+//---------------------------------------------------------------------------------------
+{
+  static const double div[] = { 2, 8, 32, 128, F_CPU / 32768. };
+  uint32_t clks = TC0->TC_CHANNEL[TCCHAN].TC_CMR.value & TC_CMR_TCCLKS_Msk;
+  return MCK_PER_US / div[clks < 4 ? clks : 4];
+}
+
+//---------------------------------------------------------------------------------------
+static double lastPeriodUs(void)
+//---------------------------------------------------------------------------------------
+{
+  return period / tcTicksPerUs();
+}
+
+// renders a column for the sketch (RENDER_COLUMN) and charges its modelled
+// target time instead of the host time
+//---------------------------------------------------------------------------------------
+static void rigRenderColumn(int w, unsigned char *column, bool next)
+//---------------------------------------------------------------------------------------
+{
+  simHostCharge();
+  if (next) gifDisplay.renderNextColumn(w, column);
+  else      gifDisplay.renderThisColumn(w, column);
+  simHostDiscard();
+  simAdvance(rigRenderCycles);
+}
+
+// called when a DMA buffer transfer starts: the column is identified by its
+// buffer in the column rings of mpc.ino (zero padding and test pattern are ignored)
+//---------------------------------------------------------------------------------------
+static void rigColumnStart(int channel, const uint8_t *src, uint32_t count, uint64_t t)
+//---------------------------------------------------------------------------------------
+{
+  const uint8_t *ring = &columnRing[0][0];
+  const uint8_t *ahead = &columnAhead[0][0];
+  double rotationCycles, latch, pos, err;
+  int column;
+
+  if (channel != COLUMN_DMA_CHANNEL) return;
+  if (src >= ring && src < ring + sizeof(columnRing))
+    column = columnRingX[(src - ring) / COLUMN_BYTES];
+  else if (src >= ahead && src < ahead + sizeof(columnAhead))
+    column = columnAheadX[(src - ahead) / COLUMN_BYTES];
+  else
+    return;
+
+  while (rigRotation + 1 < rigNumPulses && rigPulses[rigRotation+1] <= t)
+    rigRotation++;
+  if (t < rigPulses[0] || rigRotation + 1 >= rigNumPulses || rigRotation < WARMUP_ROTATIONS) {
+    rigMeasuring = false;
+    return;
+  }
+  if (!rigMeasuring && rigCyclesStart == 0) {
+    rigMeasuring = true;
+    simStats.isrMaxCycles = 0;      // without the warmup
+    rigStatsStart = simStats;
+    rigCyclesStart = t;
+    rigSkippedStart = rigSkippedEnd = numColumnsSkipped;
+    rigRenderedStart = rigRenderedEnd = numColumnsRendered;
+    rigOverrunsStart = rigOverrunsEnd = numDmaOverruns;
+    rigLateStart = rigLateEnd = numIndexLate;
+    rigRejectedStart = rigRejectedEnd = numIndexRejected;
+  }
+  if (!rigMeasuring) return;
+
+  if (rigRotation != rigLastRotation) {
+    if (rigLastRotation >= 0) {
+      if (rigVerbose)
+        printf("rotation %6ld: period %9.1f us  estimate %9.1f us  skipped %4d  max |error| %6.2f columns\n",
+               rigLastRotation,
+               (double) (rigPulses[rigLastRotation+1] - rigPulses[rigLastRotation]) / MCK_PER_US,
+               lastPeriodUs(), numColumnsSkipped - rigRotSkipped, rigRotErrMaxAbs);
+      rigRotations++;
+    }
+    rigLastRotation = rigRotation;
+    rigRotSkipped = numColumnsSkipped;
+    rigRotErrMaxAbs = 0;
+  }
+
+  rotationCycles = (double) (rigPulses[rigRotation+1] - rigPulses[rigRotation]);
+  latch = t + (count - 1) / 2 * showByteCycles(SHOW_USART0);
+  pos = (latch - rigPulses[rigRotation]) / rotationCycles * XSIZE;
+  err = pos - column;
+  if (err >= XSIZE / 2.0) err -= XSIZE;
+  if (err < -XSIZE / 2.0) err += XSIZE;
+
+  rigColumns++;
+  rigErrSum += err;
+  rigErrSqSum += err * err;
+  if (fabs(err) > rigErrMaxAbs) rigErrMaxAbs = fabs(err);
+  if (fabs(err) > rigRotErrMaxAbs) rigRotErrMaxAbs = fabs(err);
+  rigColumnUs += rotationCycles / XSIZE / MCK_PER_US;
+
+  rigStatsEnd = simStats;
+  rigCyclesEnd = t;
+  rigSkippedEnd = numColumnsSkipped;
+  rigRenderedEnd = numColumnsRendered;
+  rigOverrunsEnd = numDmaOverruns;
+  rigLateEnd = numIndexLate;
+  rigRejectedEnd = numIndexRejected;
+}
+
+//---------------------------------------------------------------------------------------
+static void report(void)
+//---------------------------------------------------------------------------------------
+{
+  double seconds = (double) (rigCyclesEnd - rigCyclesStart) / F_CPU;
+  double mean, sdev, colUs, occupancy;
+  uint64_t isrCount = rigStatsEnd.isrCount - rigStatsStart.isrCount;
+  int ch;
+
+  if (rigColumns == 0) {
+    printf("No columns output - trace too short?\n");
+    return;
+  }
+  mean = rigErrSum / rigColumns;
+  sdev = sqrt(rigErrSqSum / rigColumns - mean * mean);
+  colUs = rigColumnUs / rigColumns;
+  occupancy = (double) (rigStatsEnd.isrCycles - rigStatsStart.isrCycles) / (rigCyclesEnd - rigCyclesStart);
+
+  printf("Measured time:       %10.3f s (%ld rotations measured, %.0f RPM average)\n",
+         seconds, rigRotations, rigRotations / seconds * 60);
+  printf("Index pulses:        %10llu (%llu capture overruns)\n",
+         (unsigned long long) simStats.indexPulses, (unsigned long long) simStats.captureOverruns);
+  printf("Columns output:      %10ld\n", rigColumns);
+  printf("Columns skipped:     %10d\n", rigSkippedEnd - rigSkippedStart);
+  printf("Columns not ahead:   %10d (rendered by the interrupt)\n", rigRenderedEnd - rigRenderedStart);
+  printf("DMA overruns:        %10d\n", rigOverrunsEnd - rigOverrunsStart);
+  printf("Index late/missing:  %10d\n", rigLateEnd - rigLateStart);
+  printf("Index rejected:      %10d\n", rigRejectedEnd - rigRejectedStart);
+  printf("GIF frames:          %10lu late  %lu dropped\n", gifDisplay.getFramesLate(), gifDisplay.getFramesDropped());
+#if GIF_QUEUE_DEPTH > 0
+  printf("GIF frame queue:     %10lu peak  %lu ms decoder stalled\n", gifDisplay.getQueuePeak(), gifDisplay.getQueueStallMs());
+#endif
+  printf("Column phase error:  mean %+8.3f  sdev %8.3f  max |error| %8.3f columns\n", mean, sdev, rigErrMaxAbs);
+  printf("                     mean %+8.2f  sdev %8.2f  max |error| %8.2f us\n",
+         mean * colUs, sdev * colUs, rigErrMaxAbs * colUs);
+  printf("ISR:                 %10llu calls  occupancy %6.2f%%  average %7.2f us  max %7.2f us\n",
+         (unsigned long long) isrCount, 100 * occupancy,
+         isrCount ? (double) (rigStatsEnd.isrCycles - rigStatsStart.isrCycles) / isrCount / MCK_PER_US : 0,
+         (double) rigStatsEnd.isrMaxCycles / MCK_PER_US);
+  for (ch = 0; ch < SIM_NUM_DMA_CHANNELS; ch++) {
+    uint64_t n = rigStatsEnd.dmaTransfers[ch] - rigStatsStart.dmaTransfers[ch];
+    if (n == 0) continue;
+    printf("DMA channel %d:       %10llu transfers  %8llu bytes  busy %6.2f%%\n", ch,
+           (unsigned long long) n,
+           (unsigned long long) (rigStatsEnd.dmaBytes[ch] - rigStatsStart.dmaBytes[ch]),
+           100.0 * (rigStatsEnd.dmaBusyCycles[ch] - rigStatsStart.dmaBusyCycles[ch]) / (rigCyclesEnd - rigCyclesStart));
+  }
+}
+
+//---------------------------------------------------------------------------------------
+static void usage(const char *name)
+//---------------------------------------------------------------------------------------
+{
+  fprintf(stderr, "Usage: %s [-r rpm[:rpm2]] [-d seconds] [-j percent] [-S seed] [-f trace] [-w trace]\n"
+                  "       [-p us] [-x n] [-y n] [-g asset] [-c ticks] [-a cycles] [-i cycles] [-k scale] [-e cycles]\n"
+                  "       [-m] [-b] [-v]\n", name);
+  exit(1);
+}
+
+//---------------------------------------------------------------------------------------
+int main(int argc, char **argv)
+//---------------------------------------------------------------------------------------
+{
+  double rpm1 = 1200, rpm2 = 1200, seconds = 2, jitter = 0, pulseUs = 100;
+  unsigned seed = 1;
+  const char *traceIn = NULL, *traceOut = NULL, *asset = NULL;
+  const GifFile *gif = NULL;
+  int i, x, miss = 0, bounce = 0, motorOff = 0;
+
+  btOut = NULL;
+  for (i = 1; i < argc; i++) {
+    const char *opt = argv[i];
+    const char *arg = i + 1 < argc ? argv[i+1] : NULL;
+    if (opt[0] != '-' || opt[1] == 0 || opt[2] != 0) usage(argv[0]);
+    switch (opt[1]) {
+      case 'b': btOut = stdout;  continue;
+      case 'v': rigVerbose = true;  continue;
+      case 'm': motorOff = 1;       continue;
+    }
+    if (!arg) usage(argv[0]);
+    i++;
+    switch (opt[1]) {
+      case 'r': if (sscanf(arg, "%lf:%lf", &rpm1, &rpm2) == 1) rpm2 = rpm1; break;
+      case 'd': seconds = atof(arg);                 break;
+      case 'j': jitter = atof(arg);                  break;
+      case 'S': seed = atoi(arg);                    break;
+      case 'f': traceIn = arg;                       break;
+      case 'w': traceOut = arg;                      break;
+      case 'p': pulseUs = atof(arg);                 break;
+      case 'x': miss = atoi(arg);                    break;
+      case 'y': bounce = atoi(arg);                  break;
+      case 'g': asset = arg;                         break;
+      case 'c': simTcTriggerValue = strtoul(arg, NULL, 0); break;
+      case 'a': simAccessCycles = atoi(arg);         break;
+      case 'i': simIsrEntryCycles += atoi(arg);      break;
+      case 'k': simHostScale = atof(arg);            break;
+      case 'e': rigRenderCycles = atoi(arg);         break;
+      default:  usage(argv[0]);
+    }
+  }
+
+  if (traceIn) {
+    if (!readTrace(traceIn)) return 1;
+  }
+  else {
+    if (rpm1 <= 0 || rpm2 <= 0) usage(argv[0]);
+    synthTrace(rpm1, rpm2, seconds, jitter, seed);
+  }
+  if (rigNumPulses < WARMUP_ROTATIONS + 2) {
+    fprintf(stderr, "Trace too short (%ld rotations)\n", rigNumPulses);
+    return 1;
+  }
+  if (traceOut) writeTrace(traceOut);
+
+  if (asset) {
+    for (i = 0; gifFiles[i].length > 0; i++) {
+      if (strcmp(gifFiles[i].name, asset) == 0) gif = &gifFiles[i];
+    }
+    if (!gif) {
+      fprintf(stderr, "Unknown asset %s\n", asset);
+      return 1;
+    }
+    rotInc = gif->rotinc;
+    rotVal = gif->rotval;
+  }
+
+  rigSensor = (uint64_t *) malloc(2 * rigNumPulses * sizeof(uint64_t));
+  for (i = 0; i < rigNumPulses; i++) {
+    if (miss > 0 && i > WARMUP_ROTATIONS && i % miss == 0) continue;
+    rigSensor[rigNumSensor++] = rigPulses[i];
+    if (bounce > 0 && i > WARMUP_ROTATIONS && i % bounce == 0 && i + 1 < rigNumPulses)
+      rigSensor[rigNumSensor++] = rigPulses[i] + (rigPulses[i+1] - rigPulses[i]) / 20;
+  }
+  simSetIndexPulses(rigSensor, rigNumSensor, (uint32_t) (pulseUs * MCK_PER_US));
+  simDmaStartHook = rigColumnStart;
+
+  // hardware part of setup()
+  MOTOR_OFF = motorOff;
+  strip0.begin();
+  strip1.begin();
+  strip23.begin();
+  for (x = 0; x < nLEDs; x++) {
+    strip0.setPixelColor(x, 0, 0, 127);
+    strip1.setPixelColor(x, 0, 127, 0);
+    strip23.setPixelColor(x, 127, 0, 0);
+  }
+  showAll(strip0, strip1, strip23);
+  drawTriangleCurve();
+  tcInit();
+  isrColumnTickInit();
+
+  // main program
+  while (!simIndexPulsesDone()) {
+    if (gif) gifDisplay.showGif(gif->length, gif->data);
+    else     delay(1);
+  }
+
+  report();
+  return 0;
+}
@@ -0,0 +1,18 @@
+// Sizes of GifDisplay on the 32 bit target
+//
+// Compiled with -m32 into assembler by the Makefile, which turns the constants
+// below into build/ramsize.h for printRamBudget of the host build (gifbench -m).
+// Compiling it also checks the static_assert of GIF_RAM_BUDGET in mpcgif.h,
+// which only applies to 32 bit builds.
+//
+#include "mpcgif.h"
+
+struct GifRamTarget {
+  static const unsigned display = sizeof(GifDisplay);
+  static const unsigned picture = sizeof(GifDisplay::GifPicture);
+  static const unsigned decoder = sizeof(GifDisplay::GifDecoder);
+};
+
+extern const unsigned RAM_TARGET_DISPLAY = GifRamTarget::display;
+extern const unsigned RAM_TARGET_PICTURE = GifRamTarget::picture;
+extern const unsigned RAM_TARGET_DECODER = GifRamTarget::decoder;
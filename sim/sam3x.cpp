@@ -0,0 +1,728 @@
+// Host model of the SAM3X8E peripherals used by the POV Cylinder (see sam3x.h)
+//
+// Time is counted in MCK cycles (84 MHz). It advances when the program accesses
+// a register (simAccessCycles), calls delay(), transmits a byte by software or
+// when host time is charged (simHostScale). Events (IR edges, RC compare, end of
+// DMA transfers) are processed in time order; a pending interrupt is dispatched
+// at the exact event time unless an interrupt handler is already running.
+#include <time.h>
+#include "Arduino.h"
+#include "SPI.h"
+
+#define TC_IR_CHANNEL  1        // IR sensor is connected to TIOA1
+#define NEVER          UINT64_MAX
+#define YIELD_CYCLES   (F_CPU / 100000)   // delay() calls yield() every 10 us
+
+// peripheral index of a DMA destination
+enum { PER_NONE = -1, PER_SPI0, PER_USART0, PER_USART1, NUM_PER };
+
+Tc    simTc0;
+Dmac  simDmac;
+Spi   simSpi0;
+Usart simUsart0, simUsart1, simUsart3;
+Pio   simPioA, simPioB, simPioD;
+SPIClass SPI;
+
+const PinDescription g_APinDescription[PIN_SPI_SCK+1] = {};
+
+uint64_t simCycles;
+uint32_t simAccessCycles = 2;
+uint32_t simIsrEntryCycles = 24;
+uint32_t simTcTriggerValue = 0;
+double   simHostScale;
+SimStats simStats;
+void   (*simDmaStartHook)(int channel, const uint8_t *src, uint32_t count, uint64_t time);
+
+// interrupt handlers are optional
+void TC1_Handler(void)  __attribute__((weak));
+void DMAC_Handler(void) __attribute__((weak));
+
+typedef struct {
+    bool     enabled;       // clock enabled
+    uint64_t startTick;     // tick of the last software trigger
+    uint32_t cvStopped;     // counter value while the clock is disabled
+    uint32_t sr;            // pending status flags (cleared on read)
+    uint64_t compareTime;   // next RC compare match
+} TcState;
+
+typedef struct {
+    bool     enabled;
+    int      per;
+    uint64_t doneTime;
+} DmaState;
+
+static TcState  tcState[3];
+static DmaState dmaState[SIM_NUM_DMA_CHANNELS];
+static uint64_t perFree[NUM_PER];   // peripheral accepts the first byte of the next transfer
+static uint32_t dmacIsr;            // pending EBCISR flags (cleared on read)
+
+static const uint64_t *pulses;      // falling edges of the IR sensor in MCK cycles
+static long     numPulses;
+static uint32_t pulseWidth;
+static long     edgeIndex;          // 2*pulse (falling) or 2*pulse+1 (rising)
+
+static uint64_t nvicEnabled;
+static int      primask;
+static bool     inIsr;
+static uint64_t hostLast;
+
+
+/*
+ *  Host time
+ */
+
+//---------------------------------------------------------------------------------------
+static uint64_t hostNs(void)
+//---------------------------------------------------------------------------------------
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// charge host execution time since the last call to the simulated time
+//---------------------------------------------------------------------------------------
+static void hostCharge(void)
+//---------------------------------------------------------------------------------------
+{
+  static bool charging;         // simAdvance runs handlers, which access registers
+  uint64_t now;
+
+  if (simHostScale <= 0 || charging) return;
+  now = hostNs();
+  if (hostLast != 0 && now > hostLast) {
+    uint64_t dt = now - hostLast;
+    hostLast = now;
+    charging = true;
+    simAdvance((uint64_t) (dt * simHostScale));
+    charging = false;
+  }
+  hostLast = now;
+}
+
+//---------------------------------------------------------------------------------------
+void simHostCharge(void)
+//---------------------------------------------------------------------------------------
+{
+  hostCharge();
+}
+
+// the host time since the last charge is not charged: host-only work, or work
+// whose target time is charged by a model (simAdvance)
+//---------------------------------------------------------------------------------------
+void simHostDiscard(void)
+//---------------------------------------------------------------------------------------
+{
+  if (simHostScale > 0) hostLast = hostNs();
+}
+
+
+/*
+ *  Timer Counter
+ */
+
+//---------------------------------------------------------------------------------------
+static uint32_t tcDivider(int ch)
+//---------------------------------------------------------------------------------------
+{
+  switch (simTc0.TC_CHANNEL[ch].TC_CMR.value & TC_CMR_TCCLKS_Msk) {
+    case 0:  return 2;
+    case 1:  return 8;
+    case 2:  return 32;
+    case 3:  return 128;
+    default: return F_CPU / 32768;
+  }
+}
+
+//---------------------------------------------------------------------------------------
+static uint32_t tcCounter(int ch, uint64_t t)
+//---------------------------------------------------------------------------------------
+{
+  TcState *tc = &tcState[ch];
+  if (!tc->enabled) return tc->cvStopped;
+  return (uint32_t) (t / tcDivider(ch) - tc->startTick);
+}
+
+// time of the next tick at which CV becomes equal to RC
+//---------------------------------------------------------------------------------------
+static void tcUpdateCompare(int ch)
+//---------------------------------------------------------------------------------------
+{
+  TcState *tc = &tcState[ch];
+  uint64_t div = tcDivider(ch);
+  uint64_t tick = simCycles / div;
+  uint32_t d;
+
+  if (!tc->enabled) {
+    tc->compareTime = NEVER;
+    return;
+  }
+  d = simTc0.TC_CHANNEL[ch].TC_RC.value - (uint32_t) (tick - tc->startTick);
+  tc->compareTime = (tick + (d == 0 ? 1ull << 32 : d)) * div;
+}
+
+// IR sensor edge on TIOA: load RA/RB as configured in CMR
+//---------------------------------------------------------------------------------------
+static void tcCapture(int ch, bool rising, uint64_t t)
+//---------------------------------------------------------------------------------------
+{
+  TcState *tc = &tcState[ch];
+  uint32_t cmr = simTc0.TC_CHANNEL[ch].TC_CMR.value;
+  uint32_t edge = rising ? 1 : 2;
+
+  if (!tc->enabled) return;
+  if ((cmr >> TC_CMR_LDRA_Pos) & edge) {
+    if (tc->sr & TC_SR_LDRAS) {
+      tc->sr |= TC_SR_LOVRS;
+      simStats.captureOverruns++;
+    }
+    simTc0.TC_CHANNEL[ch].TC_RA.value = tcCounter(ch, t);
+    tc->sr |= TC_SR_LDRAS;
+  }
+  else if ((cmr >> TC_CMR_LDRB_Pos) & edge) {
+    simTc0.TC_CHANNEL[ch].TC_RB.value = tcCounter(ch, t);
+    tc->sr |= TC_SR_LDRBS;
+  }
+}
+
+//---------------------------------------------------------------------------------------
+static void tcControl(int ch, uint32_t ccr)
+//---------------------------------------------------------------------------------------
+{
+  TcState *tc = &tcState[ch];
+
+  if (ccr & TC_CCR_CLKDIS) {
+    tc->cvStopped = tcCounter(ch, simCycles);
+    tc->enabled = false;
+  }
+  else if (ccr & TC_CCR_CLKEN) {
+    if (!tc->enabled) tc->startTick = simCycles / tcDivider(ch) - tc->cvStopped;
+    tc->enabled = true;
+  }
+  if ((ccr & TC_CCR_SWTRG) && tc->enabled)
+    tc->startTick = simCycles / tcDivider(ch) - simTcTriggerValue;
+  tcUpdateCompare(ch);
+}
+
+//---------------------------------------------------------------------------------------
+static bool tcIrqPending(int ch)
+//---------------------------------------------------------------------------------------
+{
+  return tcState[ch].sr & simTc0.TC_CHANNEL[ch].TC_IMR.value;
+}
+
+
+/*
+ *  IR sensor
+ */
+
+//---------------------------------------------------------------------------------------
+static uint64_t pulseTime(long i)
+//---------------------------------------------------------------------------------------
+{
+  if (i < numPulses) return pulses[i];
+  // past the end of the trace the motor keeps its last speed
+  if (numPulses < 2) return NEVER;
+  return pulses[numPulses-1] + (i - numPulses + 1) * (pulses[numPulses-1] - pulses[numPulses-2]);
+}
+
+//---------------------------------------------------------------------------------------
+static uint64_t edgeTime(long edge)
+//---------------------------------------------------------------------------------------
+{
+  uint64_t t = pulseTime(edge / 2);
+  if (t == NEVER) return NEVER;
+  return edge & 1 ? t + pulseWidth : t;
+}
+
+//---------------------------------------------------------------------------------------
+void simSetIndexPulses(const uint64_t *fallingEdges, long count, uint32_t widthCycles)
+//---------------------------------------------------------------------------------------
+{
+  pulses = fallingEdges;
+  numPulses = count;
+  pulseWidth = widthCycles;
+  edgeIndex = 0;
+  while (edgeTime(edgeIndex) < simCycles) edgeIndex++;
+}
+
+//---------------------------------------------------------------------------------------
+bool simIndexPulsesDone(void)
+//---------------------------------------------------------------------------------------
+{
+  return edgeIndex >= 2 * numPulses;
+}
+
+
+/*
+ *  DMA Controller
+ */
+
+// MCK cycles per transmitted byte
+//---------------------------------------------------------------------------------------
+static uint32_t byteTime(int per)
+//---------------------------------------------------------------------------------------
+{
+  uint32_t pcs, div = 0;
+  int npcs;
+
+  switch (per) {
+    case PER_SPI0:
+      pcs = (simSpi0.SPI_MR.value >> 16) & 0xF;
+      for (npcs = 0; npcs < 4; npcs++) {
+        if ((pcs & (1 << npcs)) == 0) break;
+      }
+      div = (simSpi0.SPI_CSR[npcs & 3].value >> 8) & 0xFF;
+      break;
+    case PER_USART0: div = simUsart0.US_BRGR.value & 0xFFFF; break;
+    case PER_USART1: div = simUsart1.US_BRGR.value & 0xFFFF; break;
+  }
+  return 8 * (div ? div : 1);
+}
+
+//---------------------------------------------------------------------------------------
+static int dmaPeripheral(uint32_t daddr)
+//---------------------------------------------------------------------------------------
+{
+  if (daddr == (uint32_t) (uintptr_t) &simSpi0.SPI_TDR)   return PER_SPI0;
+  if (daddr == (uint32_t) (uintptr_t) &simUsart0.US_THR)  return PER_USART0;
+  if (daddr == (uint32_t) (uintptr_t) &simUsart1.US_THR)  return PER_USART1;
+  return PER_NONE;
+}
+
+// linked list: load the next descriptor (SADDR, DADDR, CTRLA, CTRLB, DSCR) into the channel
+//---------------------------------------------------------------------------------------
+static bool dmaFetch(int ch)
+//---------------------------------------------------------------------------------------
+{
+  DmacCh_num *regs = &simDmac.DMAC_CH_NUM[ch];
+  const uint32_t *lli = (const uint32_t *) (uintptr_t) regs->DMAC_DSCR.value;
+
+  if ((regs->DMAC_CTRLB.value & DMAC_CTRLB_SRC_DSCR) || lli == NULL) return false;
+  regs->DMAC_SADDR.value = lli[0];
+  regs->DMAC_DADDR.value = lli[1];
+  regs->DMAC_CTRLA.value = lli[2];
+  regs->DMAC_CTRLB.value = lli[3];
+  regs->DMAC_DSCR.value  = lli[4];
+  return true;
+}
+
+// start transfer of the buffer programmed in the channel registers
+//---------------------------------------------------------------------------------------
+static void dmaStartBuffer(int ch)
+//---------------------------------------------------------------------------------------
+{
+  DmacCh_num *regs = &simDmac.DMAC_CH_NUM[ch];
+  DmaState *dma = &dmaState[ch];
+  uint32_t count = regs->DMAC_CTRLA.value & DMAC_CTRLA_BTSIZE_Msk;
+  uint64_t begin = simCycles;
+  uint32_t bt;
+
+  dma->per = dmaPeripheral(regs->DMAC_DADDR.value);
+  if (dma->per == PER_NONE) {
+    dma->doneTime = simCycles;
+    return;
+  }
+  bt = byteTime(dma->per);
+  if (perFree[dma->per] > begin) begin = perFree[dma->per];
+  // done when the last byte has been written into the transmit holding register
+  dma->doneTime = begin + (count ? count - 1 : 0) * (uint64_t) bt;
+  perFree[dma->per] = dma->doneTime + bt;
+
+  simStats.dmaTransfers[ch]++;
+  simStats.dmaBytes[ch] += count;
+  simStats.dmaBusyCycles[ch] += (uint64_t) count * bt;
+  if (simDmaStartHook)
+    simDmaStartHook(ch, (const uint8_t *) (uintptr_t) regs->DMAC_SADDR.value, count, begin);
+}
+
+//---------------------------------------------------------------------------------------
+static void dmaStart(int ch)
+//---------------------------------------------------------------------------------------
+{
+  dmaState[ch].enabled = true;
+  dmaFetch(ch);
+  dmaStartBuffer(ch);
+}
+
+// end of buffer: continue with the next descriptor of a linked list
+//---------------------------------------------------------------------------------------
+static void dmaDone(int ch)
+//---------------------------------------------------------------------------------------
+{
+  if (dmaFetch(ch)) {
+    dmacIsr |= DMAC_EBCISR_BTC0 << ch;
+    dmaStartBuffer(ch);
+    return;
+  }
+  dmaState[ch].enabled = false;
+  dmacIsr |= (DMAC_EBCISR_BTC0 | DMAC_EBCISR_CBTC0) << ch;
+}
+
+
+/*
+ *  Event processing and interrupt dispatch
+ */
+
+//---------------------------------------------------------------------------------------
+static uint64_t nextEventTime(void)
+//---------------------------------------------------------------------------------------
+{
+  uint64_t t = edgeTime(edgeIndex);
+  int i;
+
+  for (i = 0; i < 3; i++) {
+    if (tcState[i].compareTime < t) t = tcState[i].compareTime;
+  }
+  for (i = 0; i < SIM_NUM_DMA_CHANNELS; i++) {
+    if (dmaState[i].enabled && dmaState[i].doneTime < t) t = dmaState[i].doneTime;
+  }
+  return t;
+}
+
+//---------------------------------------------------------------------------------------
+static void processEvents(void)
+//---------------------------------------------------------------------------------------
+{
+  uint64_t t;
+  int i;
+
+  while ((t = edgeTime(edgeIndex)) <= simCycles) {
+    if ((edgeIndex & 1) == 0) simStats.indexPulses++;
+    tcCapture(TC_IR_CHANNEL, edgeIndex & 1, t);
+    edgeIndex++;
+  }
+  for (i = 0; i < 3; i++) {
+    if (tcState[i].compareTime <= simCycles) {
+      tcState[i].sr |= TC_SR_CPCS;
+      tcState[i].compareTime += (1ull << 32) * tcDivider(i);
+    }
+  }
+  for (i = 0; i < SIM_NUM_DMA_CHANNELS; i++) {
+    while (dmaState[i].enabled && dmaState[i].doneTime <= simCycles) dmaDone(i);
+  }
+}
+
+//---------------------------------------------------------------------------------------
+static bool irqEnabled(IRQn_Type irq)
+//---------------------------------------------------------------------------------------
+{
+  return nvicEnabled & (1ull << irq);
+}
+
+//---------------------------------------------------------------------------------------
+static void dispatch(void)
+//---------------------------------------------------------------------------------------
+{
+  void (*handler)(void);
+  uint64_t entry, cycles;
+
+  while (!inIsr && primask == 0) {
+    if (irqEnabled(TC1_IRQn) && tcIrqPending(1) && TC1_Handler)
+      handler = TC1_Handler;
+    else if (irqEnabled(DMAC_IRQn) && (dmacIsr & simDmac.DMAC_EBCIMR.value) && DMAC_Handler)
+      handler = DMAC_Handler;
+    else
+      break;
+
+    hostCharge();
+    entry = simCycles;
+    inIsr = true;
+    simAdvance(simIsrEntryCycles / 2);
+    handler();
+    hostCharge();
+    simAdvance(simIsrEntryCycles - simIsrEntryCycles / 2);
+    inIsr = false;
+
+    cycles = simCycles - entry;
+    simStats.isrCount++;
+    simStats.isrCycles += cycles;
+    if (cycles > simStats.isrMaxCycles) simStats.isrMaxCycles = cycles;
+  }
+}
+
+//---------------------------------------------------------------------------------------
+void simAdvance(uint64_t cycles)
+//---------------------------------------------------------------------------------------
+{
+  uint64_t target = simCycles + cycles;
+  uint64_t t;
+
+  while ((t = nextEventTime()) <= target) {
+    if (t > simCycles) simCycles = t;
+    processEvents();
+    dispatch();
+  }
+  if (target > simCycles) simCycles = target;
+  dispatch();
+}
+
+//---------------------------------------------------------------------------------------
+bool simInIsr(void)
+//---------------------------------------------------------------------------------------
+{
+  return inIsr;
+}
+
+
+/*
+ *  Register access
+ */
+
+//---------------------------------------------------------------------------------------
+uint32_t simRegRead(SimReg *reg)
+//---------------------------------------------------------------------------------------
+{
+  uint32_t value;
+  int ch;
+
+  hostCharge();
+  simAdvance(simAccessCycles);
+
+  for (ch = 0; ch < 3; ch++) {
+    TcChannel *tc = &simTc0.TC_CHANNEL[ch];
+    if (reg == &tc->TC_CV) return tcCounter(ch, simCycles);
+    if (reg == &tc->TC_SR) {
+      value = tcState[ch].sr | (tcState[ch].enabled ? TC_SR_CLKSTA : 0);
+      tcState[ch].sr = 0;
+      return value;
+    }
+  }
+  if (reg == &simDmac.DMAC_CHSR) {
+    value = 0;
+    for (ch = 0; ch < SIM_NUM_DMA_CHANNELS; ch++) {
+      if (dmaState[ch].enabled) value |= DMAC_CHSR_ENA0 << ch;
+    }
+    return value;
+  }
+  if (reg == &simDmac.DMAC_EBCISR) {
+    value = dmacIsr;
+    dmacIsr = 0;
+    return value;
+  }
+  if (reg == &simSpi0.SPI_SR)
+    return SPI_SR_TDRE | SPI_SR_TXEMPTY;
+  if (reg == &simUsart0.US_CSR || reg == &simUsart1.US_CSR || reg == &simUsart3.US_CSR)
+    return US_CSR_TXRDY | US_CSR_TXEMPTY;
+  return reg->value;
+}
+
+//---------------------------------------------------------------------------------------
+void simRegWrite(SimReg *reg, uint32_t value)
+//---------------------------------------------------------------------------------------
+{
+  int ch;
+
+  hostCharge();
+  simAdvance(simAccessCycles);
+
+  for (ch = 0; ch < 3; ch++) {
+    TcChannel *tc = &simTc0.TC_CHANNEL[ch];
+    if (reg == &tc->TC_CCR) { tcControl(ch, value); return; }
+    if (reg == &tc->TC_IER) { tc->TC_IMR.value |= value;  return; }
+    if (reg == &tc->TC_IDR) { tc->TC_IMR.value &= ~value; return; }
+    if (reg == &tc->TC_RC || reg == &tc->TC_CMR) {
+      reg->value = value;
+      tcUpdateCompare(ch);
+      return;
+    }
+  }
+  if (reg == &simDmac.DMAC_CHER) {
+    for (ch = 0; ch < SIM_NUM_DMA_CHANNELS; ch++) {
+      if ((value & (DMAC_CHER_ENA0 << ch)) && !dmaState[ch].enabled) dmaStart(ch);
+    }
+    return;
+  }
+  if (reg == &simDmac.DMAC_CHDR) {
+    for (ch = 0; ch < SIM_NUM_DMA_CHANNELS; ch++) {
+      if (value & (DMAC_CHDR_DIS0 << ch)) dmaState[ch].enabled = false;
+    }
+    return;
+  }
+  if (reg == &simDmac.DMAC_EBCIER) { simDmac.DMAC_EBCIMR.value |= value;  return; }
+  if (reg == &simDmac.DMAC_EBCIDR) { simDmac.DMAC_EBCIMR.value &= ~value; return; }
+  // software transmission of one byte
+  if (reg == &simSpi0.SPI_TDR) {
+    simAdvance(byteTime(PER_SPI0));
+    return;
+  }
+  if (reg == &simUsart0.US_THR || reg == &simUsart1.US_THR) {
+    simAdvance(byteTime(reg == &simUsart0.US_THR ? PER_USART0 : PER_USART1));
+    return;
+  }
+  reg->value = value;
+}
+
+
+/*
+ *  Library functions of the Arduino core and Atmel software package
+ */
+
+//---------------------------------------------------------------------------------------
+void TC_Configure(Tc *pTc, uint32_t channel, uint32_t mode)
+//---------------------------------------------------------------------------------------
+{
+  TcChannel *tc = &pTc->TC_CHANNEL[channel];
+  tc->TC_CCR = TC_CCR_CLKDIS;
+  tc->TC_IDR = 0xFFFFFFFF;
+  (void) (uint32_t) tc->TC_SR;
+  tc->TC_CMR = mode;
+}
+
+//---------------------------------------------------------------------------------------
+void TC_Start(Tc *pTc, uint32_t channel)
+//---------------------------------------------------------------------------------------
+{
+  pTc->TC_CHANNEL[channel].TC_CCR = TC_CCR_CLKEN | TC_CCR_SWTRG;
+}
+
+//---------------------------------------------------------------------------------------
+void TC_Stop(Tc *pTc, uint32_t channel)
+//---------------------------------------------------------------------------------------
+{
+  pTc->TC_CHANNEL[channel].TC_CCR = TC_CCR_CLKDIS;
+}
+
+//---------------------------------------------------------------------------------------
+void USART_Configure(Usart *usart, uint32_t mode, uint32_t baudrate, uint32_t masterClock)
+//---------------------------------------------------------------------------------------
+{
+  usart->US_CR = US_CR_RSTRX | US_CR_RSTTX | US_CR_RXDIS | US_CR_TXDIS;
+  usart->US_MR = mode;
+  if ((mode & 0xF) == US_MR_USART_MODE_SPI_MASTER)
+    usart->US_BRGR = masterClock / baudrate;
+  else
+    usart->US_BRGR = masterClock / baudrate / 16;
+}
+
+//---------------------------------------------------------------------------------------
+void USART_SetTransmitterEnabled(Usart *usart, uint8_t enabled)
+//---------------------------------------------------------------------------------------
+{
+  usart->US_CR = enabled ? US_CR_TXEN : US_CR_TXDIS;
+}
+
+//---------------------------------------------------------------------------------------
+void USART_SetReceiverEnabled(Usart *usart, uint8_t enabled)
+//---------------------------------------------------------------------------------------
+{
+  usart->US_CR = enabled ? US_CR_RXEN : US_CR_RXDIS;
+}
+
+//---------------------------------------------------------------------------------------
+uint32_t USART_Write(Usart *usart, uint16_t data, volatile uint32_t timeOut)
+//---------------------------------------------------------------------------------------
+{
+  usart->US_THR = data;
+  return 0;
+}
+
+//---------------------------------------------------------------------------------------
+uint8_t SPIClass::transfer(uint8_t data)
+//---------------------------------------------------------------------------------------
+{
+  SPI0->SPI_TDR = data;
+  return 0;
+}
+
+//---------------------------------------------------------------------------------------
+void PIO_SetPeripheral(Pio *pPio, EPioType type, uint32_t mask)
+//---------------------------------------------------------------------------------------
+{
+  pPio->PIO_PDR = mask;
+}
+
+//---------------------------------------------------------------------------------------
+uint32_t PIO_Configure(Pio *pPio, EPioType type, uint32_t mask, uint32_t attribute)
+//---------------------------------------------------------------------------------------
+{
+  return 1;
+}
+
+//---------------------------------------------------------------------------------------
+uint32_t pmc_enable_periph_clk(uint32_t ul_id)
+//---------------------------------------------------------------------------------------
+{
+  return 0;
+}
+
+//---------------------------------------------------------------------------------------
+void NVIC_EnableIRQ(IRQn_Type irq)
+//---------------------------------------------------------------------------------------
+{
+  nvicEnabled |= 1ull << irq;
+  dispatch();
+}
+
+//---------------------------------------------------------------------------------------
+void NVIC_DisableIRQ(IRQn_Type irq)
+//---------------------------------------------------------------------------------------
+{
+  nvicEnabled &= ~(1ull << irq);
+}
+
+//---------------------------------------------------------------------------------------
+void noInterrupts(void)
+//---------------------------------------------------------------------------------------
+{
+  primask = 1;
+}
+
+//---------------------------------------------------------------------------------------
+void interrupts(void)
+//---------------------------------------------------------------------------------------
+{
+  primask = 0;
+  dispatch();
+}
+
+//---------------------------------------------------------------------------------------
+void pinMode(uint32_t pin, uint32_t mode)
+//---------------------------------------------------------------------------------------
+{
+}
+
+//---------------------------------------------------------------------------------------
+void digitalWrite(uint32_t pin, uint32_t value)
+//---------------------------------------------------------------------------------------
+{
+}
+
+//---------------------------------------------------------------------------------------
+unsigned long micros(void)
+//---------------------------------------------------------------------------------------
+{
+  hostCharge();
+  return (unsigned long) (simCycles / (F_CPU / 1000000));
+}
+
+//---------------------------------------------------------------------------------------
+unsigned long millis(void)
+//---------------------------------------------------------------------------------------
+{
+  hostCharge();
+  return (unsigned long) (simCycles / (F_CPU / 1000));
+}
+
+// called by delay() while it waits; as in the Arduino core, the sketch may define it
+//---------------------------------------------------------------------------------------
+void yield(void) __attribute__((weak));
+void yield(void)
+//---------------------------------------------------------------------------------------
+{
+}
+
+//---------------------------------------------------------------------------------------
+void delay(unsigned long ms)
+//---------------------------------------------------------------------------------------
+{
+  uint64_t end;
+
+  hostCharge();
+  end = simCycles + (uint64_t) ms * (F_CPU / 1000);
+  while (simCycles < end) {
+    yield();
+    hostCharge();
+    if (simCycles < end) simAdvance(end - simCycles < YIELD_CYCLES ? end - simCycles : YIELD_CYCLES);
+  }
+}
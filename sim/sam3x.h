@@ -0,0 +1,287 @@
+// Host model of the SAM3X8E peripherals used by the POV Cylinder (virtual POV rig)
+//
+// Registers are objects whose read/write accesses are routed into a cycle based
+// simulation (see sam3x.cpp). Modelled are:
+//   - TC0 with counter CV, RA/RB capture from the IR sensor on TIOA and RC compare
+//   - DMAC transmit channels with the byte times of the SPI/USART clocks,
+//     single buffer or linked list (descriptor fetch if CTRLB.SRC_DSCR is 0)
+//   - NVIC dispatch of TC1_Handler and DMAC_Handler while the main program calls delay() or
+//     accesses a register
+// All other peripherals (PIO, PMC, ...) only store the written values.
+#ifndef SAM3X_H
+#define SAM3X_H
+
+#include <stdint.h>
+
+#define F_CPU 84000000L
+
+class SimReg;
+uint32_t simRegRead(SimReg *reg);
+void     simRegWrite(SimReg *reg, uint32_t value);
+
+//!< one peripheral register
+class SimReg
+{
+    public:
+        uint32_t value;
+        operator uint32_t() { return simRegRead(this); }
+        SimReg & operator=(uint32_t v)  { simRegWrite(this, v); return *this; }
+        SimReg & operator|=(uint32_t v) { simRegWrite(this, simRegRead(this) | v); return *this; }
+        SimReg & operator&=(uint32_t v) { simRegWrite(this, simRegRead(this) & v); return *this; }
+};
+
+/*
+ *  Timer Counter
+ */
+typedef struct {
+    SimReg TC_CCR, TC_CMR, TC_SMMR, Reserved1, TC_CV, TC_RA, TC_RB, TC_RC,
+           TC_SR, TC_IER, TC_IDR, TC_IMR, Reserved2[4];
+} TcChannel;
+
+typedef struct {
+    TcChannel TC_CHANNEL[3];
+    SimReg    TC_BCR, TC_BMR;
+} Tc;
+
+#define TC_CCR_CLKEN            (0x1u << 0)
+#define TC_CCR_CLKDIS           (0x1u << 1)
+#define TC_CCR_SWTRG            (0x1u << 2)
+#define TC_CMR_TCCLKS_Msk       (0x7u << 0)
+#define TC_CMR_TCCLKS_TIMER_CLOCK1 (0x0u << 0)   // MCK/2
+#define TC_CMR_TCCLKS_TIMER_CLOCK2 (0x1u << 0)   // MCK/8
+#define TC_CMR_TCCLKS_TIMER_CLOCK3 (0x2u << 0)   // MCK/32
+#define TC_CMR_TCCLKS_TIMER_CLOCK4 (0x3u << 0)   // MCK/128
+#define TC_CMR_TCCLKS_TIMER_CLOCK5 (0x4u << 0)   // SLCK
+#define TC_CMR_BURST_NONE       (0x0u << 4)
+#define TC_CMR_ETRGEDG_NONE     (0x0u << 8)
+#define TC_CMR_ABETRG           (0x1u << 10)
+#define TC_CMR_CPCTRG           (0x1u << 14)
+#define TC_CMR_WAVE             (0x1u << 15)
+#define TC_CMR_LDRA_Pos         16
+#define TC_CMR_LDRA_RISING      (0x1u << 16)
+#define TC_CMR_LDRA_FALLING     (0x2u << 16)
+#define TC_CMR_LDRA_EDGE        (0x3u << 16)
+#define TC_CMR_LDRB_Pos         18
+#define TC_CMR_LDRB_RISING      (0x1u << 18)
+#define TC_CMR_LDRB_FALLING     (0x2u << 18)
+#define TC_CMR_LDRB_EDGE        (0x3u << 18)
+#define TC_SR_COVFS             (0x1u << 0)
+#define TC_SR_LOVRS             (0x1u << 1)
+#define TC_SR_CPAS              (0x1u << 2)
+#define TC_SR_CPBS              (0x1u << 3)
+#define TC_SR_CPCS              (0x1u << 4)
+#define TC_SR_LDRAS             (0x1u << 5)
+#define TC_SR_LDRBS             (0x1u << 6)
+#define TC_SR_ETRGS             (0x1u << 7)
+#define TC_SR_CLKSTA            (0x1u << 16)
+#define TC_IER_COVFS            TC_SR_COVFS
+#define TC_IER_LOVRS            TC_SR_LOVRS
+#define TC_IER_CPCS             TC_SR_CPCS
+#define TC_IER_LDRAS            TC_SR_LDRAS
+#define TC_IER_LDRBS            TC_SR_LDRBS
+#define TC_IDR_CPCS             TC_SR_CPCS
+#define TC_IDR_LDRAS            TC_SR_LDRAS
+
+void TC_Configure(Tc *pTc, uint32_t channel, uint32_t mode);
+void TC_Start(Tc *pTc, uint32_t channel);
+void TC_Stop(Tc *pTc, uint32_t channel);
+
+/*
+ *  DMA Controller
+ */
+typedef struct {
+    SimReg DMAC_SADDR, DMAC_DADDR, DMAC_DSCR, DMAC_CTRLA, DMAC_CTRLB,
+           DMAC_CFG, DMAC_SPIP, DMAC_DPIP, Reserved[2];
+} DmacCh_num;
+
+#define DMACCH_NUM_NUMBER 6
+
+typedef struct {
+    SimReg DMAC_GCFG, DMAC_EN, DMAC_SREQ, DMAC_CREQ, DMAC_LAST, Reserved1,
+           DMAC_EBCIER, DMAC_EBCIDR, DMAC_EBCIMR, DMAC_EBCISR,
+           DMAC_CHER, DMAC_CHDR, DMAC_CHSR, Reserved2[2];
+    DmacCh_num DMAC_CH_NUM[DMACCH_NUM_NUMBER];
+} Dmac;
+
+#define DMAC_GCFG_ARB_CFG_FIXED         (0x0u << 4)
+#define DMAC_GCFG_ARB_CFG_ROUND_ROBIN   (0x1u << 4)
+#define DMAC_EN_ENABLE                  (0x1u << 0)
+#define DMAC_EBCIER_BTC0                (0x1u << 0)
+#define DMAC_EBCIER_CBTC0               (0x1u << 8)
+#define DMAC_EBCIER_ERR0                (0x1u << 16)
+#define DMAC_EBCIDR_CBTC0               (0x1u << 8)
+#define DMAC_EBCISR_BTC0                (0x1u << 0)
+#define DMAC_EBCISR_CBTC0               (0x1u << 8)
+#define DMAC_CHER_ENA0                  (0x1u << 0)
+#define DMAC_CHDR_DIS0                  (0x1u << 0)
+#define DMAC_CHSR_ENA0                  (0x1u << 0)
+#define DMAC_CTRLA_BTSIZE_Msk           (0xffffu << 0)
+#define DMAC_CTRLA_BTSIZE(value)        ((DMAC_CTRLA_BTSIZE_Msk & ((value) << 0)))
+#define DMAC_CTRLA_SRC_WIDTH_BYTE       (0x0u << 24)
+#define DMAC_CTRLA_DST_WIDTH_BYTE       (0x0u << 28)
+#define DMAC_CTRLA_DONE                 (0x1u << 31)
+#define DMAC_CTRLB_SRC_DSCR             (0x1u << 16)
+#define DMAC_CTRLB_DST_DSCR             (0x1u << 20)
+#define DMAC_CTRLB_FC_MEM2PER_DMA_FC    (0x1u << 21)
+#define DMAC_CTRLB_SRC_INCR_INCREMENTING (0x0u << 24)
+#define DMAC_CTRLB_SRC_INCR_FIXED       (0x2u << 24)
+#define DMAC_CTRLB_DST_INCR_FIXED       (0x2u << 28)
+#define DMAC_CFG_DST_PER(value)         ((0xfu << 4) & ((value) << 4))
+#define DMAC_CFG_DST_H2SEL              (0x1u << 13)
+#define DMAC_CFG_SOD                    (0x1u << 16)
+#define DMAC_CFG_FIFOCFG_ALAP_CFG       (0x0u << 28)
+
+/*
+ *  SPI
+ */
+typedef struct {
+    SimReg SPI_CR, SPI_MR, SPI_RDR, SPI_TDR, SPI_SR, SPI_IER, SPI_IDR, SPI_IMR,
+           Reserved1[4], SPI_CSR[4], Reserved2[41], SPI_WPMR, SPI_WPSR;
+} Spi;
+
+#define SPI_CR_SPIEN            (0x1u << 0)
+#define SPI_CR_SPIDIS           (0x1u << 1)
+#define SPI_CR_SWRST            (0x1u << 7)
+#define SPI_MR_MSTR             (0x1u << 0)
+#define SPI_MR_MODFDIS          (0x1u << 4)
+#define SPI_PCS(npcs)           ((~(1 << (npcs)) & 0xF) << 16)
+#define SPI_SR_RDRF             (0x1u << 0)
+#define SPI_SR_TDRE             (0x1u << 1)
+#define SPI_SR_TXEMPTY          (0x1u << 9)
+#define SPI_CSR_CPOL            (0x1u << 0)
+#define SPI_CSR_NCPHA           (0x1u << 1)
+#define SPI_CSR_CSNAAT          (0x1u << 2)
+#define SPI_CSR_CSAAT           (0x1u << 3)
+#define SPI_CSR_BITS_8_BIT      (0x0u << 4)
+#define SPI_CSR_SCBR_Pos        8
+#define SPI_CSR_SCBR_Msk        (0xffu << SPI_CSR_SCBR_Pos)
+#define SPI_CSR_SCBR(value)     ((0xffu << 8) & ((value) << 8))
+#define SPI_CSR_DLYBS(value)    ((0xffu & ((value))) << 16)
+#define SPI_CSR_DLYBCT(value)   ((0xffu & ((value))) << 24)
+
+/*
+ *  USART
+ */
+typedef struct {
+    SimReg US_CR, US_MR, US_IER, US_IDR, US_IMR, US_CSR, US_RHR, US_THR,
+           US_BRGR, US_RTOR, US_TTGR;
+} Usart;
+
+#define US_CR_RSTRX             (0x1u << 2)
+#define US_CR_RSTTX             (0x1u << 3)
+#define US_CR_RXEN              (0x1u << 4)
+#define US_CR_RXDIS             (0x1u << 5)
+#define US_CR_TXEN              (0x1u << 6)
+#define US_CR_TXDIS             (0x1u << 7)
+#define US_MR_USART_MODE_NORMAL     (0x0u << 0)
+#define US_MR_USART_MODE_SPI_MASTER (0xEu << 0)
+#define US_MR_USCLKS_MCK        (0x0u << 4)
+#define US_MR_CHRL_8_BIT        (0x3u << 6)
+#define US_MR_PAR_NO            (0x4u << 9)
+#define US_MR_NBSTOP_1_BIT      (0x0u << 12)
+#define US_MR_CHMODE_NORMAL     (0x0u << 14)
+#define US_MR_CLKO              (0x1u << 18)
+#define US_MR_OVER              (0x1u << 19)
+#define US_CSR_RXRDY            (0x1u << 0)
+#define US_CSR_TXRDY            (0x1u << 1)
+#define US_BRGR_CD_Pos          0
+#define US_BRGR_CD_Msk          (0xffffu << US_BRGR_CD_Pos)
+#define US_CSR_TXEMPTY          (0x1u << 9)
+
+void     USART_Configure(Usart *usart, uint32_t mode, uint32_t baudrate, uint32_t masterClock);
+void     USART_SetTransmitterEnabled(Usart *usart, uint8_t enabled);
+void     USART_SetReceiverEnabled(Usart *usart, uint8_t enabled);
+uint32_t USART_Write(Usart *usart, uint16_t data, volatile uint32_t timeOut);
+
+/*
+ *  PIO, PMC and NVIC
+ */
+typedef struct {
+    SimReg PIO_PER, PIO_PDR, PIO_PSR, PIO_ABSR;
+} Pio;
+
+typedef enum { PIO_NOT_A_PIN, PIO_PERIPH_A, PIO_PERIPH_B, PIO_INPUT, PIO_OUTPUT_0, PIO_OUTPUT_1 } EPioType;
+
+typedef struct {
+    Pio     *pPort;
+    uint32_t ulPin;
+    uint32_t ulPeripheralId;
+    EPioType ulPinType;
+    uint32_t ulPinConfiguration;
+} PinDescription;
+
+extern const PinDescription g_APinDescription[];
+
+#define PIN_SPI_MOSI  75
+#define PIN_SPI_MISO  74
+#define PIN_SPI_SCK   76
+
+void PIO_SetPeripheral(Pio *pPio, EPioType type, uint32_t mask);
+uint32_t PIO_Configure(Pio *pPio, EPioType type, uint32_t mask, uint32_t attribute);
+
+enum { ID_PIOA = 11, ID_PIOB, ID_PIOC, ID_PIOD, ID_USART0 = 17, ID_USART1, ID_USART2, ID_USART3,
+       ID_SPI0 = 24, ID_TC0 = 27, ID_TC1, ID_TC2, ID_DMAC = 39 };
+uint32_t pmc_enable_periph_clk(uint32_t ul_id);
+
+typedef enum { TC0_IRQn = 27, TC1_IRQn, TC2_IRQn, DMAC_IRQn = 39 } IRQn_Type;
+void NVIC_EnableIRQ(IRQn_Type irq);
+void NVIC_DisableIRQ(IRQn_Type irq);
+void noInterrupts(void);
+void interrupts(void);
+
+// interrupt handlers of the sketch
+void TC1_Handler(void);
+void DMAC_Handler(void);
+
+/*
+ *  Peripheral instances
+ */
+extern Tc    simTc0;
+extern Dmac  simDmac;
+extern Spi   simSpi0;
+extern Usart simUsart0, simUsart1, simUsart3;
+extern Pio   simPioA, simPioB, simPioD;
+
+#define TC0     (&simTc0)
+#define DMAC    (&simDmac)
+#define SPI0    (&simSpi0)
+#define USART0  (&simUsart0)
+#define USART1  (&simUsart1)
+#define USART3  (&simUsart3)
+#define PIOA    (&simPioA)
+#define PIOB    (&simPioB)
+#define PIOD    (&simPioD)
+
+/*
+ *  Simulation control (used by the host programs)
+ */
+#define SIM_NUM_DMA_CHANNELS DMACCH_NUM_NUMBER
+
+typedef struct {
+    uint64_t isrCount;          //!< number of interrupt handler calls
+    uint64_t isrCycles;         //!< MCK cycles spent in interrupt handlers
+    uint64_t isrMaxCycles;      //!< longest interrupt handler call
+    uint64_t indexPulses;       //!< IR index pulses applied to TIOA
+    uint64_t captureOverruns;   //!< RA loaded again before it was read (LOVRS)
+    uint64_t dmaTransfers[SIM_NUM_DMA_CHANNELS];
+    uint64_t dmaBytes[SIM_NUM_DMA_CHANNELS];
+    uint64_t dmaBusyCycles[SIM_NUM_DMA_CHANNELS];
+} SimStats;
+
+extern uint64_t simCycles;          //!< simulated time in MCK cycles
+extern uint32_t simAccessCycles;    //!< cost of one register access
+extern uint32_t simIsrEntryCycles;  //!< interrupt entry plus exit cost
+extern double   simHostScale;       //!< MCK cycles charged per host ns (0 = off)
+extern uint32_t simTcTriggerValue;  //!< CV after a software trigger (0 on hardware)
+extern SimStats simStats;
+//! called when a DMA buffer transfer starts (time: MCK cycle of its first byte)
+extern void   (*simDmaStartHook)(int channel, const uint8_t *src, uint32_t count, uint64_t time);
+
+void simSetIndexPulses(const uint64_t *fallingEdges, long count, uint32_t widthCycles);
+bool simIndexPulsesDone(void);
+void simAdvance(uint64_t cycles);
+bool simInIsr(void);
+void simHostCharge(void);           //!< charges the host time since the last charge (simHostScale)
+void simHostDiscard(void);          //!< drops it (host-only work, or work charged by a model)
+
+#endif
@@ -0,0 +1,13 @@
+// Display hooks of the host simulation of GifDisplay (SIMULATION build).
+// They take the place of the X window viewer of the original CYGWIN simulation;
+// each host program (e.g. gifbench) provides its own implementation.
+#ifndef XWIN_H
+#define XWIN_H
+
+class GifDisplay;
+
+void xAllocateColorMap(int length, const unsigned char *rgb);  //!< palette (RGB) of the picture that has just become current
+void xShowFrameBuffer(GifDisplay *display);                  //!< called by isr_simulation() after the picture swap
+void xWaitRotation(GifDisplay *display);                     //!< one rotation passes while a decoded picture is pending
+
+#endif